@@ -0,0 +1,6825 @@
+/* 
+ * libmresource - library of the file-based resource key allocator
+ *
+ * Copyright (c) 2013-2022  Ramses van Zon
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <error.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <errno.h>
+#include "mresource.h"
+
+/*****************************************************************************/
+
+#define MAX_LINE_LEN  1024  /* maximum number of character per key           */
+#define SIGNAL_CHAR     '!' /* initial character on a line if key is used    */
+#define FREE_CHAR       ' ' /* initial character on a line if key is free    */
+#define DRAIN_CHAR      '~' /* initial character on a line if key is in use,
+                               and gets removed once it is released           */
+#define RETIRED_CHAR    '-' /* initial character on a line if key is removed,
+                               until the file gets compacted                  */
+#define COUNT_CHAR      '#' /* after the signal, starts the count of a key   */
+#define CLAIM_CHAR      '*' /* initial character on a line while a free key is
+                               being claimed without locks (see claim_record) */
+#define NOTIFY_BUF_LEN 4096 /* size of buffer to drain change notifications  */
+#define PENDING_SUFFIX ".pending" /* suffix of the queue of delayed releases */
+#define QUEUE_SUFFIX  ".queue"    /* suffix of the queue of waiting processes  */
+#define QUEUE_STALE  4      /* poll intervals after which a waiter that has
+                               not shown itself is dropped from the queue     */
+#define QUEUE_STALE_MIN 1000 /* milliseconds it is kept at least             */
+#define CURSOR_SUFFIX ".cursor"   /* suffix of the next-fit cursor of a file   */
+#define SOCKET_SUFFIX ".sock"     /* suffix of the socket of a daemon for a file */
+#define ADDRESS_SUFFIX ".addr"    /* suffix of the TCP address of that daemon  */
+#define AGENT_SUFFIX  ".agent"    /* suffix of the socket of an agent on a host */
+#define TCP_PREFIX  "tcp://"      /* start of a FILE that is a daemon's address */
+#define CONNECT_TIMEOUT 3000 /* milliseconds to try to reach a daemon by TCP */
+#define LEASE_SUFFIX  ".leases"   /* suffix of the log of who holds which keys */
+#define STATS_SUFFIX  ".stats"    /* suffix of the log of the costs of calls   */
+#define STATS_VARIABLE "MRESOURCE_STATS" /* environment variable that, unless
+                               empty or "0", has the costs of calls logged    */
+#define NSTATS           4  /* number of costs logged per call               */
+#define SHARD_MAGIC "MRSHARDS\n" /* first line of the manifest of a sharded pool */
+#define LEASE_LOG_LIMIT 65536 /* bytes of lease log beyond which it is compacted */
+#define LEASE_CHECK_INTERVAL 1000 /* milliseconds between looking for expired
+                               leases while waiting for keys                  */
+#define HOST_LEN       256  /* room for a host name, including the '\0'      */
+#define CURSOR_LEN      21  /* bytes in a cursor file: a padded number + '\n' */
+#define INDEX_MAGIC "MRINDEX\n" /* first bytes of an indexed resource file  */
+#define INDEX_VERSION    3  /* layout version of indexed resource files      */
+#define INDEX_MIN_CAP   64  /* minimum capacity of the index of a file       */
+#define SCAN_LOCK_OFFSET ((off_t)1<<62) /* byte beyond any data, locked
+                               shared while scanning with record locks        */
+#define QUEUE_LOCK_OFFSET (SCAN_LOCK_OFFSET+1) /* byte locked while changing
+                               the queue of waiters with record locks         */
+
+/*****************************************************************************/
+
+char mresource_ExitMsg[6][22] = { "", 
+                                  "Could not open file", 
+                                  "Could not find key", 
+                                  "Argument error", 
+                                  "Time-out",
+                                  "Invalid resource file" };
+
+/****************************************************************************/
+
+static void fill_file_lock_controls(struct flock* set_lock, struct flock* unset_lock)
+{
+    /* Fill two 'struct flock's needed for file locking and unlocking */
+
+    pid_t pid = getpid();
+    set_lock->l_type     = F_WRLCK;
+    set_lock->l_whence   = SEEK_SET;
+    set_lock->l_start    = 0;
+    set_lock->l_len      = 0;
+    set_lock->l_pid      = pid; 
+    unset_lock->l_type   = F_UNLCK;
+    unset_lock->l_whence = SEEK_SET;
+    unset_lock->l_start  = 0;
+    unset_lock->l_len    = 0;
+    unset_lock->l_pid    = pid; 
+
+} /* end fill_file_lock_controls(set_lock,unset_lock) */
+
+/****************************************************************************/
+
+static int apply_lock(int fd, struct flock* lock, int wait)
+{
+    /* Set or clear a lock described by 'lock', waiting for it if 'wait' is
+       set. A wait that is interrupted by a signal is resumed. Returns 0 on
+       success and -1 on failure, with errno EAGAIN or EACCES if the lock
+       is held by another process and 'wait' is zero. */
+
+    int     result;
+
+    do
+        result = fcntl(fd, wait? F_SETLKW : F_SETLK, lock);
+    while (result != 0 && errno == EINTR);
+
+    return result;
+
+} /* end apply_lock(fd,lock,wait) */
+
+/****************************************************************************/
+
+static int lock_range(int fd, short type, off_t start, off_t length, int wait)
+{
+    /* Lock (or, with type F_UNLCK, unlock) a byte range of a file. 
+       Returns 0 on success and -1 on failure, as apply_lock. */
+
+    struct flock lock;
+
+    lock.l_type   = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start  = start;
+    lock.l_len    = length;
+    lock.l_pid    = getpid();
+
+    return apply_lock(fd, &lock, wait);
+
+} /* end lock_range(fd,type,start,length,wait) */
+
+/****************************************************************************/
+
+struct IndexHeader {
+    /* Header of an indexed resource file. It is followed by a bitmap of
+       free records, by a table of the file offsets of the records, both
+       with room for 'capacity' records, and by a hash table of the keys
+       with 2*capacity slots that each hold a record number plus one (or 
+       zero if empty). Then come the records in the same text form as in
+       a plain resource file. */
+    char     magic[8];  /* INDEX_MAGIC                                      */
+    uint32_t version;   /* INDEX_VERSION                                    */
+    uint32_t nrecords;  /* number of records in the file                    */
+    uint32_t capacity;  /* room in bitmap and table, a multiple of 64       */
+    uint32_t nfree;     /* number of free records                           */
+    uint32_t hint;      /* bitmap words before this one have no free bits   */
+    uint32_t cursor;    /* record where the next next-fit search starts     */
+    uint32_t nclaimed;  /* number of records claimed by lock-free obtains   */
+    uint64_t body;      /* file offset of the first record                  */
+};
+
+/****************************************************************************/
+
+struct Stats {
+    /* Costs of a single obtain or release, kept only if asked for by the
+       STATS_VARIABLE, to find out where the time of slow calls goes */
+    long   start;       /* milliseconds since the epoch when the call began */
+    long   lockwait;    /* microseconds spent waiting for locks             */
+    long   lockhold;    /* microseconds that locks were held                */
+    long   locked;      /* when the current lock was taken, or 0            */
+    long   scanned;     /* free records looked at when searching            */
+    long   polls;       /* attempts made to obtain                          */
+};
+
+/****************************************************************************/
+
+struct Pool {
+    /* An open resource file. While locked, its contents are mapped into
+       memory (or, failing that, read into a private copy), so records can
+       be scanned without stdio and signal bytes can be flipped in place. */
+    int    fd;          /* file descriptor of the resource file             */
+    char*  filename;    /* name of the resource file                        */
+    char*  data;        /* contents of the file while locked                */
+    size_t size;        /* size of the file while locked                    */
+    int    mapped;      /* whether data is mapped or a private copy         */
+    int    modified;    /* whether records were changed while locked        */
+    struct IndexHeader* index;  /* header if the file is indexed, or NULL   */
+    uint64_t* freebits; /* bitmap of free records of an indexed file        */
+    uint64_t* offsets;  /* file offsets of the records of an indexed file   */
+    uint32_t* keyslots; /* hash table of the keys of an indexed file        */
+    enum Locking locking;  /* how the file is locked                        */
+    char*  require;     /* tags that obtained keys must have, or NULL        */
+    char*  prefer;      /* tags that obtained keys should have, or NULL      */
+    pid_t  owner;       /* process recorded as the holder of obtained keys  */
+    char*  host;        /* host of that process if not this one, or NULL    */
+    long   ttl;         /* milliseconds that obtained keys are leased for    */
+    long   leasecheck;  /* when expired leases were last looked for, or 0   */
+    struct Stats* stats;  /* costs of the current call, or NULL if not kept */
+    struct Cache* cache;  /* keys cached by a node-local agent, or NULL     */
+    int    tier;        /* rank of its FILE among several obtained from     */
+    int    priority;    /* priority of obtains among waiters, higher first  */
+    long   ticket;      /* number in the queue of waiters of the file, or 0 */
+    long   queued;      /* when that ticket was last refreshed              */
+    long   polltime;    /* longest wait between tries while in the queue    */
+    int    reopened;    /* whether the file was replaced and opened anew    */
+    unsigned seed;      /* state of its random choices, kept apart from the
+                           rand() of a program that uses the library        */
+    enum Durability durability; /* when changes are flushed to disk         */
+    int    unsynced;    /* whether changes were made since the last flush   */
+    int    released;    /* whether waiters are to be told at unlock, as the
+                           stores of lock-free mode do not notify them      */
+    struct flock set_lock, unset_lock;
+};
+
+/****************************************************************************/
+
+static size_t index_body_offset(uint32_t capacity)
+{
+    /* File offset of the first record of an indexed file */
+
+    return sizeof(struct IndexHeader) + capacity/8 + capacity*sizeof(uint64_t)
+        + 2*capacity*sizeof(uint32_t);
+
+} /* end index_body_offset(capacity) */
+
+/****************************************************************************/
+
+enum Durability durability_setting(void)
+{
+    /* When changes to resource files are to be flushed to disk by
+       default, as set by the SYNC_VARIABLE; anything but 'data' or
+       'group' means never */
+
+    char*   setting = getenv(SYNC_VARIABLE);
+
+    if (setting != NULL && strcmp(setting, "data") == 0)
+        return SYNC_DATA;
+    else if (setting != NULL && strcmp(setting, "group") == 0)
+        return SYNC_GROUP;
+
+    return SYNC_NONE;
+
+} /* end durability_setting() */
+
+/****************************************************************************/
+
+static int open_pool(struct Pool* pool, char* filename, int flags, enum Locking locking)
+{
+    /* Open a resource file for reading and writing; 'flags' can add e.g.
+       O_CREAT to the flags passed to open(). */
+
+    struct timespec now;
+
+    pool->fd     = open(filename, O_RDWR|flags, 0666);
+    pool->filename = filename;
+    pool->data   = NULL;
+    pool->size   = 0;
+    pool->mapped = 0;
+    pool->modified = 0;
+    pool->index  = NULL;
+    pool->locking = locking;
+    pool->require = NULL;
+    pool->prefer = NULL;
+    pool->owner  = 0;
+    pool->host   = NULL;
+    pool->cache  = NULL;
+    pool->tier   = 0;
+    pool->priority = 0;
+    pool->ticket = 0;
+    pool->queued = 0;
+    pool->polltime = POLL_INTERVAL;
+    pool->ttl    = 0;
+    pool->leasecheck = 0;
+    pool->stats  = NULL;
+    pool->reopened = 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pool->seed   = (unsigned)getpid() ^ (unsigned)now.tv_nsec;
+    pool->durability = SYNC_NONE;
+    pool->unsynced = 0;
+    pool->released = 0;
+
+    if (pool->fd < 0)
+        return FILE_NOT_OPEN;
+
+    fill_file_lock_controls(&pool->set_lock, &pool->unset_lock);
+
+    return NO_ERROR;
+
+} /* end open_pool(pool,filename,flags,locking) */
+
+/****************************************************************************/
+
+static int attach_index(struct Pool* pool)
+{
+    /* Recognize an indexed resource file and check its header */
+
+    struct IndexHeader* index = (struct IndexHeader*)pool->data;
+
+    if (pool->size < sizeof(struct IndexHeader)
+        || memcmp(index->magic, INDEX_MAGIC, sizeof(index->magic)) != 0)
+        return NO_ERROR;  /* a plain resource file */
+
+    if (index->version != INDEX_VERSION
+        || index->capacity % 64 != 0
+        || index->nrecords > index->capacity
+        || index->nfree > index->nrecords
+        || index->body != index_body_offset(index->capacity)
+        || index->body > pool->size)
+        return BAD_FILE;
+
+    pool->index    = index;
+    pool->freebits = (uint64_t*)(pool->data + sizeof(struct IndexHeader));
+    pool->offsets  = pool->freebits + index->capacity/64;
+    pool->keyslots = (uint32_t*)(pool->offsets + index->capacity);
+
+    return NO_ERROR;
+
+} /* end attach_index(pool) */
+
+/****************************************************************************/
+
+static void unmap_pool(struct Pool* pool)
+{
+    /* Unmap the contents of the resource file */
+
+    if (pool->mapped) 
+        munmap(pool->data, pool->size);
+    else
+        free(pool->data);
+
+    pool->data   = NULL;
+    pool->size   = 0;
+    pool->mapped = 0;
+    pool->index  = NULL;
+
+} /* end unmap_pool(pool) */
+
+/****************************************************************************/
+
+static int map_pool(struct Pool* pool)
+{
+    /* Map the current contents of the resource file into memory. A
+       mapping kept from a previous lock is reused if the file still has
+       the same size; changed contents show through a shared mapping. */
+
+    struct stat status;
+    ssize_t     nread;
+    size_t      offset;
+
+    if (fstat(pool->fd, &status) != 0) 
+        return FILE_NOT_OPEN;
+
+    pool->modified = 0;
+    pool->index = NULL;
+
+    if (pool->mapped && pool->size == (size_t)status.st_size)
+        return attach_index(pool);
+
+    unmap_pool(pool);
+
+    pool->size = status.st_size;
+
+    if (pool->size == 0)
+        return NO_ERROR;
+
+    pool->data = mmap(NULL, pool->size, PROT_READ|PROT_WRITE, MAP_SHARED, pool->fd, 0);
+
+    if (pool->data != MAP_FAILED) 
+        pool->mapped = 1;
+    else {
+        /* fall back to a private copy for file systems that cannot map */
+        pool->data = malloc(pool->size);
+        if (pool->data == NULL) {
+            pool->size = 0;
+            return FILE_NOT_OPEN;
+        }
+        for (offset = 0; offset < pool->size; offset += nread) {
+            nread = pread(pool->fd, pool->data + offset, pool->size - offset, offset);
+            if (nread <= 0) {
+                pool->size = offset;
+                break;
+            }
+        }
+    }
+
+    return attach_index(pool);
+
+} /* end map_pool(pool) */
+
+
+/****************************************************************************/
+
+static long current_usec()
+{
+    /* Microseconds on the monotonic clock, for measuring lock waits */
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long)now.tv_sec*1000000 + now.tv_nsec/1000;
+
+} /* end current_usec() */
+
+/****************************************************************************/
+
+static void count_lock_wait(struct Pool* pool, long start, int locked)
+{
+    /* If the costs of the current call are kept, add the time since 
+       'start' to its lock wait and, if the lock was 'locked', start 
+       timing how long it is held */
+
+    long    now;
+
+    if (pool->stats == NULL)
+        return;
+
+    now = current_usec();
+    pool->stats->lockwait += now - start;
+    if (locked)
+        pool->stats->locked = now;
+
+} /* end count_lock_wait(pool,start,locked) */
+
+/****************************************************************************/
+
+static int lock_failure(struct Pool* pool, int wait)
+{
+    /* Exit code for a lock on the resource file that could not be taken:
+       TIME_OUT if another process holds it and 'wait' was not set, and
+       otherwise, as when the system refuses the lock, FILE_NOT_OPEN. */
+
+    if (!wait && (errno == EAGAIN || errno == EACCES))
+        return TIME_OUT;
+
+    error(0, errno, "Could not lock '%s'", pool->filename);
+
+    return FILE_NOT_OPEN;
+
+} /* end lock_failure(pool,wait) */
+
+/****************************************************************************/
+
+static int reopen_replaced_pool(struct Pool* pool)
+{
+    /* If the resource file has been replaced by another one under its 
+       name since the pool was opened (as compaction does), drop the 
+       locks on and mapping of the old one, and open the new one. Returns
+       whether this happened, or -1 if the new one cannot be opened. */
+
+    struct stat opened;
+    struct stat named;
+    int     fd;
+
+    if (fstat(pool->fd, &opened) != 0 || stat(pool->filename, &named) != 0
+        || (opened.st_ino == named.st_ino && opened.st_dev == named.st_dev))
+        return 0;
+
+    fd = open(pool->filename, O_RDWR);
+
+    if (fd < 0)
+        return -1;
+
+    /* closing the old file also drops our locks on it */
+    unmap_pool(pool);
+    close(pool->fd);
+    pool->fd = fd;
+    pool->reopened = 1;
+    if (pool->stats != NULL)
+        pool->stats->locked = 0;
+
+    return 1;
+
+} /* end reopen_replaced_pool(pool) */
+
+/****************************************************************************/
+
+static int acquire_pool(struct Pool* pool, int wait)
+{
+    /* Lock the resource file and map its current contents into memory.
+       With record locking, only a shared lock on a byte beyond the data is
+       taken. It keeps out operations that lock the whole file, such as
+       appends, but not other processes that use record locking; those 
+       write-lock each record before changing it (see claim_record). The
+       same goes for lock-free claims, which swap signals instead (and only
+       try the record lock). 
+       Unless 'wait' is set, TIME_OUT is returned if another process holds
+       the lock (see lock_failure for other failures). If the file got 
+       replaced while waiting for the lock, the new one is opened and
+       locked instead. */
+
+    int     exitcode;
+    int     failed;
+    int     replaced;
+    long    start = (pool->stats != NULL)? current_usec() : 0;
+
+    if (pool->locking != LOCK_FILE) {
+
+        failed = (lock_range(pool->fd, F_RDLCK, SCAN_LOCK_OFFSET, 1, wait) != 0);
+        count_lock_wait(pool, start, !failed);
+        if (failed)
+            return lock_failure(pool, wait);
+        replaced = reopen_replaced_pool(pool);
+        if (replaced != 0)
+            return replaced > 0? acquire_pool(pool, wait) : FILE_NOT_OPEN;
+        exitcode = map_pool(pool);
+
+        if (exitcode != NO_ERROR || pool->mapped || pool->size == 0)
+            return exitcode;
+
+        /* records can only be claimed safely in a shared mapping */
+        unmap_pool(pool);
+        lock_range(pool->fd, F_UNLCK, SCAN_LOCK_OFFSET, 1, 1);
+        pool->locking = LOCK_FILE;
+        start = (pool->stats != NULL)? current_usec() : 0;
+
+    }
+
+    failed = (apply_lock(pool->fd, &pool->set_lock, wait) != 0);
+    count_lock_wait(pool, start, !failed);
+    if (failed)
+        return lock_failure(pool, wait);
+    replaced = reopen_replaced_pool(pool);
+    if (replaced != 0)
+        return replaced > 0? acquire_pool(pool, wait) : FILE_NOT_OPEN;
+
+    return map_pool(pool);
+
+} /* end acquire_pool(pool,wait) */
+
+/****************************************************************************/
+
+static int lock_pool(struct Pool* pool)
+{
+    /* Lock the resource file, waiting for the lock if needed, and map its
+       current contents into memory (see acquire_pool) */
+
+    return acquire_pool(pool, 1);
+
+} /* end lock_pool(pool) */
+
+/****************************************************************************/
+
+static void write_back(struct Pool* pool, void* address, size_t length)
+{
+    /* Write a modified part of the contents to the file, which is only
+       needed when they are a private copy rather than mapped */
+
+    char* start = address;
+
+    pool->modified = 1;
+    pool->unsynced = 1;
+
+    if (!pool->mapped
+        && pwrite(pool->fd, start, length, start - pool->data) != (ssize_t)length)
+        error(0, 0, "Could not write to resource file.");
+
+} /* end write_back(pool,address,length) */
+
+/****************************************************************************/
+
+static uint32_t record_number(struct Pool* pool, char* record)
+{
+    /* Position of a record in the offset table of an indexed file */
+
+    uint64_t offset = record - pool->data;
+    uint32_t low = 0;
+    uint32_t high = pool->index->nrecords; 
+    uint32_t middle;
+
+    while (high - low > 1) {
+        middle = low + (high - low)/2;
+        if (pool->offsets[middle] <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    return low;
+
+} /* end record_number(pool,record) */
+
+/****************************************************************************/
+
+static void update_index(struct Pool* pool, char* record, int isfree)
+{
+    /* Keep the bitmap and free count of an indexed file up to date when
+       a record becomes free or used. With record locking, other processes
+       may update other bits of the index at the same time, hence the 
+       atomic operations. */
+
+    struct IndexHeader* index = pool->index;
+    uint32_t number = record_number(pool, record);
+    uint32_t hint;
+    uint64_t bit = (uint64_t)1 << (number%64);
+
+    if (!isfree) {
+        __atomic_fetch_and(pool->freebits + number/64, ~bit, __ATOMIC_SEQ_CST);
+        __atomic_fetch_sub(&index->nfree, 1, __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_fetch_or(pool->freebits + number/64, bit, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&index->nfree, 1, __ATOMIC_SEQ_CST);
+        hint = __atomic_load_n(&index->hint, __ATOMIC_SEQ_CST);
+        while (number/64 < hint 
+               && !__atomic_compare_exchange_n(&index->hint, &hint, number/64, 0,
+                                               __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            ;
+    }
+
+    write_back(pool, pool->freebits + number/64, sizeof(uint64_t));
+    write_back(pool, index, sizeof(struct IndexHeader));
+
+} /* end update_index(pool,record,isfree) */
+
+/****************************************************************************/
+
+static int swaps_signal(struct Pool* pool, char* record)
+{
+    /* Whether a record is claimed and released by swapping its signal
+       atomically, rather than under a lock: in lock-free mode, except for
+       counted records, whose COUNT field a swap of the signal does not
+       guard; those are write-locked as with record locking. */
+
+    return pool->locking == LOCK_ATOMIC
+        && !(record[1] == COUNT_CHAR && record[2] >= '0' && record[2] <= '9');
+
+} /* end swaps_signal(pool,record) */
+
+/****************************************************************************/
+
+static int locks_record(struct Pool* pool, char* record)
+{
+    /* Whether a record is write-locked before it gets changed */
+
+    return pool->locking == LOCK_RECORDS
+        || (pool->locking == LOCK_ATOMIC && !swaps_signal(pool, record));
+
+} /* end locks_record(pool,record) */
+
+/****************************************************************************/
+
+static void count_claims(struct Pool* pool, int change)
+{
+    /* Keep the number of records claimed by lock-free obtains in the
+       header of an indexed file up to date (see count_claimed_records) */
+
+    __atomic_fetch_add(&pool->index->nclaimed, change, __ATOMIC_SEQ_CST);
+    write_back(pool, pool->index, sizeof(struct IndexHeader));
+
+} /* end count_claims(pool,change) */
+
+/****************************************************************************/
+
+static void set_signal(struct Pool* pool, char* record, char signal)
+{
+    /* Set the allocation signal of the record starting at 'record'. In an
+       indexed file, a record's bit is set before it is marked free, and
+       cleared after it is marked used, so that processes that scan the
+       bitmap with record locking never miss a free record (they check
+       the signal itself when claiming). */
+
+    int wasfree    = (*record == FREE_CHAR);
+    int isfree     = (signal == FREE_CHAR);
+    int wasclaimed = (*record == CLAIM_CHAR);
+
+    if (pool->index != NULL && isfree && !wasfree)
+        update_index(pool, record, isfree);
+
+    if (swaps_signal(pool, record)) {
+        /* only the claimed record is ours to change (see claim_record) */
+        __atomic_store_n(record, signal, __ATOMIC_SEQ_CST);
+        write_back(pool, record, 1);
+    } else if (locks_record(pool, record)) {
+        /* a write (rather than a store) also notifies any waiters */
+        pool->unsynced = 1;
+        if (pwrite(pool->fd, &signal, 1, record - pool->data) != 1)
+            error(0, 0, "Could not write to resource file.");
+    } else {
+        *record = signal;
+        write_back(pool, record, 1);
+    }
+
+    if (pool->index != NULL && wasfree && !isfree)
+        update_index(pool, record, isfree);
+
+    if (pool->index != NULL && wasclaimed)
+        count_claims(pool, -1);
+
+} /* end set_signal(pool,record,signal) */
+
+/****************************************************************************/
+
+static int swap_signal(struct Pool* pool, char* record, char expected, char signal)
+{
+    /* In lock-free mode, change the signal of a record from 'expected' to
+       'signal' in one atomic compare-and-swap in the shared mapping, so
+       that of processes doing so at the same time, only one succeeds. As
+       with set_signal, the bit of an indexed file is set before a record
+       is marked free, and cleared after it is marked used. If the swap
+       fails, the free count is put back, but not the bit, as another
+       process may have freed the record meanwhile; a bit left over is
+       skipped by claimers, which check the signal (see next_free_record).
+       Likewise, a claim is counted before it is made, and uncounted once
+       it is over. Returns whether the record had the 'expected' signal. */
+
+    int indexed  = (pool->index != NULL);
+    int tofree   = (indexed && expected != FREE_CHAR && signal == FREE_CHAR);
+    int fromfree = (indexed && expected == FREE_CHAR && signal != FREE_CHAR);
+    int toclaim  = (indexed && signal == CLAIM_CHAR);
+
+    if (tofree)
+        update_index(pool, record, 1);
+    if (toclaim)
+        count_claims(pool, 1);
+
+    if (!__atomic_compare_exchange_n(record, &expected, signal, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        if (tofree) {
+            __atomic_fetch_sub(&pool->index->nfree, 1, __ATOMIC_SEQ_CST);
+            write_back(pool, pool->index, sizeof(struct IndexHeader));
+        }
+        if (toclaim)
+            count_claims(pool, -1);
+        return 0;
+    }
+
+    write_back(pool, record, 1);
+
+    if (fromfree)
+        update_index(pool, record, 0);
+    if (indexed && expected == CLAIM_CHAR)
+        count_claims(pool, -1);
+
+    return 1;
+
+} /* end swap_signal(pool,record,expected,signal) */
+
+/****************************************************************************/
+
+static void sync_pool(struct Pool* pool)
+{
+    /* Flush the changes made to the resource file to disk: the stores
+       into its mapping, and then its data. One flush of a file covers
+       the changes of all processes, so a process that flushes after
+       another one often finds little left to write. */
+
+    pool->unsynced = 0;
+
+    if (pool->mapped && msync(pool->data, pool->size, MS_SYNC) != 0)
+        error(0, 0, "Could not flush resource file.");
+
+    if (fdatasync(pool->fd) != 0)
+        error(0, 0, "Could not flush resource file.");
+
+} /* end sync_pool(pool) */
+
+/****************************************************************************/
+
+static void unlock_pool(struct Pool* pool)
+{
+    /* Unlock the resource file. Its mapping is kept for the next lock, 
+       but a private copy is dropped, as it would go stale. Changes are
+       flushed to disk before or after unlocking, as their durability
+       asks, so that the operation only completes once they are there. */
+
+    if (pool->unsynced && pool->durability == SYNC_DATA)
+        sync_pool(pool);
+
+    if (pool->mapped) {
+        /* Stores into a mapping do not trigger change notifications, so
+           rewrite the first byte to announce the modification to waiters;
+           without locks, that byte may be claimed meanwhile, so the time
+           stamps of the file announce released records (or a change in
+           the queue of waiters) instead */
+        if (pool->modified && pool->locking == LOCK_FILE
+            && pwrite(pool->fd, pool->data, 1, 0) != 1)
+            error(0, 0, "Could not write to resource file.");
+        if (pool->released)
+            futimens(pool->fd, NULL);
+        pool->modified = 0;
+        pool->released = 0;
+    } else
+        unmap_pool(pool);
+
+    if (pool->locking != LOCK_FILE)
+        lock_range(pool->fd, F_UNLCK, SCAN_LOCK_OFFSET, 1, 1);
+    else
+        apply_lock(pool->fd, &pool->unset_lock, 0);
+
+    if (pool->stats != NULL && pool->stats->locked != 0) {
+        pool->stats->lockhold += current_usec() - pool->stats->locked;
+        pool->stats->locked = 0;
+    }
+
+    /* flushing outside the lock lets others work meanwhile, and processes
+       that flush at the same time share one commit of the file system */
+    if (pool->unsynced && pool->durability == SYNC_GROUP)
+        sync_pool(pool);
+
+} /* end unlock_pool(pool) */
+
+/****************************************************************************/
+
+static int claim_record(struct Pool* pool, char* record, char expected, int wait)
+{
+    /* With record locking, write-lock the signal byte of a record, and 
+       check that it still holds the 'expected' signal; if not, the lock
+       is dropped again; an 'expected' signal of '\0' matches any. Returns
+       whether the record may be changed. Without record locking, the 
+       whole file is locked already. In lock-free mode, the 'expected'
+       signal (which has to be given) is swapped for CLAIM_CHAR, which no
+       other process changes; release_record swaps signals by itself. The
+       signal byte is write-locked along, without waiting, so that a claim
+       fails rather than clash with a process that uses record locking. */
+
+    off_t offset = record - pool->data;
+
+    if (swaps_signal(pool, record)) {
+        if (*(volatile char*)record != expected
+            || lock_range(pool->fd, F_WRLCK, offset, 1, 0) != 0)
+            return 0;
+        if (swap_signal(pool, record, expected, CLAIM_CHAR))
+            return 1;
+        lock_range(pool->fd, F_UNLCK, offset, 1, 0);
+        return 0;
+    }
+
+    if (!locks_record(pool, record))
+        return 1;
+
+    if (lock_range(pool->fd, F_WRLCK, offset, 1, wait) != 0)
+        return 0;
+
+    if (expected != '\0' && *(volatile char*)record != expected) {
+        lock_range(pool->fd, F_UNLCK, offset, 1, 0);
+        return 0;
+    }
+
+    return 1;
+
+} /* end claim_record(pool,record,expected,wait) */
+
+/****************************************************************************/
+
+static void unclaim_record(struct Pool* pool, char* record)
+{
+    /* Drop the write lock on a claimed record; in lock-free mode, make
+       it free again first, unless it has been used (see use_record) */
+
+    if (swaps_signal(pool, record))
+        swap_signal(pool, record, CLAIM_CHAR, FREE_CHAR);
+
+    if (swaps_signal(pool, record) || locks_record(pool, record))
+        lock_range(pool->fd, F_UNLCK, record - pool->data, 1, 0);
+
+} /* end unclaim_record(pool,record) */
+
+/****************************************************************************/
+
+static void close_pool(struct Pool* pool)
+{
+    /* Close a resource file */
+
+    unmap_pool(pool);
+    close(pool->fd);
+    pool->fd = -1;
+
+} /* end close_pool(pool) */
+
+/****************************************************************************/
+
+static char* next_record(struct Pool* pool, char* record)
+{
+    /* Start of the record after 'record', or NULL if there is none. Only
+       records terminated by a newline count. */
+
+    char* end = pool->data + pool->size;
+    char* newline = memchr(record, '\n', end - record);
+
+    return (newline && newline + 1 < end)? newline + 1 : NULL;
+
+} /* end next_record(pool,record) */
+
+/****************************************************************************/
+
+static char* first_record(struct Pool* pool)
+{
+    /* Start of the first complete record, or NULL if there is none */
+
+    if (pool->index != NULL)
+        return pool->index->nrecords? pool->data + pool->offsets[0] : NULL;
+
+    if (pool->size == 0 || memchr(pool->data, '\n', pool->size) == NULL)
+        return NULL;
+
+    return pool->data;
+
+} /* end first_record(pool) */
+
+/****************************************************************************/
+
+static char* next_indexed_free_record(struct Pool* pool, char* record)
+{
+    /* Find the first free record at or after 'record' in an indexed file
+       from its bitmap, skipping the words that the hint says are full. */
+
+    struct IndexHeader* index = pool->index;
+    uint32_t number = record_number(pool, record);
+    uint32_t word = number/64;
+    uint32_t nwords = (index->nrecords + 63)/64;
+    uint64_t bits;
+    int      fromhint = 0;
+
+    if (index->nfree == 0)
+        return NULL;
+
+    if (word < index->hint) {
+        word = index->hint;
+        number = word*64;
+    }
+    /* only raise the hint while no other process can clear bits */
+    fromhint = (word == index->hint && number%64 == 0 && pool->locking == LOCK_FILE);
+
+    for (bits = word < nwords ? pool->freebits[word] & (~(uint64_t)0 << (number%64)) : 0; 
+         bits == 0 && ++word < nwords;
+         bits = pool->freebits[word])
+        ;
+
+    if (fromhint && word > index->hint) {
+        /* all words skipped from the hint on are full */
+        index->hint = word < nwords ? word : nwords;
+        write_back(pool, index, sizeof(struct IndexHeader));
+    }
+
+    if (word >= nwords)
+        return NULL;
+
+    number = word*64;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        number++;
+    }
+
+    return number < index->nrecords? pool->data + pool->offsets[number] : NULL;
+
+} /* end next_indexed_free_record(pool,record) */
+
+/****************************************************************************/
+
+static char* next_free_record(struct Pool* pool, char* record)
+{
+    /* Find the first free record at or after 'record'. Rather than going
+       line by line, this searches for the FREE_CHAR that starts a line, 
+       so runs of used records are skipped by a single memchr. Returns 
+       NULL if there is none. */
+
+    char*    end = pool->data + pool->size;
+    char*    found = record;
+    uint32_t number;
+
+    if (record == NULL)
+        return NULL;
+
+    if (pool->index != NULL) {
+        found = next_indexed_free_record(pool, record);
+        /* a lock-free release that lost its swap may leave the bit of a
+           record that is not free (see swap_signal); as no swap is in
+           flight under a whole-file lock, it gets cleared then */
+        while (found != NULL && *(volatile char*)found != FREE_CHAR) {
+            number = record_number(pool, found);
+            if (pool->locking == LOCK_FILE) {
+                pool->freebits[number/64] &= ~((uint64_t)1 << (number%64));
+                write_back(pool, pool->freebits + number/64, sizeof(uint64_t));
+            }
+            found = (number + 1 < pool->index->nrecords)?
+                    next_indexed_free_record(pool, pool->data + pool->offsets[number+1]) : NULL;
+        }
+        return found;
+    }
+
+    if (*record != FREE_CHAR) {
+        do {
+            found = memchr(found + 1, FREE_CHAR, end - found - 1);
+        } while (found != NULL && found[-1] != '\n');
+        if (found == NULL)
+            return NULL;
+    }
+
+    /* an unterminated record at the end of the file does not count */
+    if (memchr(found, '\n', end - found) == NULL)
+        return NULL;
+
+    return found;
+
+} /* end next_free_record(pool,record) */
+
+/****************************************************************************/
+
+static uint32_t count_records(struct Pool* pool, uint32_t atmost)
+{
+    /* Number of records in the file, but counting no further than 'atmost' */
+
+    uint32_t count = 0;
+    char*    record;
+
+    if (pool->index != NULL)
+        return pool->index->nrecords < atmost? pool->index->nrecords : atmost;
+
+    for (record = first_record(pool); 
+         record != NULL && count < atmost; 
+         record = next_record(pool, record))
+        count++;
+
+    return count;
+
+} /* end count_records(pool,atmost) */
+
+/****************************************************************************/
+
+static char* record_key(char* record)
+{
+    /* Start of the key of a complete record. That is right after the
+       signal, except in a counted record, where the signal is followed
+       by a field "#COUNT/CAPACITY " (see record_count). */
+
+    char* field = record + 1;
+    char* digit = field + 1;
+
+    if (*field != COUNT_CHAR || *digit < '0' || *digit > '9')
+        return field;
+    while (*digit >= '0' && *digit <= '9')
+        digit++;
+    if (*digit++ != '/' || *digit < '0' || *digit > '9')
+        return field;
+    while (*digit >= '0' && *digit <= '9')
+        digit++;
+
+    return (*digit == ' ')? digit + 1 : field;
+
+} /* end record_key(record) */
+
+/****************************************************************************/
+
+static char* tags_start(char* key, char* end)
+{
+    /* Start of the tags after a key on a line that ends at 'end', i.e.,
+       the space before the first following word that contains a '=', or
+       'end' if there are no tags. The first word always is part of the
+       key, and so are other words without a '='. */
+
+    char* space;
+    char* word;
+
+    for (space = memchr(key, ' ', end - key); 
+         space != NULL; 
+         space = memchr(space + 1, ' ', end - space - 1)) {
+        for (word = space + 1; word < end && *word != ' ' && *word != '='; word++)
+            ;
+        if (word < end && *word == '=')
+            return space;
+    }
+
+    return end;
+
+} /* end tags_start(key,end) */
+
+/****************************************************************************/
+
+static size_t argument_key_length(char* argument, unsigned long* capacity)
+{
+    /* Length of the key in a key argument to '-c' or '-a', which may be 
+       followed by ':N' for a counted key and then by tags. The capacity
+       N, or 1 if not given, is put in 'capacity'. */
+
+    char*  tags = tags_start(argument, argument + strlen(argument));
+    char*  colon;
+    char*  end;
+
+    *capacity = 1;
+
+    for (colon = tags; colon > argument && *colon != ':'; colon--)
+        ;
+
+    if (*colon == ':' && colon[1] >= '0' && colon[1] <= '9') {
+        *capacity = strtoul(colon + 1, &end, 10);
+        if (end == tags && *capacity >= 1)
+            return colon - argument;
+        *capacity = 1;
+    }
+
+    return tags - argument;
+
+} /* end argument_key_length(argument,capacity) */
+
+/****************************************************************************/
+
+static size_t key_length(struct Pool* pool, char* record)
+{
+    /* Length of the key of a complete record, without its tags */
+
+    char* key = record_key(record);
+
+    return tags_start(key, memchr(key, '\n', pool->data + pool->size - key)) - key;
+
+} /* end key_length(pool,record) */
+
+/****************************************************************************/
+
+static int record_has_tags(struct Pool* pool, char* record, char* tags)
+{
+    /* Whether a complete record has all of 'tags', a comma-separated list
+       of NAME=VALUE words (which, if NULL, any record has) */
+
+    char*  key = record_key(record);
+    char*  end = memchr(key, '\n', pool->data + pool->size - key);
+    char*  word;
+    size_t length;
+    size_t wordlength;
+    int    found;
+
+    if (tags == NULL)
+        return 1;
+
+    for (; *tags != '\0'; tags += length + (tags[length] == ',')) {
+        length = strcspn(tags, ",");
+        if (length == 0)
+            continue;
+        found = 0;
+        for (word = tags_start(key, end); word < end && !found; word += wordlength) {
+            while (word < end && *word == ' ')
+                word++;
+            for (wordlength = 0; word + wordlength < end && word[wordlength] != ' '; wordlength++)
+                ;
+            found = (wordlength == length && memcmp(word, tags, length) == 0);
+        }
+        if (!found)
+            return 0;
+    }
+
+    return 1;
+
+} /* end record_has_tags(pool,record,tags) */
+
+/****************************************************************************/
+
+static uint32_t count_tagged_records(struct Pool* pool, char* tags, uint32_t atmost)
+{
+    /* Number of records with all of 'tags' (see record_has_tags), but
+       counting no further than 'atmost'. Records that are removed, or
+       that are to be removed once released, do not count. */
+
+    uint32_t count = 0;
+    char*    record;
+
+    for (record = first_record(pool); 
+         record != NULL && count < atmost; 
+         record = next_record(pool, record))
+        if (*record != RETIRED_CHAR && *record != DRAIN_CHAR
+            && memchr(record, '\n', pool->data + pool->size - record) != NULL
+            && record_has_tags(pool, record, tags))
+            count++;
+
+    return count;
+
+} /* end count_tagged_records(pool,tags,atmost) */
+
+/****************************************************************************/
+
+static int record_count(char* record, unsigned long* count, unsigned long* capacity)
+{
+    /* Whether a record is counted, i.e., its key can be obtained up to
+       'capacity' times at once; if so, 'count' is how often it is now.
+       The COUNT field has a fixed width, so that it can be changed in
+       place. The signal of a counted record shows whether it is full. */
+
+    char* slash;
+
+    if (record_key(record) == record + 1)
+        return 0;
+
+    *count = strtoul(record + 2, &slash, 10);
+    *capacity = strtoul(slash + 1, NULL, 10);
+
+    return 1;
+
+} /* end record_count(record,count,capacity) */
+
+/****************************************************************************/
+
+static int record_in_use(char* record)
+{
+    /* Whether a record, counted or not, is obtained at least once */
+
+    unsigned long count;
+    unsigned long capacity;
+
+    if (record_count(record, &count, &capacity))
+        return count > 0;
+
+    return *record == SIGNAL_CHAR || *record == DRAIN_CHAR;
+
+} /* end record_in_use(record) */
+
+/****************************************************************************/
+
+static double record_load(char* record)
+{
+    /* Fraction of the capacity of a record that is in use */
+
+    unsigned long count;
+    unsigned long capacity;
+
+    if (record_count(record, &count, &capacity))
+        return (double)count/capacity;
+
+    return *record == SIGNAL_CHAR? 1.0 : 0.0;
+
+} /* end record_load(record) */
+
+/****************************************************************************/
+
+static void set_count(struct Pool* pool, char* record, unsigned long count)
+{
+    /* Change the COUNT field of a claimed counted record */
+
+    char*  field = record + 2;
+    size_t width = strchr(field, '/') - field;
+    char   text[24];
+
+    snprintf(text, sizeof(text), "%0*lu", (int)width, count);
+
+    if (locks_record(pool, record)) {
+        pool->unsynced = 1;
+        if (pwrite(pool->fd, text, width, field - pool->data) != (ssize_t)width)
+            error(0, 0, "Could not write to resource file.");
+    } else {
+        memcpy(field, text, width);
+        write_back(pool, field, width);
+    }
+
+} /* end set_count(pool,record,count) */
+
+/****************************************************************************/
+
+static void use_record(struct Pool* pool, char* record)
+{
+    /* Mark one more use of a claimed record that has room for it */
+
+    unsigned long count;
+    unsigned long capacity;
+
+    if (!record_count(record, &count, &capacity)) 
+        set_signal(pool, record, SIGNAL_CHAR);
+    else {
+        set_count(pool, record, count + 1);
+        if (count + 1 >= capacity)
+            set_signal(pool, record, SIGNAL_CHAR);
+    }
+
+} /* end use_record(pool,record) */
+
+/****************************************************************************/
+
+static int release_record(struct Pool* pool, char* record)
+{
+    /* Undo one use of a record, if it is in use; returns whether it was.
+       A record that is being removed (see retire_record) gets removed 
+       once it is not in use anymore, instead of becoming free. */
+
+    unsigned long count;
+    unsigned long capacity;
+    int      inuse = 0;
+
+    if (swaps_signal(pool, record)) {
+        /* the swap checks that the record is in use by itself */
+        inuse = swap_signal(pool, record, SIGNAL_CHAR, FREE_CHAR)
+                || swap_signal(pool, record, DRAIN_CHAR, RETIRED_CHAR);
+        pool->released |= inuse;
+        return inuse;
+    }
+
+    if (record_in_use(record) && claim_record(pool, record, '\0', 1)) {
+        /* check again, now that nobody else can change the record */
+        inuse = record_in_use(record);
+        if (inuse && record_count(record, &count, &capacity))
+            set_count(pool, record, count - 1);
+        if (inuse && *record == SIGNAL_CHAR)
+            set_signal(pool, record, FREE_CHAR);
+        else if (inuse && *record == DRAIN_CHAR 
+                 && (!record_count(record, &count, &capacity) || count == 0))
+            set_signal(pool, record, RETIRED_CHAR);
+        unclaim_record(pool, record);
+    }
+
+    return inuse;
+
+} /* end release_record(pool,record) */
+
+/****************************************************************************/
+
+static uint32_t key_slot(char* key, size_t length, uint32_t nslots)
+{
+    /* Home slot of a key in a hash table with 'nslots' slots (FNV-1a) */
+
+    uint64_t hash = 14695981039346656037ULL;
+    size_t   i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash % nslots;
+
+} /* end key_slot(key,length,nslots) */
+
+/****************************************************************************/
+
+static void insert_key(uint32_t* keyslots, uint32_t nslots, char* key, size_t length, uint32_t number)
+{
+    /* Enter record 'number', with the given key, in a hash table of keys.
+       Keys that occur more than once get a slot for every record. */
+
+    uint32_t slot;
+
+    for (slot = key_slot(key, length, nslots); 
+         keyslots[slot] != 0; 
+         slot = (slot + 1) % nslots)
+        ;
+
+    keyslots[slot] = number + 1;
+
+} /* end insert_key(keyslots,nslots,key,length,number) */
+
+/****************************************************************************/
+
+static char* companion_filename(char* filename, char* suffix)
+{
+    /* Name of a file kept next to the resource file (to be freed) */
+
+    char* name = malloc(strlen(filename) + strlen(suffix) + 1);
+
+    strcpy(name, filename);
+    strcat(name, suffix);
+
+    return name;
+
+} /* end companion_filename(filename,suffix) */
+
+/****************************************************************************/
+
+static char* record_at(struct Pool* pool, uint64_t offset)
+{
+    /* Start of the first complete record at or after file offset 'offset',
+       or NULL if there is none */
+
+    uint32_t number;
+    char*    record;
+
+    if (pool->index != NULL) {
+        if (pool->index->nrecords == 0)
+            return NULL;
+        if (offset <= pool->offsets[0])
+            return pool->data + pool->offsets[0];
+        if (offset >= pool->size)
+            return NULL;
+        number = record_number(pool, pool->data + offset);
+        if (pool->offsets[number] < offset)
+            number++;
+        return number < pool->index->nrecords? pool->data + pool->offsets[number] : NULL;
+    }
+
+    if (offset == 0)
+        return first_record(pool);
+
+    if (offset >= pool->size)
+        return NULL;
+
+    record = pool->data + offset;
+
+    if (record[-1] != '\n')
+        return next_record(pool, record);
+
+    return memchr(record, '\n', pool->size - offset)? record : NULL;
+
+} /* end record_at(pool,offset) */
+
+/****************************************************************************/
+
+static char* random_record(struct Pool* pool)
+{
+    /* A record picked at random. In an indexed file, all records are
+       equally likely. A plain file is not counted first; instead, the
+       record is picked by a random byte of the file, which favours records
+       that follow long keys, but that is fine for spreading the load. */
+
+    double   fraction = (double)rand_r(&pool->seed)/((double)RAND_MAX+1.0);
+    char*    record;
+
+    if (pool->index != NULL)
+        return pool->index->nrecords? 
+            pool->data + pool->offsets[(uint32_t)(fraction*pool->index->nrecords)] : NULL;
+
+    record = record_at(pool, (uint64_t)(fraction*pool->size));
+
+    return record? record : first_record(pool);
+
+} /* end random_record(pool) */
+
+/****************************************************************************/
+
+static char* cursor_record(struct Pool* pool)
+{
+    /* The record where the previous next-fit search left off, or the first
+       record if there was none. An indexed file keeps the record number in
+       its header; a plain file keeps the offset in FILE.cursor. Either is
+       just a hint, so it is read without any further locking. */
+
+    char*    cursorname;
+    char     text[CURSOR_LEN+1];
+    int      fd;
+    ssize_t  nread = 0;
+    uint32_t number;
+    char*    record = NULL;
+
+    if (pool->index != NULL) {
+        number = __atomic_load_n(&pool->index->cursor, __ATOMIC_RELAXED);
+        if (number < pool->index->nrecords)
+            record = pool->data + pool->offsets[number];
+    } else {
+        cursorname = companion_filename(pool->filename, CURSOR_SUFFIX);
+        fd = open(cursorname, O_RDONLY);
+        if (fd >= 0) {
+            nread = pread(fd, text, CURSOR_LEN, 0);
+            close(fd);
+        }
+        if (nread > 0) {
+            text[nread] = '\0';
+            record = record_at(pool, strtoull(text, NULL, 10));
+        }
+        free(cursorname);
+    }
+
+    return record? record : first_record(pool);
+
+} /* end cursor_record(pool) */
+
+/****************************************************************************/
+
+static void move_cursor(struct Pool* pool, char* record)
+{
+    /* Let the next next-fit search start at 'record', or at the first
+       record if 'record' is NULL. The cursor file always gets a number
+       of the same width, so that a single write replaces it entirely. */
+
+    char*    cursorname;
+    char     text[CURSOR_LEN+1];
+    int      fd;
+
+    if (pool->index != NULL) {
+        __atomic_store_n(&pool->index->cursor, 
+                         record? record_number(pool, record) : 0, __ATOMIC_RELAXED);
+        write_back(pool, pool->index, sizeof(struct IndexHeader));
+    } else {
+        cursorname = companion_filename(pool->filename, CURSOR_SUFFIX);
+        fd = open(cursorname, O_WRONLY|O_CREAT, 0666);
+        snprintf(text, sizeof(text), "%*llu\n", CURSOR_LEN-1,
+                 (unsigned long long)(record? record - pool->data : 0));
+        if (fd < 0 || pwrite(fd, text, CURSOR_LEN, 0) != CURSOR_LEN)
+            error(0, 0, "Could not write to '%s'.", cursorname);
+        if (fd >= 0)
+            close(fd);
+        free(cursorname);
+    }
+
+} /* end move_cursor(pool,record) */
+
+/****************************************************************************/
+
+static int open_change_notifier(int nfiles, char** filenames)
+{
+    /* Set up a watch for modifications of resource files, including their
+       replacement by another file (which unlinks them). Returns a file
+       descriptor to wait on, or -1 if notification is not available, in
+       which case waiters simply fall back to polling. */
+
+    int notifier = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    int i;
+
+    for (i = 0; i < nfiles && notifier >= 0; i++)
+        if (inotify_add_watch(notifier, filenames[i], IN_MODIFY|IN_ATTRIB|IN_DELETE_SELF|IN_MOVE_SELF) < 0) {
+            close(notifier);
+            notifier = -1;
+        }
+
+    return notifier;
+
+} /* end open_change_notifier(nfiles,filenames) */
+
+/****************************************************************************/
+
+static void drain_change_notifier(int notifier)
+{
+    /* Discard pending notifications. Called while holding the file lock,
+       so any modification they announce is already visible in the file. */
+
+    char buffer[NOTIFY_BUF_LEN];
+
+    if (notifier >= 0) 
+        while (read(notifier, buffer, sizeof(buffer)) > 0) 
+            ;
+
+} /* end drain_change_notifier(notifier) */
+
+/****************************************************************************/
+
+static long current_msec()
+{
+    /* Milliseconds on the monotonic clock, for computing deadlines */
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long)now.tv_sec*1000 + now.tv_nsec/1000000;
+
+} /* end current_msec() */
+
+/****************************************************************************/
+
+static long current_epoch_msec()
+{
+    /* Milliseconds since the epoch, for release times that other processes,
+       possibly on other hosts, have to honour */
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (long)now.tv_sec*1000 + now.tv_nsec/1000000;
+
+} /* end current_epoch_msec() */
+
+/****************************************************************************/
+
+static void sleep_msec(long msec)
+{
+    /* Sleep for 'msec' milliseconds, resuming after signal interruptions */
+
+    struct timespec remaining;
+
+    remaining.tv_sec  = msec/1000;
+    remaining.tv_nsec = (msec%1000)*1000000;
+
+    while (nanosleep(&remaining, &remaining) != 0) 
+        ;
+
+} /* end sleep_msec(msec) */
+
+/****************************************************************************/
+
+static long next_waittime(long polltime, long maxpolltime, int attempt, unsigned* seed)
+{
+    /* Time to wait before attempt number 'attempt+1'. Without backoff
+       (maxpolltime<=polltime) this is just polltime.  With backoff, the 
+       wait doubles with each attempt up to maxpolltime, and a random
+       jitter, drawn with 'seed', spreads it over [wait/2,wait]. */
+
+    long waittime = polltime;
+
+    if (maxpolltime <= polltime)
+        return polltime;
+
+    while (attempt-- > 0 && waittime < maxpolltime)
+        waittime *= 2;
+
+    if (waittime > maxpolltime)
+        waittime = maxpolltime;
+
+    return waittime/2 + (long)((double)rand_r(seed)/((double)RAND_MAX+1.0)*(waittime - waittime/2)) + 1;
+
+} /* end next_waittime(polltime,maxpolltime,attempt,seed) */
+
+/****************************************************************************/
+
+static void wait_for_change(int notifier, long waittime)
+{
+    /* Wait for the resource file to be modified, but no longer than
+       'waittime' milliseconds. Without a notifier, just sleep. */
+
+    struct pollfd pfd;
+
+    if (notifier >= 0) {
+        pfd.fd     = notifier;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, waittime>INT_MAX?INT_MAX:(int)waittime);
+    } else
+        sleep_msec(waittime);
+
+} /* end wait_for_change(notifier,waittime) */
+
+/****************************************************************************/
+
+static void host_name(char* name)
+{
+    /* Name of this host, as recorded in leases, in 'name' of HOST_LEN */
+
+    if (gethostname(name, HOST_LEN) != 0)
+        strcpy(name, "localhost");
+    name[HOST_LEN-1] = '\0';
+
+} /* end host_name(name) */
+
+/****************************************************************************/
+
+static void owner_host(struct Pool* pool, char* name)
+{
+    /* Host of the owner of a pool, as recorded in leases, in 'name' of 
+       HOST_LEN: the host of a client it acts for, or else this one */
+
+    if (pool->host != NULL)
+        snprintf(name, HOST_LEN, "%s", pool->host);
+    else
+        host_name(name);
+
+} /* end owner_host(pool,name) */
+
+/****************************************************************************/
+
+static void append_log(char* filename, char* suffix, char* text, size_t length, enum Durability durability)
+{
+    /* Append lines to a log of a resource file, such as its lease log
+       FILE.leases. This happens in a single write to a file opened for
+       appending, so that processes that only share the scan lock, or no
+       lock at all, do not mix up their lines. The lines are flushed to
+       disk if the 'durability' of changes asks for that. */
+
+    char*  logname = companion_filename(filename, suffix);
+    int    fd = open(logname, O_WRONLY|O_APPEND|O_CREAT, 0666);
+
+    if (fd >= 0) {
+        if (write(fd, text, length) != (ssize_t)length
+            || (durability != SYNC_NONE && fdatasync(fd) != 0))
+            error(0, 0, "Could not write '%s'.", logname);
+        close(fd);
+    }
+
+    free(logname);
+
+} /* end append_log(filename,suffix,text,length,durability) */
+
+/****************************************************************************/
+
+static int close_synced(FILE* stream, enum Durability durability)
+{
+    /* Close a companion file of a resource file that was written through
+       'stream', such as its pending releases or its queue, after flushing
+       it to disk if the 'durability' of changes asks for that. Returns 0
+       on success and -1 if the file could not be written. */
+
+    int    failed = 0;
+
+    if (durability != SYNC_NONE)
+        failed = fflush(stream) != 0 || fdatasync(fileno(stream)) != 0;
+
+    return (fclose(stream) != 0 || failed)? -1 : 0;
+
+} /* end close_synced(stream,durability) */
+
+/****************************************************************************/
+
+static char* temporary_filename(char* filename)
+{
+    /* Newly allocated name FILE.PID.tmp, under which a file that is to
+       replace FILE gets written before it is renamed */
+
+    char*   tempname = malloc(strlen(filename) + 32);
+
+    sprintf(tempname, "%s.%ld.tmp", filename, (long)getpid());
+
+    return tempname;
+
+} /* end temporary_filename(filename) */
+
+/****************************************************************************/
+
+static int write_replacement(char* filename, char* contents, size_t size, char* tempname, enum Durability durability)
+{
+    /* Write 'contents' to 'tempname', a file that is to replace the file
+       'filename' (see temporary_filename), with the permissions of that
+       file, and flushed to disk if the 'durability' of changes asks for 
+       that. Returns the open temporary file, or -1 if it could not be 
+       written, in which case it is removed. */
+
+    int     fd = open(tempname, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    struct stat status;
+
+    if (fd < 0)
+        return -1;
+
+    if (stat(filename, &status) == 0)
+        fchmod(fd, status.st_mode & 07777);
+
+    if (write(fd, contents, size) != (ssize_t)size
+        || (durability != SYNC_NONE && fdatasync(fd) != 0)) {
+        close(fd);
+        unlink(tempname);
+        return -1;
+    }
+
+    return fd;
+
+} /* end write_replacement(filename,contents,size,tempname,durability) */
+
+/****************************************************************************/
+
+static int replace_file(char* filename, char* contents, size_t size, enum Durability durability)
+{
+    /* Write 'contents' to a file under a temporary name, and rename it to
+       'filename', so that the file it replaces is replaced as a whole.
+       The new file keeps the permissions of the old one, and is written
+       as durably as 'durability' asks. */
+
+    char*   tempname = temporary_filename(filename);
+    int     fd = write_replacement(filename, contents, size, tempname, durability);
+    int     exitcode = NO_ERROR;
+
+    if (fd < 0)
+        exitcode = FILE_NOT_OPEN;
+    else if (close(fd) != 0 || rename(tempname, filename) != 0) {
+        unlink(tempname);
+        exitcode = FILE_NOT_OPEN;
+    }
+
+    free(tempname);
+
+    return exitcode;
+
+} /* end replace_file(filename,contents,size,durability) */
+
+/****************************************************************************/
+
+struct Lease {
+    /* a use of a key held by a process, according to the lease log */
+    char*  key;         /* the key, or NULL once the use is released         */
+    pid_t  owner;       /* process holding it                                */
+    char   host[HOST_LEN]; /* host the owner runs on                         */
+    long   start;       /* epoch milliseconds at which the lease (re)started */
+    long   ttl;         /* milliseconds the lease lasts, or 0 for no limit   */
+};
+
+/****************************************************************************/
+
+static int find_lease(struct Lease* leases, int nleases, char* key, pid_t owner, char* host, int strict)
+{
+    /* Index of the first lease of 'key' held by 'owner' on 'host', or,
+       unless 'strict' is set, of the first lease of 'key' at all, or -1.
+       Process ids are only unique on one host, so both have to match. */
+
+    int     i;
+    int     any = -1;
+
+    for (i = 0; i < nleases; i++) 
+        if (leases[i].key != NULL && strcmp(leases[i].key, key) == 0) {
+            if (leases[i].owner == owner && strcmp(leases[i].host, host) == 0)
+                return i;
+            if (any < 0)
+                any = i;
+        }
+
+    return strict? -1 : any;
+
+} /* end find_lease(leases,nleases,key,owner,host,strict) */
+
+/****************************************************************************/
+
+static int read_leases(char* filename, struct Lease** leases)
+{
+    /* Replay the lease log of a resource file to find the leases still
+       held. The log is a text file with lines
+         + OWNER HOST START TTL KEY   for an obtained use of KEY,
+         - OWNER HOST KEY             for a released one, and
+         * OWNER HOST START TTL KEY   for renewed leases of KEY by OWNER;
+       a release ends a lease of the same owner on the same host if there
+       is one, and the
+       oldest lease of the key otherwise, while keys that are released by 
+       other means than mresource do not leave a line at all. The leases
+       (to be freed with free_leases) are put in 'leases', in the order in
+       which they were obtained. Returns their number. */
+
+    FILE*   log;
+    char*   leasename = companion_filename(filename, LEASE_SUFFIX);
+    char    line[MAX_LINE_LEN+HOST_LEN+64];
+    char    host[HOST_LEN];
+    long    owner;
+    long    start;
+    long    ttl;
+    size_t  length;
+    int     nleases = 0;
+    int     maxleases = 0;
+    int     skip;
+    int     i;
+    int     j;
+
+    *leases = NULL;
+    log = fopen(leasename, "r");
+
+    if (log != NULL) {
+
+        while (fgets(line, sizeof(line), log) != NULL) {
+            length = strlen(line);
+            if (length > 0 && line[length-1] == '\n')
+                line[length-1] = '\0';
+            skip = 0;
+            if (line[0] == '+' 
+                && sscanf(line, "+ %ld %255s %ld %ld %n", &owner, host, &start, &ttl, &skip) == 4
+                && skip > 0) {
+                if (nleases == maxleases) {
+                    maxleases = maxleases?2*maxleases:64;
+                    *leases = realloc(*leases, maxleases*sizeof(struct Lease));
+                }
+                (*leases)[nleases].key   = strdup(line + skip);
+                (*leases)[nleases].owner = (pid_t)owner;
+                strcpy((*leases)[nleases].host, host);
+                (*leases)[nleases].start = start;
+                (*leases)[nleases].ttl   = ttl;
+                nleases++;
+            } else if (line[0] == '-' 
+                       && sscanf(line, "- %ld %255s %n", &owner, host, &skip) == 2
+                       && skip > 0) {
+                i = find_lease(*leases, nleases, line + skip, (pid_t)owner, host, 0);
+                if (i >= 0) {
+                    free((*leases)[i].key);
+                    (*leases)[i].key = NULL;
+                }
+            } else if (line[0] == '*' 
+                       && sscanf(line, "* %ld %255s %ld %ld %n", &owner, host, &start, &ttl, &skip) == 4
+                       && skip > 0) {
+                for (i = 0; i < nleases; i++) 
+                    if ((*leases)[i].key != NULL && (*leases)[i].owner == (pid_t)owner
+                        && strcmp((*leases)[i].host, host) == 0
+                        && strcmp((*leases)[i].key, line + skip) == 0) {
+                        (*leases)[i].start = start;
+                        if (ttl > 0)
+                            (*leases)[i].ttl = ttl;
+                    }
+            }
+        }
+
+        fclose(log);
+    }
+
+    free(leasename);
+
+    /* drop the released leases */
+    for (i = j = 0; i < nleases; i++)
+        if ((*leases)[i].key != NULL)
+            (*leases)[j++] = (*leases)[i];
+
+    return j;
+
+} /* end read_leases(filename,leases) */
+
+/****************************************************************************/
+
+static void free_leases(struct Lease* leases, int nleases)
+{
+    /* Free the leases read by read_leases */
+
+    int     i;
+
+    for (i = 0; i < nleases; i++)
+        free(leases[i].key);
+    free(leases);
+
+} /* end free_leases(leases,nleases) */
+
+/****************************************************************************/
+
+enum KeyStatus {
+    /* progress of a key that is to be released */
+    KEY_PENDING = 0, /* not encountered in the file yet                      */
+    KEY_UNUSED,      /* only encountered as an unused record                 */
+    KEY_RELEASED,    /* a used record with this key was found and released   */
+    KEY_RECLAIMED    /* not released, as it is leased to others only, the
+                        lease of the releasing owner having been reclaimed  */
+};
+
+/****************************************************************************/
+
+static enum KeyStatus unmark_indexed_resource(struct Pool* pool, char* key, size_t length)
+{
+    /* Unmark one used record with 'key' in a locked indexed file, found
+       through the hash table of keys rather than by scanning the file */
+
+    uint32_t nslots = 2*pool->index->capacity;
+    uint32_t slot;
+    char*    record;
+    enum KeyStatus status = KEY_PENDING;
+
+    if (nslots == 0)
+        return status;
+
+    for (slot = key_slot(key, length, nslots); 
+         pool->keyslots[slot] != 0; 
+         slot = (slot + 1) % nslots) {
+        record = pool->data + pool->offsets[pool->keyslots[slot] - 1];
+        if (key_length(pool, record) == length 
+            && memcmp(record_key(record), key, length) == 0) {
+            if (release_record(pool, record))
+                return KEY_RELEASED;
+            status = KEY_UNUSED;
+        }
+    }
+
+    return status;
+
+} /* end unmark_indexed_resource(pool,key,length) */
+
+/****************************************************************************/
+
+static int unmark_resources(struct Pool* pool, int nkeys, char** keys)
+{
+    /* Unmark 'keys' in a locked resource file, in a single pass through 
+       the file, or by hash lookups if the file is indexed. Each key 
+       releases one use of a record, so a key that was obtained several
+       times, or that is counted, can be released as often. The releases
+       are added to the lease log. If the pool has an owner, the keys are
+       checked against its leases first: a key that has leases, but none
+       of the owner on its host, was reclaimed from it and may now be held
+       by another process, so it is left alone, and NOT_FOUND is returned. */
+
+    struct Lease* leases = NULL;
+    char    host[HOST_LEN];
+    char*   record;
+    size_t  length;
+    char*   log;
+    size_t  loglength;
+    FILE*   out;
+    int     exitcode;
+    int     nreleased = 0;
+    int     nleases = 0;
+    int     i;
+    int     j;
+    size_t* keylength = malloc(nkeys*sizeof(size_t));
+    enum KeyStatus* status = calloc(nkeys, sizeof(enum KeyStatus));
+
+    owner_host(pool, host);
+
+    if (pool->owner != 0)
+        nleases = read_leases(pool->filename, &leases);
+
+    for (i = 0; i < nkeys; i++) {
+        keylength[i] = strlen(keys[i]);
+        if (nleases == 0)
+            continue;
+        j = find_lease(leases, nleases, keys[i], pool->owner, host, 1);
+        if (j >= 0) {
+            /* a key released twice ends two leases */
+            free(leases[j].key);
+            leases[j].key = NULL;
+        } else if (find_lease(leases, nleases, keys[i], pool->owner, host, 0) >= 0) {
+            error(0, 0, "Key '%s' is no longer leased to %ld; not releasing it.", 
+                  keys[i], (long)pool->owner);
+            status[i] = KEY_RECLAIMED;
+            nreleased++;
+        }
+    }
+
+    if (pool->index != NULL) 
+        for (i = 0; i < nkeys; i++)
+            if (status[i] != KEY_RECLAIMED)
+                status[i] = unmark_indexed_resource(pool, keys[i], keylength[i]);
+
+    for (record = first_record(pool); 
+         record != NULL && pool->index == NULL && nreleased < nkeys; 
+         record = next_record(pool, record)) {
+        length = key_length(pool, record);
+        for (i = 0; i < nkeys; i++) {
+            if (status[i] != KEY_RELEASED && status[i] != KEY_RECLAIMED
+                && keylength[i] == length 
+                && memcmp(record_key(record), keys[i], length) == 0) {
+                /* a counted record may take more than one of the keys */
+                if (release_record(pool, record)) {
+                    status[i] = KEY_RELEASED;
+                    nreleased++;
+                } else
+                    status[i] = KEY_UNUSED;
+            }
+        }
+    }
+
+    exitcode = NO_ERROR;
+    out = open_memstream(&log, &loglength);
+    for (i = 0; i < nkeys; i++) 
+        if (status[i] == KEY_PENDING || status[i] == KEY_RECLAIMED)
+            exitcode = NOT_FOUND;
+        else if (status[i] == KEY_RELEASED)
+            fprintf(out, "- %ld %s %s\n", (long)pool->owner, host, keys[i]);
+    fclose(out);
+
+    if (loglength > 0)
+        append_log(pool->filename, LEASE_SUFFIX, log, loglength, pool->durability);
+    free(log);
+
+    free(status);
+    free(keylength);
+    free_leases(leases, nleases);
+
+    return exitcode;
+
+} /* end unmark_resources(pool,nkeys,keys) */
+
+
+/****************************************************************************/
+
+static int queue_resources(char* filename, int nkeys, char** keys, long delay, pid_t owner, char* host, enum Durability durability)
+{
+    /* Add 'keys' to the queue of pending releases of the resource file,
+       to be released after 'delay' milliseconds, by 'owner' on 'host'.
+       The queue is a text file with a release time, an owner, its host
+       and a key on each line, protected by the lock on the resource file,
+       and written as durably as its changes ('durability'). */
+
+    struct Pool pool;
+    FILE*   pending;
+    char*   pendingname;
+    int     exitcode;
+    int     i;
+    long    release_time = current_epoch_msec() + delay;
+
+    exitcode = open_pool(&pool, filename, 0, LOCK_FILE);
+
+    if (exitcode == NO_ERROR && apply_lock(pool.fd, &pool.set_lock, 1) != 0) {
+        exitcode = lock_failure(&pool, 1);
+        close_pool(&pool);
+    } else if (exitcode == NO_ERROR) {
+
+        pendingname = companion_filename(filename, PENDING_SUFFIX);
+        pending = fopen(pendingname, "a");
+
+        if (pending != NULL) {
+            for (i = 0; i < nkeys; i++)
+                fprintf(pending, "%ld %ld %s %s\n", release_time, (long)owner, host, keys[i]);
+            if (close_synced(pending, durability) != 0) {
+                error(0, 0, "Could not write '%s'.", pendingname);
+                exitcode = FILE_NOT_OPEN;
+            }
+        } else
+            exitcode = FILE_NOT_OPEN;
+
+        free(pendingname);
+
+        apply_lock(pool.fd, &pool.unset_lock, 0);
+        close_pool(&pool);
+
+    }
+
+    return exitcode;
+
+} /* end queue_resources(filename,nkeys,keys,delay,owner,host,durability) */
+
+/****************************************************************************/
+
+static long apply_pending_releases(struct Pool* pool, char* filename)
+{
+    /* Release the keys in the pending release queue whose release time has
+       passed, in one pass through the locked resource file for each owner
+       (and its host) that queued them. Returns the earliest release time
+       still in the queue, or 0 if the queue is empty. */
+
+    FILE*   pending;
+    char*   pendingname = companion_filename(filename, PENDING_SUFFIX);
+    char    line[MAX_LINE_LEN+HOST_LEN+64];
+    char*   key;
+    char*   host;
+    char*   rest;
+    char*   poolhost = pool->host;
+    long    release_time;
+    long    releaser;
+    long    now = current_epoch_msec();
+    long    next_release = 0;
+    size_t  length;
+    pid_t   owner = pool->owner;
+    int     nlines = 0;
+    int     maxlines = 0;
+    int     nexpired = 0;
+    int     ngroup;
+    int     i;
+    int     j;
+    char**  lines = NULL;
+    char**  expired = NULL;
+    char**  group = NULL;
+    long*   times = NULL;
+    long*   owners = NULL;
+    char**  hosts = NULL;
+
+    pending = fopen(pendingname, "r+");
+
+    if (pending != NULL) {
+
+        while (fgets(line, sizeof(line), pending) != NULL) {
+            length = strlen(line);
+            if (length > 0 && line[length-1] == '\n')
+                line[length-1] = '\0';
+            release_time = strtol(line, &rest, 10);
+            if (*rest == ' ')
+                releaser = strtol(rest, &host, 10);
+            if (*rest != ' ' || *host != ' ' 
+                || (key = strchr(host + 1, ' ')) == NULL || key == host + 1)
+                continue;      /* skip malformed lines */
+            if (nlines == maxlines) {
+                maxlines = maxlines?2*maxlines:64;
+                lines   = realloc(lines, maxlines*sizeof(char*));
+                expired = realloc(expired, maxlines*sizeof(char*));
+                group   = realloc(group, maxlines*sizeof(char*));
+                times   = realloc(times, maxlines*sizeof(long));
+                owners  = realloc(owners, maxlines*sizeof(long));
+                hosts   = realloc(hosts, maxlines*sizeof(char*));
+            }
+            lines[nlines] = strdup(line);
+            times[nlines] = release_time;
+            if (release_time <= now) {
+                owners[nexpired] = releaser;
+                hosts[nexpired] = strndup(host + 1, key - (host + 1));
+                expired[nexpired++] = lines[nlines] + (key + 1 - line);
+            } else if (next_release == 0 || release_time < next_release)
+                next_release = release_time;
+            nlines++;
+        }
+
+        if (nexpired > 0) {
+
+            /* each owner releases its own keys (see unmark_resources) */
+            for (i = 0; i < nexpired; i++) {
+                if (owners[i] < 0)
+                    continue;  /* released with those of an earlier line */
+                for (j = i, ngroup = 0; j < nexpired; j++)
+                    if (owners[j] == owners[i] && strcmp(hosts[j], hosts[i]) == 0) {
+                        group[ngroup++] = expired[j];
+                        if (j > i)
+                            owners[j] = -1;
+                    }
+                pool->owner = (pid_t)owners[i];
+                pool->host  = hosts[i];
+                unmark_resources(pool, ngroup, group);
+            }
+            pool->owner = owner;
+            pool->host  = poolhost;
+
+            if (nexpired < nlines) {
+                fseek(pending, 0, SEEK_SET);
+                for (i = 0; i < nlines; i++) 
+                    if (times[i] > now)
+                        fprintf(pending, "%s\n", lines[i]);
+                fflush(pending);
+                if (ftruncate(fileno(pending), ftell(pending)) != 0)
+                    error(0, 0, "Could not truncate '%s'.", pendingname);
+            } else
+                unlink(pendingname);
+        }
+
+        if (close_synced(pending, nexpired > 0? pool->durability : SYNC_NONE) != 0)
+            error(0, 0, "Could not write '%s'.", pendingname);
+
+        for (i = 0; i < nlines; i++)
+            free(lines[i]);
+        for (i = 0; i < nexpired; i++)
+            free(hosts[i]);
+        free(lines);
+        free(expired);
+        free(group);
+        free(times);
+        free(owners);
+        free(hosts);
+    }
+
+    free(pendingname);
+
+    return next_release;
+
+} /* end apply_pending_releases(pool,filename) */
+
+/****************************************************************************/
+
+static long earliest_pending_release(char* filename)
+{
+    /* Earliest release time in the pending release queue, or 0 if there
+       is none. This reads the queue without a lock, so the answer is only
+       a hint as to whether the queue needs to be applied. */
+
+    FILE*   pending;
+    char*   pendingname = companion_filename(filename, PENDING_SUFFIX);
+    char    line[MAX_LINE_LEN+32];
+    long    release_time;
+    long    earliest = 0;
+
+    pending = fopen(pendingname, "r");
+
+    if (pending != NULL) {
+        while (fgets(line, sizeof(line), pending) != NULL) {
+            release_time = strtol(line, NULL, 10);
+            if (release_time > 0 && (earliest == 0 || release_time < earliest))
+                earliest = release_time;
+        }
+        fclose(pending);
+    }
+
+    free(pendingname);
+
+    return earliest;
+
+} /* end earliest_pending_release(filename) */
+
+/****************************************************************************/
+
+static int settle_pending_releases(struct Pool* pool, char* filename, long* next_release)
+{
+    /* Apply the expired pending releases of a locked pool, and set
+       'next_release' to the earliest release time that remains in the
+       queue (or 0). With record locking, the queue can only be rewritten
+       while holding the lock on the whole file, so the lock is switched
+       temporarily, but only when some queued release has actually 
+       expired. Returns the exit code of taking the lock of the pool back
+       (see lock_pool); if that fails, the pool is not locked. */
+
+    enum Locking locking = pool->locking;
+
+    if (locking == LOCK_FILE) {
+        *next_release = apply_pending_releases(pool, filename);
+        return NO_ERROR;
+    }
+
+    *next_release = earliest_pending_release(filename);
+
+    if (*next_release == 0 || *next_release > current_epoch_msec())
+        return NO_ERROR;
+
+    unlock_pool(pool);
+    pool->locking = LOCK_FILE;
+    *next_release = 0;
+    if (lock_pool(pool) == NO_ERROR)
+        *next_release = apply_pending_releases(pool, filename);
+    unlock_pool(pool);
+    pool->locking = locking;
+
+    return lock_pool(pool);
+
+} /* end settle_pending_releases(pool,filename,next_release) */
+
+/****************************************************************************/
+
+static int lease_expired(struct Lease* lease, char* host, long now)
+{
+    /* Whether a lease has run out, or its owner no longer runs on this
+       host. Owners on other hosts can only be checked by their TTL, and
+       leases without an owner (0), such as those of keys obtained from a
+       shell, whose process may well exit before they are released, only
+       end by their TTL or a release. */
+
+    if (lease->ttl > 0 && now - lease->start >= lease->ttl)
+        return 1;
+
+    return lease->owner != 0 && strcmp(lease->host, host) == 0 
+        && kill(lease->owner, 0) != 0 && errno == ESRCH;
+
+} /* end lease_expired(lease,host,now) */
+
+/****************************************************************************/
+
+static int count_expired_leases(char* filename)
+{
+    /* Number of expired leases of a resource file. This reads the lease
+       log without a lock, so the answer is only a hint. */
+
+    struct Lease* leases;
+    char    host[HOST_LEN];
+    long    now = current_epoch_msec();
+    int     nleases = read_leases(filename, &leases);
+    int     nexpired = 0;
+    int     i;
+
+    host_name(host);
+    for (i = 0; i < nleases; i++)
+        if (lease_expired(leases + i, host, now))
+            nexpired++;
+
+    free_leases(leases, nleases);
+
+    return nexpired;
+
+} /* end count_expired_leases(filename) */
+
+/****************************************************************************/
+
+static int reclaim_leases(struct Pool* pool)
+{
+    /* Release the keys of the expired leases of a resource file that is 
+       locked as a whole, and rewrite its lease log with just the leases
+       that are still held. The log is replaced as a whole (see 
+       replace_file), so a crash leaves either log, not a torn one. 
+       Returns the number of keys reclaimed. */
+
+    struct Lease* leases;
+    FILE*   log;
+    char*   leasename = companion_filename(pool->filename, LEASE_SUFFIX);
+    char    host[HOST_LEN];
+    char**  expired;
+    char*   isexpired;
+    char*   text;
+    size_t  length;
+    pid_t   owner = pool->owner;
+    long    now = current_epoch_msec();
+    int     nleases = read_leases(pool->filename, &leases);
+    int     nexpired = 0;
+    int     i;
+
+    host_name(host);
+    expired = malloc((nleases + 1)*sizeof(char*));
+    isexpired = malloc(nleases + 1);
+    for (i = 0; i < nleases; i++) {
+        isexpired[i] = lease_expired(leases + i, host, now);
+        if (isexpired[i])
+            expired[nexpired++] = leases[i].key;
+    }
+
+    /* the keys are released without an owner, whose leases they are not */
+    pool->owner = 0;
+    if (nexpired > 0)
+        unmark_resources(pool, nexpired, expired);
+    pool->owner = owner;
+
+    if (nexpired < nleases) {
+        log = open_memstream(&text, &length);
+        for (i = 0; i < nleases; i++)
+            if (!isexpired[i])
+                fprintf(log, "+ %ld %s %ld %ld %s\n", (long)leases[i].owner, 
+                        leases[i].host, leases[i].start, leases[i].ttl, leases[i].key);
+        fclose(log);
+        if (replace_file(leasename, text, length, pool->durability) != NO_ERROR)
+            error(0, 0, "Could not rewrite '%s'.", leasename);
+        free(text);
+    } else
+        unlink(leasename);
+
+    free(expired);
+    free(isexpired);
+    free_leases(leases, nleases);
+    free(leasename);
+
+    return nexpired;
+
+} /* end reclaim_leases(pool) */
+
+/****************************************************************************/
+
+static int count_claimed_records(struct Pool* pool)
+{
+    /* Number of records of a locked pool that are claimed by lock-free
+       obtains (see claim_record), whether in flight or left behind. An
+       indexed file counts them in its header, which may briefly be ahead
+       (see swap_signal), or stay ahead of a process that died meanwhile
+       until free_stale_claims; a plain file has to be scanned. */
+
+    char*   record;
+    int     nclaimed = 0;
+
+    if (pool->index != NULL)
+        return (int)__atomic_load_n(&pool->index->nclaimed, __ATOMIC_SEQ_CST);
+
+    for (record = first_record(pool); record != NULL; record = next_record(pool, record))
+        if (*(volatile char*)record == CLAIM_CHAR)
+            nclaimed++;
+
+    return nclaimed;
+
+} /* end count_claimed_records(pool) */
+
+/****************************************************************************/
+
+static int free_stale_claims(struct Pool* pool)
+{
+    /* Free the records of a pool locked as a whole that are still claimed
+       by lock-free obtains. Those hold the scan lock from their claim up
+       to their use or unclaim of a record, which a lock on the whole file
+       keeps out, so such claims were left by processes that died in
+       between. Returns the number of records freed. */
+
+    char*   record;
+    int     nfreed = 0;
+
+    for (record = first_record(pool); record != NULL; record = next_record(pool, record))
+        if (*record == CLAIM_CHAR) {
+            set_signal(pool, record, FREE_CHAR);
+            nfreed++;
+        }
+
+    /* no claim is in flight now, so any count left over is stale too */
+    if (pool->index != NULL && pool->index->nclaimed != 0) {
+        pool->index->nclaimed = 0;
+        write_back(pool, pool->index, sizeof(struct IndexHeader));
+    }
+
+    return nfreed;
+
+} /* end free_stale_claims(pool) */
+
+/****************************************************************************/
+
+static int maintain_leases(struct Pool* pool, int reclaim, int* nreclaimed)
+{
+    /* Reclaim the keys of expired leases of a locked pool if 'reclaim' is
+       set and there are any, and compact the lease log if it has grown
+       beyond LEASE_LOG_LIMIT. This rewrites the log, which with record 
+       locking needs the lock on the whole file, so that lock is taken
+       temporarily, as in settle_pending_releases. In lock-free mode,
+       records left claimed by processes that died are reclaimed along
+       (see free_stale_claims). Sets 'nreclaimed' to the number of keys
+       reclaimed, and returns as settle_pending_releases does. */
+
+    struct stat status;
+    char*   leasename = companion_filename(pool->filename, LEASE_SUFFIX);
+    int     needed;
+    int     claimed;
+    long    now = current_msec();
+    enum Locking locking = pool->locking;
+
+    *nreclaimed = 0;
+
+    /* replaying the log takes time, so while processes keep waiting for
+       keys, it is only done every LEASE_CHECK_INTERVAL */
+    if (reclaim && pool->leasecheck != 0 && now - pool->leasecheck < LEASE_CHECK_INTERVAL)
+        reclaim = 0;
+    else if (reclaim)
+        pool->leasecheck = now;
+
+    needed = stat(leasename, &status) == 0 
+          && (status.st_size > LEASE_LOG_LIMIT 
+              || (reclaim && count_expired_leases(pool->filename) > 0));
+    /* claims in flight count too; which are stale shows under the lock */
+    claimed = reclaim && locking == LOCK_ATOMIC && count_claimed_records(pool) > 0;
+
+    free(leasename);
+
+    if (!needed && !claimed)
+        return NO_ERROR;
+
+    if (locking == LOCK_FILE) {
+        *nreclaimed = reclaim_leases(pool);
+        return NO_ERROR;
+    }
+
+    unlock_pool(pool);
+    pool->locking = LOCK_FILE;
+    if (lock_pool(pool) == NO_ERROR) {
+        if (claimed)
+            *nreclaimed = free_stale_claims(pool);
+        if (needed)
+            *nreclaimed += reclaim_leases(pool);
+    }
+    unlock_pool(pool);
+    pool->locking = locking;
+
+    return lock_pool(pool);
+
+} /* end maintain_leases(pool,reclaim,nreclaimed) */
+
+/****************************************************************************/
+
+static int eligible_record(struct Pool* pool, char* record, char* require, char* prefer, char** found, int nfound)
+{
+    /* Whether a free record has the 'require' and 'prefer' tags, and is
+       not one of the 'nfound' records in 'found' yet */
+
+    int     i;
+
+    for (i = 0; i < nfound; i++)
+        if (found[i] == record)
+            return 0;
+
+    return record_has_tags(pool, record, require) && record_has_tags(pool, record, prefer);
+
+} /* end eligible_record(pool,record,require,prefer,found,nfound) */
+
+/****************************************************************************/
+
+static int least_loaded_records(struct Pool* pool, int nwanted, char* require, char* prefer, char** found, int nfound)
+{
+    /* Find (up to) 'nwanted' more eligible free records (see 
+       eligible_record) that have the smallest fraction of their capacity
+       in use, and put them, in order of load, then position, after the 
+       'nfound' records in 'found'. Returns the number added. */
+
+    char*   record;
+    char**  best = found + nfound;
+    double  load;
+    double* loads = malloc(nwanted*sizeof(double));
+    int     nbest = 0;
+    int     i;
+
+    for (record = next_free_record(pool, first_record(pool));
+         record != NULL && !(nbest == nwanted && loads[nwanted-1] == 0.0);
+         record = next_free_record(pool, next_record(pool, record))) {
+        if (pool->stats != NULL)
+            pool->stats->scanned++;
+        if (!eligible_record(pool, record, require, prefer, found, nfound))
+            continue;
+        load = record_load(record);
+        if (nbest == nwanted && load >= loads[nwanted-1])
+            continue;
+        /* insert, dropping the most loaded one if there are too many */
+        i = (nbest < nwanted)? nbest++ : nwanted - 1;
+        for (; i > 0 && loads[i-1] > load; i--) {
+            best[i] = best[i-1];
+            loads[i] = loads[i-1];
+        }
+        best[i] = record;
+        loads[i] = load;
+    }
+
+    free(loads);
+
+    return nbest;
+
+} /* end least_loaded_records(pool,nwanted,require,prefer,found,nfound) */
+
+/****************************************************************************/
+
+static int claim_free_records(struct Pool* pool, int nwanted, enum Policy policy, char* require, char* prefer, char** found, int nfound, int* nconflicts)
+{
+    /* Claim eligible free records (see eligible_record) of a locked file
+       until 'found', which holds 'nfound' claimed records already, holds
+       'nwanted'. With record locking, free records that another process
+       is claiming at the same time are skipped, and counted in 
+       'nconflicts'. Unless the policy is first-fit, the search starts 
+       further into the file, and wraps around to the first record; or, 
+       for the least-loaded policy, all free records are considered.
+       Returns the number of records in 'found'. */
+
+    char*   record;
+    char*   first;
+    char*   start;
+    int     wrapped;
+    int     nbest;
+    int     i;
+    int     j;
+
+    if (nfound >= nwanted)
+        return nfound;
+
+    if (policy == LEAST_LOADED) {
+        nbest = least_loaded_records(pool, nwanted - nfound, require, prefer, found, nfound);
+        for (i = j = nfound; i < nfound + nbest; i++)
+            if (claim_record(pool, found[i], FREE_CHAR, 0))
+                found[j++] = found[i];
+            else
+                (*nconflicts)++;
+        return j;
+    }
+
+    first = first_record(pool);
+    if (policy == NEXT_FIT)
+        start = cursor_record(pool);
+    else if (policy == RANDOM_FIT)
+        start = random_record(pool);
+    else
+        start = first;
+
+    for (record = next_free_record(pool, start), wrapped = (start == first);
+         nfound < nwanted;
+         record = next_free_record(pool, next_record(pool, record))) {
+        if (record == NULL && !wrapped) {
+            record = next_free_record(pool, first);
+            wrapped = 1;
+        }
+        if (record == NULL || (wrapped && start != first && record >= start))
+            break;
+        if (pool->stats != NULL)
+            pool->stats->scanned++;
+        if (!eligible_record(pool, record, require, prefer, found, nfound))
+            continue;
+        if (claim_record(pool, record, FREE_CHAR, 0))
+            found[nfound++] = record;
+        else
+            (*nconflicts)++;
+    }
+
+    return nfound;
+
+} /* end claim_free_records(pool,nwanted,policy,require,prefer,found,nfound,nconflicts) */
+
+/****************************************************************************/
+
+struct Ticket {
+    /* a process waiting for keys of a resource file, in its queue */
+    long   number;      /* order of arrival                                 */
+    int    priority;    /* higher goes first                                */
+    pid_t  pid;         /* process that waits                               */
+    char   host[HOST_LEN]; /* host that process runs on                     */
+    int    nwanted;     /* number of keys it waits for                      */
+    long   deadline;    /* when it gives up (ms since the epoch), or 0      */
+    long   seen;        /* when it last showed it still waits               */
+    long   stale;       /* milliseconds after which it is dropped unseen    */
+    char*  require;     /* tags the keys must have, or NULL (to be freed)   */
+};
+
+/****************************************************************************/
+
+static int lock_queue(struct Pool* pool, int inside, short type)
+{
+    /* Lock (or, with type F_UNLCK, unlock) the queue of waiters of a
+       resource file, which is protected by a byte of the file. Inside a
+       whole-file lock, that byte is locked already. Returns 0 on success
+       and -1 if the lock could not be taken. */
+
+    if (!inside || pool->locking != LOCK_FILE)
+        return lock_range(pool->fd, type, QUEUE_LOCK_OFFSET, 1, 1);
+
+    return 0;
+
+} /* end lock_queue(pool,inside,type) */
+
+/****************************************************************************/
+
+static int compare_tickets(const void* a, const void* b)
+{
+    /* Comparison for qsort, putting tickets in the order they are served */
+
+    const struct Ticket* x = a;
+    const struct Ticket* y = b;
+
+    if (x->priority != y->priority)
+        return x->priority > y->priority? -1 : 1;
+
+    return (x->number > y->number) - (x->number < y->number);
+
+} /* end compare_tickets(a,b) */
+
+/****************************************************************************/
+
+static int read_queue(struct Pool* pool, struct Ticket** tickets, int* pruned)
+{
+    /* Read the queue of waiters of a locked resource file, FILE.queue, a
+       text file with lines
+         NUMBER PRIORITY PID HOST NWANTED DEADLINE SEEN STALE REQUIRE
+       with a '-' for no required tags. Waiters that died on this host,
+       that gave up, or that have not shown themselves for STALE ms (see
+       join_queue) are dropped, and counted in 'pruned'. The others (to be
+       freed with free_queue) are put in 'tickets', in the order they are
+       served. Returns their number. */
+
+    FILE*   in;
+    char*   queuename = companion_filename(pool->filename, QUEUE_SUFFIX);
+    char    line[MAX_LINE_LEN+HOST_LEN+128];
+    char    require[MAX_LINE_LEN];
+    char    host[HOST_LEN];
+    struct Ticket ticket;
+    long    pid;
+    long    now = current_epoch_msec();
+    int     ntickets = 0;
+    int     maxtickets = 0;
+
+    *tickets = NULL;
+    *pruned = 0;
+    in = fopen(queuename, "r");
+    free(queuename);
+
+    if (in == NULL)
+        return 0;
+
+    host_name(host);
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (strlen(line) >= MAX_LINE_LEN
+            || sscanf(line, "%ld %d %ld %255s %d %ld %ld %ld %s", &ticket.number,
+                      &ticket.priority, &pid, ticket.host, &ticket.nwanted, &ticket.deadline,
+                      &ticket.seen, &ticket.stale, require) != 9)
+            continue;
+        ticket.pid = (pid_t)pid;
+        if ((strcmp(ticket.host, host) == 0 && kill(ticket.pid, 0) != 0 && errno == ESRCH)
+            || (ticket.deadline != 0 && ticket.deadline < now)
+            || ticket.seen < now - ticket.stale) {
+            (*pruned)++;
+            continue;
+        }
+        ticket.require = strcmp(require, "-")? strdup(require) : NULL;
+        if (ntickets == maxtickets) {
+            maxtickets = maxtickets? 2*maxtickets : 16;
+            *tickets = realloc(*tickets, maxtickets*sizeof(struct Ticket));
+        }
+        (*tickets)[ntickets++] = ticket;
+    }
+
+    fclose(in);
+
+    qsort(*tickets, ntickets, sizeof(struct Ticket), compare_tickets);
+
+    return ntickets;
+
+} /* end read_queue(pool,tickets,pruned) */
+
+/****************************************************************************/
+
+static void write_queue(struct Pool* pool, struct Ticket* tickets, int ntickets)
+{
+    /* Write the queue of waiters of a locked resource file, as durably as
+       its changes; an empty queue is removed, so that obtaining without
+       waiters stays cheap */
+
+    FILE*   out;
+    char*   queuename = companion_filename(pool->filename, QUEUE_SUFFIX);
+    int     i;
+
+    if (ntickets == 0)
+        unlink(queuename);
+    else if ((out = fopen(queuename, "w")) != NULL) {
+        for (i = 0; i < ntickets; i++)
+            fprintf(out, "%ld %d %ld %s %d %ld %ld %ld %s\n", tickets[i].number,
+                    tickets[i].priority, (long)tickets[i].pid, tickets[i].host,
+                    tickets[i].nwanted, tickets[i].deadline, tickets[i].seen, tickets[i].stale,
+                    tickets[i].require? tickets[i].require : "-");
+        if (close_synced(out, pool->durability) != 0)
+            error(0, 0, "Could not write '%s'.", queuename);
+    }
+
+    free(queuename);
+
+} /* end write_queue(pool,tickets,ntickets) */
+
+/****************************************************************************/
+
+static void free_queue(struct Ticket* tickets, int ntickets)
+{
+    /* Free the tickets read by read_queue */
+
+    int     i;
+
+    for (i = 0; i < ntickets; i++)
+        free(tickets[i].require);
+    free(tickets);
+
+} /* end free_queue(tickets,ntickets) */
+
+/****************************************************************************/
+
+static int find_ticket(struct Pool* pool, struct Ticket* tickets, int ntickets)
+{
+    /* Index of the ticket of the pool's own process in the queue, or -1 */
+
+    int     i;
+
+    for (i = 0; i < ntickets; i++)
+        if (tickets[i].number == pool->ticket && tickets[i].pid == getpid())
+            return i;
+
+    return -1;
+
+} /* end find_ticket(pool,tickets,ntickets) */
+
+/****************************************************************************/
+
+static void join_queue(struct Pool* pool, int nwanted, long deadline)
+{
+    /* Put the process in the queue of waiters of a resource file, with
+       the priority of the pool, unless it is in it already and has shown
+       itself there recently. A waiter that does not show itself for
+       QUEUE_STALE of its poll intervals (the pool's polltime) is taken
+       to be gone, so it shows itself at every other try, at least. The
+       ticket keeps its number when it had been dropped as stale.
+       'deadline' is in ms since the epoch, or 0. */
+
+    struct Ticket* tickets;
+    int     ntickets;
+    int     pruned;
+    int     i;
+    long    now = current_epoch_msec();
+    long    stale = QUEUE_STALE*pool->polltime;
+
+    if (stale < QUEUE_STALE_MIN)
+        stale = QUEUE_STALE_MIN;
+
+    if (pool->ticket != 0 && now - pool->queued < stale/2)
+        return;
+
+    if (lock_queue(pool, 0, F_WRLCK) != 0)
+        return;
+
+    ntickets = read_queue(pool, &tickets, &pruned);
+    i = pool->ticket? find_ticket(pool, tickets, ntickets) : -1;
+
+    if (i < 0) {
+        tickets = realloc(tickets, (ntickets + 1)*sizeof(struct Ticket));
+        if (pool->ticket == 0)
+            for (i = 0, pool->ticket = 1; i < ntickets; i++)
+                if (tickets[i].number >= pool->ticket)
+                    pool->ticket = tickets[i].number + 1;
+        i = ntickets++;
+        tickets[i].number   = pool->ticket;
+        tickets[i].priority = pool->priority;
+        tickets[i].pid      = getpid();
+        host_name(tickets[i].host);
+        tickets[i].nwanted  = nwanted;
+        tickets[i].deadline = deadline;
+        tickets[i].require  = pool->require? strdup(pool->require) : NULL;
+    }
+    tickets[i].seen  = now;
+    tickets[i].stale = stale;
+    pool->queued = now;
+
+    write_queue(pool, tickets, ntickets);
+    free_queue(tickets, ntickets);
+
+    lock_queue(pool, 0, F_UNLCK);
+
+} /* end join_queue(pool,nwanted,deadline) */
+
+/****************************************************************************/
+
+static void leave_queue(struct Pool* pool, int inside)
+{
+    /* Take the process out of the queue of waiters of a resource file,
+       if it is in it; 'inside' tells whether the file is locked already.
+       Outside the lock, the file is touched, as waiters that came after
+       this one may be served now. */
+
+    struct Ticket* tickets;
+    int     ntickets;
+    int     pruned;
+    int     i;
+
+    if (pool->ticket == 0 || lock_queue(pool, inside, F_WRLCK) != 0)
+        return;
+
+    ntickets = read_queue(pool, &tickets, &pruned);
+    i = find_ticket(pool, tickets, ntickets);
+
+    if (i >= 0) {
+        free(tickets[i].require);
+        memmove(tickets + i, tickets + i + 1, (ntickets - i - 1)*sizeof(struct Ticket));
+        ntickets--;
+    }
+    if (i >= 0 || pruned > 0)
+        write_queue(pool, tickets, ntickets);
+    free_queue(tickets, ntickets);
+
+    lock_queue(pool, inside, F_UNLCK);
+
+    if (!inside && ntickets > 0)
+        futimens(pool->fd, NULL);
+    else if (ntickets > 0 && pool->locking == LOCK_ATOMIC)
+        /* taking keys by stores does not wake the waiters behind */
+        pool->released = 1;
+
+    pool->ticket = 0;
+
+} /* end leave_queue(pool,inside) */
+
+/****************************************************************************/
+
+static int reserve_for_queue(struct Pool* pool, int nwanted, char*** found)
+{
+    /* Claim the free records of a locked resource file that go to the
+       waiters ahead of the pool's process in the queue: all that the
+       first waiter can use, so that it is not overtaken forever by
+       smaller requests, and those of each further waiter ahead that can
+       be served in full. The claimed records, which the process may not
+       take, are put in 'found' (to be freed), which has room for another
+       'nwanted'. Returns their number. */
+
+    struct Ticket* tickets;
+    char*   queuename;
+    int     absent;
+    int     ntickets;
+    int     pruned;
+    int     nreserved = 0;
+    int     nclaimed;
+    int     nconflicts;
+    int     i;
+    int     j;
+
+    *found = malloc(nwanted*sizeof(char*));
+
+    /* without waiters, there is no queue file, and nothing to lock */
+    queuename = companion_filename(pool->filename, QUEUE_SUFFIX);
+    absent = (access(queuename, F_OK) != 0);
+    free(queuename);
+    if (absent || lock_queue(pool, 1, F_WRLCK) != 0)
+        return 0;
+
+    ntickets = read_queue(pool, &tickets, &pruned);
+    if (pruned > 0)
+        write_queue(pool, tickets, ntickets);
+
+    for (i = 0; i < ntickets; i++) {
+        if (tickets[i].priority < pool->priority
+            || (tickets[i].priority == pool->priority && pool->ticket != 0
+                && tickets[i].number >= pool->ticket))
+            break;
+        *found = realloc(*found, (nreserved + tickets[i].nwanted + nwanted)*sizeof(char*));
+        nclaimed = claim_free_records(pool, nreserved + tickets[i].nwanted, FIRST_FIT,
+                                      tickets[i].require, NULL, *found, nreserved, &nconflicts);
+        if (i > 0 && nclaimed < nreserved + tickets[i].nwanted) {
+            /* only the first waiter holds on to a partial claim */
+            for (j = nreserved; j < nclaimed; j++)
+                unclaim_record(pool, (*found)[j]);
+            nclaimed = nreserved;
+        }
+        nreserved = nclaimed;
+    }
+
+    free_queue(tickets, ntickets);
+
+    lock_queue(pool, 1, F_UNLCK);
+
+    return nreserved;
+
+} /* end reserve_for_queue(pool,nwanted,found) */
+
+/****************************************************************************/
+
+static int obtain_records(struct Pool* pool, int nwanted, enum Policy policy, FILE* out, int* nconflicts)
+{
+    /* Obtain 'nwanted' records of a locked resource file and print their
+       keys to 'out'. The records are obtained all at once, or not at all,
+       and are all different, also if they are counted. They must have the
+       tags the pool requires; records with the tags it prefers go first,
+       and other ones are only used if there are not enough of those. A
+       lease of each, by the owner of the pool, is added to the lease log.
+       Returns NOT_FOUND if the file has fewer than 'nwanted' records with
+       the required tags, and TIME_OUT if not enough of them are free right
+       now. Free records that go to waiters ahead in the queue of the file
+       (see reserve_for_queue) are not taken; once the records are taken,
+       the process leaves the queue. */
+
+    char**  found;
+    char    host[HOST_LEN];
+    char*   text;
+    size_t  length;
+    FILE*   log;
+    long    now = current_epoch_msec();
+    int     nreserved = reserve_for_queue(pool, nwanted, &found);
+    int     nfound = nreserved;
+    int     i;
+    int     exitcode = NO_ERROR;
+
+    /* from here on, the reserved records are the first of those 'found',
+       and the ones for this process follow */
+    nwanted += nreserved;
+
+    *nconflicts = 0;
+    if (pool->prefer != NULL)
+        nfound = claim_free_records(pool, nwanted, policy, pool->require, pool->prefer,
+                                    found, nfound, nconflicts);
+    nfound = claim_free_records(pool, nwanted, policy, pool->require, NULL,
+                                found, nfound, nconflicts);
+
+    if (nfound < nwanted) {
+        /* do not hold on to partial claims */
+        for (i = 0; i < nfound; i++)
+            unclaim_record(pool, found[i]);
+        /* in lock-free mode, free records that others claim, e.g. for
+           waiters ahead, are passed by, and may be given up without any
+           notice, so those claims count as conflicts (see
+           obtain_pool_resources) */
+        if (pool->locking == LOCK_ATOMIC)
+            *nconflicts += count_claimed_records(pool);
+        nwanted -= nreserved;
+        /* count the keys to see if the request can ever be met */
+        exitcode = count_tagged_records(pool, pool->require, nwanted) < (uint32_t)nwanted? 
+                   NOT_FOUND : TIME_OUT;
+    } else {
+        owner_host(pool, host);
+        for (i = 0; i < nreserved; i++)
+            unclaim_record(pool, found[i]);
+        log = open_memstream(&text, &length);
+        for (i = nreserved; i < nwanted; i++) {
+            use_record(pool, found[i]);
+            unclaim_record(pool, found[i]);
+            fprintf(out, "%.*s\n", (int)key_length(pool, found[i]), record_key(found[i]));
+            fprintf(log, "+ %ld %s %ld %ld %.*s\n", (long)pool->owner, host, now, pool->ttl,
+                    (int)key_length(pool, found[i]), record_key(found[i]));
+        }
+        fclose(log);
+        append_log(pool->filename, LEASE_SUFFIX, text, length, pool->durability);
+        free(text);
+        if (policy == NEXT_FIT)
+            move_cursor(pool, next_record(pool, found[nwanted-1]));
+        leave_queue(pool, 1);
+    }
+
+    free(found);
+
+    return exitcode;
+
+} /* end obtain_records(pool,nwanted,policy,out,nconflicts) */
+
+/****************************************************************************/
+
+static int try_obtain(struct Pool* pool, int nwanted, enum Policy policy, FILE* out, int notifier, long* next_release, int* nconflicts, int wait)
+{
+    /* A single attempt to obtain 'nwanted' resources from an open resource
+       file, which also carries out any pending releases that are due, and
+       reclaims the keys of expired leases if they are needed. 
+       Returns as obtain_records does, and sets 'next_release' to the time
+       of the next pending release, if any. Unless 'wait' is set, a file
+       locked by another process counts as a conflict and gives TIME_OUT. */
+
+    int     exitcode;
+    int     nreclaimed = 0;
+
+    *nconflicts = 0;
+    *next_release = 0;
+
+    exitcode = acquire_pool(pool, wait);
+
+    if (exitcode == TIME_OUT) {
+        *nconflicts = 1;
+        return exitcode;
+    }
+
+    drain_change_notifier(notifier);
+
+    if (exitcode == NO_ERROR)
+        exitcode = settle_pending_releases(pool, pool->filename, next_release);
+
+    if (exitcode == NO_ERROR)
+        exitcode = obtain_records(pool, nwanted, policy, out, nconflicts);
+
+    if (exitcode == TIME_OUT && maintain_leases(pool, 1, &nreclaimed) == NO_ERROR
+        && nreclaimed > 0)
+        exitcode = obtain_records(pool, nwanted, policy, out, nconflicts);
+
+    unlock_pool(pool);
+
+    return exitcode;
+
+} /* end try_obtain(pool,nwanted,policy,out,notifier,next_release,nconflicts,wait) */
+
+/****************************************************************************/
+
+static int read_manifest(char* filename, char*** shards)
+{
+    /* Read the names of the shards of a sharded pool from its manifest, a
+       text file with the line SHARD_MAGIC, followed by the name of one
+       shard file per line. Relative names are relative to the directory
+       of the manifest. Returns the number of shards, whose names (to be
+       freed with free_names) are put in 'shards', or 0 if the file is not
+       a manifest. */
+
+    FILE*   manifest = fopen(filename, "r");
+    char    line[MAX_LINE_LEN];
+    char*   slash = strrchr(filename, '/');
+    size_t  dirlength = slash? slash - filename + 1 : 0;
+    size_t  length;
+    size_t  prefix;
+    int     nshards = 0;
+
+    *shards = NULL;
+
+    if (manifest == NULL)
+        return 0;
+
+    if (fgets(line, sizeof(line), manifest) != NULL && strcmp(line, SHARD_MAGIC) == 0) {
+        while (fgets(line, sizeof(line), manifest) != NULL) {
+            length = strcspn(line, "\n");
+            if (length == 0)
+                continue;
+            *shards = realloc(*shards, (nshards + 1)*sizeof(char*));
+            prefix = (line[0] == '/')? 0 : dirlength;
+            (*shards)[nshards] = malloc(prefix + length + 1);
+            memcpy((*shards)[nshards], filename, prefix);
+            memcpy((*shards)[nshards] + prefix, line, length);
+            (*shards)[nshards][prefix + length] = '\0';
+            nshards++;
+        }
+    }
+
+    fclose(manifest);
+
+    return nshards;
+
+} /* end read_manifest(filename,shards) */
+
+/****************************************************************************/
+
+void free_names(char** names, int nnames)
+{
+    /* Free an array of allocated names, such as from read_manifest */
+
+    int     i;
+
+    for (i = 0; i < nnames; i++)
+        free(names[i]);
+    free(names);
+
+} /* end free_names(names,nnames) */
+
+/****************************************************************************/
+
+static int select_shard_keys(int nkeys, char** keys, int nshards, int shard, int arguments, char** selected)
+{
+    /* Put those of 'keys' that belong to 'shard' out of 'nshards', by the 
+       hash of the key, in 'selected', and return how many there are. With
+       'arguments' set, the keys are arguments to '-c' or '-a', which may
+       carry a count and tags that are not part of the key. */
+
+    unsigned long capacity;
+    size_t  length;
+    int     nselected = 0;
+    int     i;
+
+    for (i = 0; i < nkeys; i++) {
+        length = arguments? argument_key_length(keys[i], &capacity) : strlen(keys[i]);
+        if (key_slot(keys[i], length, nshards) == (uint32_t)shard)
+            selected[nselected++] = keys[i];
+    }
+
+    return nselected;
+
+} /* end select_shard_keys(nkeys,keys,nshards,shard,arguments,selected) */
+
+/****************************************************************************/
+
+static int home_shard(int nshards)
+{
+    /* Shard at which this process starts looking for free keys, chosen by
+       the hash of its host and process id, so that processes spread over
+       the shards */
+
+    char    text[HOST_LEN+32];
+
+    host_name(text);
+    snprintf(text + strlen(text), 32, ":%ld", (long)getpid());
+
+    return key_slot(text, strlen(text), nshards);
+
+} /* end home_shard(nshards) */
+
+/****************************************************************************/
+
+static int open_pools(char* filename, enum Locking locking, struct Pool** pools)
+{
+    /* Open a resource file or, if it is the manifest of a sharded pool,
+       each of its shards. Returns the number of pools put in 'pools', to
+       be closed with close_pools, or 0 if a file could not be opened. */
+
+    char**  shards;
+    int     nshards = read_manifest(filename, &shards);
+    int     i;
+
+    if (nshards == 0) {
+        shards = malloc(sizeof(char*));
+        shards[0] = strdup(filename);
+        nshards = 1;
+    }
+
+    *pools = malloc(nshards*sizeof(struct Pool));
+
+    for (i = 0; i < nshards; i++) 
+        if (open_pool(*pools + i, shards[i], 0, locking) != NO_ERROR)
+            break;
+
+    if (i < nshards) {
+        while (i-- > 0)
+            close_pool(*pools + i);
+        free(*pools);
+        *pools = NULL;
+        free_names(shards, nshards);
+        return 0;
+    }
+
+    /* the pools keep the names */
+    free(shards);
+
+    return nshards;
+
+} /* end open_pools(filename,locking,pools) */
+
+/****************************************************************************/
+
+static void close_pools(struct Pool* pools, int npools)
+{
+    /* Close the pools opened with open_pools */
+
+    int     i;
+
+    for (i = 0; i < npools; i++) {
+        close_pool(pools + i);
+        free(pools[i].filename);
+    }
+    free(pools);
+
+} /* end close_pools(pools,npools) */
+
+/****************************************************************************/
+
+static int obtain_pool_resources(struct Pool* pools, int npools, int nwanted, long timeout, long polltime, long maxpolltime, enum Policy policy, FILE* out, int* tier)
+{
+    /* Obtain 'nwanted' resources from an open resource file, or from one
+       of the shards of a sharded pool, waiting for them to become 
+       available if needed, and print their keys to 'out'. The shards are
+       tried in turn, starting at the home shard of the process, without
+       waiting for locks held by others. Only if no other shard can serve
+       the request, the shards that were busy are tried again, this time
+       waiting for their locks. All keys come from the same shard.
+       The pools may also be those of several files, with the tier of the
+       pools of each file set to its rank; the files are then tried in
+       that order, and waited for all at once. The tier of the pool that
+       the keys came from is put in 'tier', unless that is NULL. While
+       waiting, the process is in the queue of waiters of each pool (see
+       join_queue), so that keys go to waiters in turn, by priority. */
+
+    int     repeat;
+    int     exitcode;
+    int     result;
+    int     nconflicts;
+    int     conflicts;
+    long    deadline = current_msec() + timeout;
+    long    waittime = 0;
+    long    next_release;
+    long    release;
+    int     attempt = 0;
+    int     notifier = -1;
+    int     watching = 0;
+    int     first;
+    int     shard;
+    int     wait;
+    int     i;
+    int     j;
+    int     k;
+    int*    order = malloc(npools*sizeof(int));
+    char*   alone = malloc(npools);
+    char*   busy = malloc(npools);
+    char**  filenames;
+
+    for (i = 0; i < npools; i = j) {
+        /* the shards of one file are consecutive and share a tier */
+        for (j = i; j < npools && pools[j].tier == pools[i].tier; j++)
+            ;
+        first = j - i > 1? home_shard(j - i) : 0;
+        for (k = i; k < j; k++) {
+            order[k] = i + (first + k - i)%(j - i);
+            alone[k] = (j - i == 1);
+        }
+    }
+
+    /* how long waiters may go unseen in the queue depends on this */
+    for (i = 0; i < npools; i++)
+        pools[i].polltime = maxpolltime > polltime? maxpolltime : polltime;
+
+    do {
+        exitcode = NOT_FOUND;
+        nconflicts = 0;
+        next_release = 0;
+        memset(busy, 0, npools);
+        if (pools->stats != NULL)
+            pools->stats->polls++;
+        for (i = 0; i < 2*npools; i++) {
+            /* the second pass is over the shards that were busy in the
+               first; notifications are drained at the first shard only,
+               so that none arriving during the round get lost */
+            shard = order[i%npools];
+            if (!busy[shard] && i >= npools)
+                continue;
+            wait = (i >= npools || alone[shard]);
+            result = try_obtain(pools + shard, nwanted, policy, out, i == 0? notifier : -1, 
+                                &release, &conflicts, wait);
+            busy[shard] = (result == TIME_OUT && conflicts > 0);
+            if (wait)
+                nconflicts += conflicts;
+            if (release != 0 && (next_release == 0 || release < next_release))
+                next_release = release;
+            if (result == TIME_OUT)
+                exitcode = TIME_OUT;
+            else if (result != NOT_FOUND) {
+                exitcode = result;
+                if (tier != NULL)
+                    *tier = pools[shard].tier;
+                break;
+            }
+        }
+        repeat = 0;
+
+        if (exitcode == TIME_OUT) {
+            waittime = next_waittime(polltime, maxpolltime, attempt++, &pools->seed);
+            if (nconflicts > 0 && waittime > 10)
+                /* records may free up without notice if a competing
+                   claimer gives up, so retry shortly */
+                waittime = 1 + rand_r(&pools->seed)%10;
+            if (next_release != 0 && waittime > next_release - current_epoch_msec())
+                waittime = next_release - current_epoch_msec() + 1;
+            if (waittime < 1)
+                /* a pending release came due during the try, and gets
+                   carried out by the next one; only a deadline ends it */
+                waittime = 1;
+            if (timeout != NO_TIMEOUT && waittime > deadline - current_msec())
+                waittime = deadline - current_msec();
+            repeat = (waittime > 0);
+        }
+
+        for (i = 0; i < npools; i++)
+            if (pools[i].reopened && watching) {
+                /* the watch is on the file that was replaced */
+                if (notifier >= 0)
+                    close(notifier);
+                notifier = -1;
+                watching = 0;
+            }
+        for (i = 0; i < npools; i++)
+            pools[i].reopened = 0;
+
+        if (repeat)
+            /* waiting processes line up, so that they get served in turn */
+            for (i = 0; i < npools; i++)
+                join_queue(pools + i, nwanted, timeout == NO_TIMEOUT? 0 :
+                           current_epoch_msec() + deadline - current_msec());
+
+        if (repeat && !watching) {
+            /* Only start watching the file once we have to wait, as
+               setting up (and closing) a notifier is not free. One 
+               more try follows right away, so that no modification
+               made before the watch existed goes unnoticed. */
+            filenames = malloc(npools*sizeof(char*));
+            for (i = 0; i < npools; i++)
+                filenames[i] = pools[i].filename;
+            notifier = open_change_notifier(npools, filenames);
+            free(filenames);
+            watching = 1;
+        } else if (repeat)
+            wait_for_change(notifier, waittime);
+        
+    } while (repeat); /* keep waiting if resources were not avaliable */
+
+    for (i = 0; i < npools; i++)
+        leave_queue(pools + i, 0);
+    if (notifier >= 0)
+        close(notifier);
+    free(busy);
+    free(alone);
+    free(order);
+
+    return exitcode;
+
+} /* end obtain_pool_resources(pools,npools,nwanted,timeout,polltime,maxpolltime,policy,out,tier) */
+
+/****************************************************************************/
+
+static void begin_stats(struct Stats* stats, struct Pool* pools, int npools)
+{
+    /* Keep the costs of the call that starts now in 'stats', for all 
+       'npools' pools, if the STATS_VARIABLE asks for it */
+
+    char*   setting = getenv(STATS_VARIABLE);
+    int     keep = (setting != NULL && *setting != '\0' && strcmp(setting, "0") != 0);
+    int     i;
+
+    memset(stats, 0, sizeof(struct Stats));
+    stats->start = current_epoch_msec();
+
+    for (i = 0; i < npools; i++)
+        pools[i].stats = keep? stats : NULL;
+
+} /* end begin_stats(stats,pools,npools) */
+
+/****************************************************************************/
+
+static void end_stats(char* filename, char* operation, struct Pool* pools, int npools, int exitcode)
+{
+    /* If the costs of the call were kept, append a line with them to the
+       stats log of the resource file, FILE.stats:
+         OPERATION PID START EXITCODE LOCKWAIT LOCKHOLD SCANNED POLLS
+       with the start in milliseconds since the epoch and the lock times
+       in microseconds. Then stop keeping them. */
+
+    struct Stats* stats = pools->stats;
+    char    line[256];
+    int     length;
+    int     i;
+
+    if (stats == NULL)
+        return;
+
+    length = snprintf(line, sizeof(line), "%s %ld %ld %d %ld %ld %ld %ld\n", operation, 
+                      (long)getpid(), stats->start, exitcode, stats->lockwait, 
+                      stats->lockhold, stats->scanned, stats->polls);
+    append_log(filename, STATS_SUFFIX, line, length, SYNC_NONE);
+
+    for (i = 0; i < npools; i++)
+        pools[i].stats = NULL;
+
+} /* end end_stats(filename,operation,pools,npools,exitcode) */
+
+/****************************************************************************/
+
+int obtain_any_resource(int nfiles, char** filenames, int nwanted, long timeout, long polltime, long maxpolltime, enum Locking locking, enum Durability durability, enum Policy policy, pid_t owner, long ttl, char* require, char* prefer, int priority)
+{
+    /* Resource management routine to obtain 'nwanted' resources from the
+       first of 'nfiles' resource files that has them free, waiting for
+       them on all files at once if none has. All keys come from the same
+       file. With more than one file, the name of that file is printed on
+       a line before the keys. Among waiting processes, those with a
+       higher 'priority' get keys first. Otherwise as obtain_resource. */
+
+    struct Pool* pools = NULL;
+    struct Pool* filepools;
+    struct Stats stats;
+    char*   text;
+    size_t  length;
+    FILE*   out = nfiles > 1? open_memstream(&text, &length) : stdout;
+    int     npools = 0;
+    int     nfilepools;
+    int     tier = 0;
+    int     exitcode;
+    int     i;
+    int     j;
+
+    for (i = 0; i < nfiles; i++) {
+        nfilepools = open_pools(filenames[i], locking, &filepools);
+        if (nfilepools == 0)
+            break;
+        pools = realloc(pools, (npools + nfilepools)*sizeof(struct Pool));
+        for (j = 0; j < nfilepools; j++) {
+            pools[npools] = filepools[j];
+            pools[npools].tier = i;
+            npools++;
+        }
+        free(filepools);
+    }
+
+    if (i < nfiles) {
+        if (npools > 0)
+            close_pools(pools, npools);
+        else
+            free(pools);
+        if (nfiles > 1) {
+            fclose(out);
+            free(text);
+        }
+        return FILE_NOT_OPEN;
+    }
+
+    for (i = 0; i < npools; i++) {
+        pools[i].owner   = owner;
+        pools[i].ttl     = ttl;
+        pools[i].require = require;
+        pools[i].prefer  = prefer;
+        pools[i].priority = priority;
+        pools[i].durability = durability;
+    }
+
+    begin_stats(&stats, pools, npools);
+    exitcode = obtain_pool_resources(pools, npools, nwanted, timeout, polltime, maxpolltime, 
+                                     policy, out, &tier);
+    end_stats(filenames[tier], "obtain", pools, npools, exitcode);
+    close_pools(pools, npools);
+
+    if (nfiles > 1) {
+        fclose(out);
+        if (exitcode == NO_ERROR)
+            printf("%s\n%s", filenames[tier], text);
+        free(text);
+    }
+
+    return exitcode;
+
+} /* end obtain_any_resource(nfiles,filenames,nwanted,timeout,polltime,maxpolltime,locking,durability,policy,owner,ttl,require,prefer,priority) */
+
+/****************************************************************************/
+
+int obtain_resource(char* filename, int nwanted, long timeout, long polltime, long maxpolltime, enum Locking locking, enum Durability durability, enum Policy policy, pid_t owner, long ttl, char* require, char* prefer)
+{
+    /* Resource management routine to obtain 'nwanted' resources given a
+       resource file, waiting for them to become available if needed. 
+       They are leased to 'owner', for 'ttl' milliseconds if positive.
+       Only keys with the 'require' tags are obtained, and ones with the
+       'prefer' tags first (either can be NULL). */
+
+    return obtain_any_resource(1, &filename, nwanted, timeout, polltime, maxpolltime, locking,
+                               durability, policy, owner, ttl, require, prefer, 0);
+
+} /* end obtain_resource(filename,nwanted,timeout,polltime,maxpolltime,locking,durability,policy,owner,ttl,require,prefer) */
+
+/****************************************************************************/
+
+static int release_pool_resources(struct Pool* pool, int nkeys, char** keys, long delay)
+{
+    /* Release 'keys' in an open resource file. Without a delay this 
+       happens immediately. With a delay, the release is queued, and will
+       be carried out by the first mresource process that locks the file
+       after the delay has passed. */
+
+    char    host[HOST_LEN];
+    int     exitcode;
+    int     result;
+    int     nreclaimed;
+    long    next_release;
+
+    if (delay > 0) {
+        owner_host(pool, host);
+        return queue_resources(pool->filename, nkeys, keys, delay, pool->owner, host,
+                               pool->durability);
+    }
+
+    exitcode = lock_pool(pool);
+
+    if (exitcode == NO_ERROR)
+        exitcode = settle_pending_releases(pool, pool->filename, &next_release);
+
+    if (exitcode == NO_ERROR) {
+        exitcode = unmark_resources(pool, nkeys, keys);
+        result = maintain_leases(pool, 0, &nreclaimed);
+        if (result != NO_ERROR)
+            exitcode = result;
+    }
+        
+    unlock_pool(pool);
+
+    return exitcode;
+
+} /* end release_pool_resources(pool,nkeys,keys,delay) */
+
+/****************************************************************************/
+
+static int release_shard_resources(struct Pool* pools, int npools, int nkeys, char** keys, long delay)
+{
+    /* Release 'keys' in an open resource file, or in the shards of a
+       sharded pool that the keys belong to */
+
+    char**  selected;
+    int     nselected;
+    int     exitcode = NO_ERROR;
+    int     result;
+    int     i;
+
+    if (npools == 1)
+        return release_pool_resources(pools, nkeys, keys, delay);
+
+    selected = malloc(nkeys*sizeof(char*));
+
+    for (i = 0; i < npools; i++) {
+        nselected = select_shard_keys(nkeys, keys, npools, i, 0, selected);
+        if (nselected > 0) {
+            result = release_pool_resources(pools + i, nselected, selected, delay);
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+    }
+
+    free(selected);
+
+    return exitcode;
+
+} /* end release_shard_resources(pools,npools,nkeys,keys,delay) */
+
+/****************************************************************************/
+
+int release_resource(char* filename, int nkeys, char** keys, long delay, enum Locking locking, enum Durability durability, pid_t owner)
+{
+    /* Resource management routine to release 'keys' from resource file,
+       or sharded pool, preferably ending the leases of 'owner' on them */
+
+    struct Pool* pools;
+    struct Stats stats;
+    int     npools;
+    int     exitcode;
+    int     i;
+
+    npools = open_pools(filename, locking, &pools);
+
+    if (npools == 0)
+        return FILE_NOT_OPEN;
+
+    for (i = 0; i < npools; i++) {
+        pools[i].owner = owner;
+        pools[i].durability = durability;
+    }
+
+    begin_stats(&stats, pools, npools);
+    exitcode = release_shard_resources(pools, npools, nkeys, keys, delay);
+    end_stats(filename, "release", pools, npools, exitcode);
+    close_pools(pools, npools);
+
+    return exitcode;
+
+} /* end release_resource(filename,nkeys,keys,delay,locking,durability,owner) */
+
+/****************************************************************************/
+
+static int renew_leases(char* filename, int nkeys, char** keys, pid_t owner, char* host, long ttl, enum Durability durability)
+{
+    /* Restart the leases that 'owner' on 'host' (or on this host, if 
+       NULL) holds on 'keys', with a new TTL of 'ttl' milliseconds if
+       positive, so that they do not expire. Returns NOT_FOUND if the 
+       owner does not hold one of the keys. */
+
+    struct Pool   pool;
+    struct Lease* leases;
+    char    name[HOST_LEN];
+    char*   text;
+    size_t  length;
+    FILE*   out;
+    char**  shards;
+    int     nshards = read_manifest(filename, &shards);
+    int     nleases;
+    int     exitcode = NO_ERROR;
+    int     result;
+    int     i;
+    long    now = current_epoch_msec();
+
+    if (nshards > 0) {
+        /* each key is leased in the shard it belongs to */
+        for (i = 0; i < nkeys; i++) {
+            result = renew_leases(shards[key_slot(keys[i], strlen(keys[i]), nshards)], 
+                                  1, keys + i, owner, host, ttl, durability);
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    exitcode = open_pool(&pool, filename, 0, LOCK_FILE);
+
+    if (exitcode == NO_ERROR && apply_lock(pool.fd, &pool.set_lock, 1) != 0) {
+        exitcode = lock_failure(&pool, 1);
+        close_pool(&pool);
+    } else if (exitcode == NO_ERROR) {
+
+        pool.host = host;
+        owner_host(&pool, name);
+        nleases = read_leases(filename, &leases);
+        out = open_memstream(&text, &length);
+        for (i = 0; i < nkeys; i++)
+            if (find_lease(leases, nleases, keys[i], owner, name, 1) >= 0)
+                fprintf(out, "* %ld %s %ld %ld %s\n", (long)owner, name, now, ttl, keys[i]);
+            else
+                exitcode = NOT_FOUND;
+        fclose(out);
+
+        if (length > 0)
+            append_log(filename, LEASE_SUFFIX, text, length, durability);
+        free(text);
+        free_leases(leases, nleases);
+
+        apply_lock(pool.fd, &pool.unset_lock, 0);
+        close_pool(&pool);
+
+    }
+
+    return exitcode;
+
+} /* end renew_leases(filename,nkeys,keys,owner,host,ttl,durability) */
+
+/****************************************************************************/
+
+int renew_resource(char* filename, int nkeys, char** keys, pid_t owner, long ttl, enum Durability durability)
+{
+    /* Restart the leases that 'owner' holds on 'keys', with a new TTL of
+       'ttl' milliseconds if positive, so that they do not expire. Returns
+       NOT_FOUND if the owner does not hold one of the keys. */
+
+    return renew_leases(filename, nkeys, keys, owner, NULL, ttl, durability);
+
+} /* end renew_resource(filename,nkeys,keys,owner,ttl,durability) */
+
+/****************************************************************************/
+
+static int socket_address(char* filename, struct sockaddr_un* address)
+{
+    /* Fill in the address of the socket of the daemon serving a resource
+       file, which is FILE.sock. Returns -1 if that name is too long. */
+
+    char*  socketname = companion_filename(filename, SOCKET_SUFFIX);
+    int    result = 0;
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(socketname) < sizeof(address->sun_path))
+        strcpy(address->sun_path, socketname);
+    else
+        result = -1;
+
+    free(socketname);
+
+    return result;
+
+} /* end socket_address(filename,address) */
+
+/****************************************************************************/
+
+static int agent_address(char* filename, struct sockaddr_un* address)
+{
+    /* Fill in the address of the socket of the agent for a resource file
+       on this host, which is FILE.HOST.agent. Returns -1 if that name is
+       too long. */
+
+    char   suffix[HOST_LEN + sizeof(AGENT_SUFFIX) + 1];
+    char   host[HOST_LEN];
+    char*  socketname;
+    int    result = 0;
+
+    host_name(host);
+    snprintf(suffix, sizeof(suffix), ".%s%s", host, AGENT_SUFFIX);
+    socketname = companion_filename(filename, suffix);
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(socketname) < sizeof(address->sun_path))
+        strcpy(address->sun_path, socketname);
+    else
+        result = -1;
+
+    free(socketname);
+
+    return result;
+
+} /* end agent_address(filename,address) */
+
+/****************************************************************************/
+
+static int send_all(int fd, char* text, size_t length)
+{
+    /* Write all of 'text' to a socket. Returns -1 if the peer has gone. */
+
+    ssize_t nsent;
+
+    for (; length > 0; text += nsent, length -= nsent) {
+        nsent = send(fd, text, length, MSG_NOSIGNAL);
+        if (nsent < 0 && errno == EINTR)
+            nsent = 0;
+        else if (nsent <= 0)
+            return -1;
+    }
+
+    return 0;
+
+} /* end send_all(fd,text,length) */
+
+/****************************************************************************/
+
+static int daemon_address(char* filename, int remote, char** host, char** port)
+{
+    /* The TCP address of the daemon serving a resource file. That is the
+       name of the file itself, if it is an address 'tcp://HOST:PORT'; or
+       else, only if 'remote' asks for that, the address that a daemon
+       listening on TCP left in FILE.addr (see open_tcp_listener). A
+       FILE.addr of a daemon on this host that is no longer running is
+       removed. HOST and PORT are put in newly allocated strings. Returns
+       whether there is such an address. */
+
+    char    line[MAX_LINE_LEN];
+    char    daemonhost[HOST_LEN];
+    char    thishost[HOST_LEN];
+    char*   text = NULL;
+    char*   addrname;
+    char*   colon;
+    char*   end;
+    FILE*   in;
+    long    pid;
+    int     found;
+    int     stale = 0;
+
+    if (strncmp(filename, TCP_PREFIX, strlen(TCP_PREFIX)) == 0)
+        text = strdup(filename + strlen(TCP_PREFIX));
+    else if (!remote)
+        return 0;
+    else {
+        addrname = companion_filename(filename, ADDRESS_SUFFIX);
+        in = fopen(addrname, "r");
+        if (in == NULL) {
+            free(addrname);
+            return 0;
+        }
+        found = (fgets(line, sizeof(line), in) != NULL);
+        if (found)
+            text = strndup(line, strcspn(line, "\n"));
+        /* the daemon is checked where it can be, on its own host */
+        host_name(thishost);
+        if (fgets(line, sizeof(line), in) != NULL
+            && sscanf(line, "%ld %255s", &pid, daemonhost) == 2
+            && strcmp(daemonhost, thishost) == 0)
+            stale = (kill((pid_t)pid, 0) != 0 && errno == ESRCH);
+        fclose(in);
+        if (stale)
+            unlink(addrname);
+        free(addrname);
+        if (!found || stale) {
+            free(text);
+            return 0;
+        }
+    }
+
+    colon = strrchr(text, ':');
+    found = (colon != NULL && colon > text && colon[1] != '\0');
+
+    if (found) {
+        strtol(colon + 1, &end, 10);
+        found = (*end == '\0');
+    }
+
+    if (found) {
+        *colon = '\0';
+        /* an IPv6 address comes in brackets */
+        if (text[0] == '[' && colon[-1] == ']') {
+            colon[-1] = '\0';
+            *host = strdup(text + 1);
+        } else
+            *host = strdup(text);
+        *port = strdup(colon + 1);
+    }
+
+    free(text);
+
+    return found;
+
+} /* end daemon_address(filename,remote,host,port) */
+
+/****************************************************************************/
+
+static int connect_within(int fd, struct sockaddr* address, socklen_t length, long timeout)
+{
+    /* Connect a socket, but give up after 'timeout' milliseconds, as when
+       the other host is down. Returns 0 on success. */
+
+    struct pollfd pfd;
+    int     flags = fcntl(fd, F_GETFL);
+    int     failure = 0;
+    socklen_t failurelength = sizeof(failure);
+    int     result;
+
+    fcntl(fd, F_SETFL, flags|O_NONBLOCK);
+
+    result = connect(fd, address, length);
+
+    if (result != 0 && errno == EINPROGRESS) {
+        pfd.fd     = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd, 1, (int)timeout) == 1
+            && getsockopt(fd, SOL_SOCKET, SO_ERROR, &failure, &failurelength) == 0
+            && failure == 0)
+            result = 0;
+    }
+
+    fcntl(fd, F_SETFL, flags);
+
+    return result;
+
+} /* end connect_within(fd,address,length,timeout) */
+
+/****************************************************************************/
+
+static int connect_local(struct sockaddr_un* address)
+{
+    /* Connect to a socket on this host; returns -1 if nobody listens */
+
+    int    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+    if (fd >= 0 && connect(fd, (struct sockaddr*)address, sizeof(*address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+
+} /* end connect_local(address) */
+
+/****************************************************************************/
+
+static int connect_daemon(char* filename, int remote)
+{
+    /* Connect to the daemon serving a resource file: to the agent for the
+       file on this host if there is one, through FILE.sock if the daemon
+       runs on this host, or else over TCP (see daemon_address). Returns
+       the connection, or -1 if no daemon can be reached. */
+
+    struct sockaddr_un address;
+    struct addrinfo  hints;
+    struct addrinfo* found;
+    struct addrinfo* candidate;
+    char*  host;
+    char*  port;
+    int    fd;
+    int    one = 1;
+
+    if (agent_address(filename, &address) == 0 && (fd = connect_local(&address)) >= 0)
+        return fd;
+
+    if (socket_address(filename, &address) == 0 && (fd = connect_local(&address)) >= 0)
+        return fd;
+
+    if (!daemon_address(filename, remote, &host, &port))
+        return -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    fd = -1;
+
+    if (getaddrinfo(host, port, &hints, &found) == 0) {
+        for (candidate = found; candidate != NULL && fd < 0; candidate = candidate->ai_next) {
+            fd = socket(candidate->ai_family, candidate->ai_socktype|SOCK_CLOEXEC,
+                        candidate->ai_protocol);
+            if (fd >= 0 && connect_within(fd, candidate->ai_addr, candidate->ai_addrlen,
+                                          CONNECT_TIMEOUT) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+    }
+
+    if (fd >= 0)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    free(host);
+    free(port);
+
+    return fd;
+
+} /* end connect_daemon(filename,remote) */
+
+/****************************************************************************/
+
+static int request_daemon(char* filename, int remote, char* request, size_t length)
+{
+    /* Send a request to the daemon serving a resource file, and print the
+       keys in its response. Returns the exit code from the response, or -1
+       if no daemon serves the file, so that it can be accessed directly. */
+
+    FILE*  response;
+    char   buffer[NOTIFY_BUF_LEN];
+    size_t nread;
+    int    fd = connect_daemon(filename, remote);
+    int    exitcode = FILE_NOT_OPEN;
+
+    if (fd < 0)
+        return -1;
+
+    /* from here on, the daemon may act on the request, so there is no
+       falling back; a daemon that goes away mid-request is an error */
+    if (send_all(fd, request, length) != 0) {
+        close(fd);
+        return FILE_NOT_OPEN;
+    }
+    shutdown(fd, SHUT_WR);
+
+    /* the daemon hangs up after answering, as no more requests follow */
+    response = fdopen(fd, "r");
+    if (fgets(buffer, sizeof(buffer), response) != NULL)
+        exitcode = atoi(buffer);
+    while ((nread = fread(buffer, 1, sizeof(buffer), response)) > 0)
+        fwrite(buffer, 1, nread, stdout);
+    fclose(response);
+
+    return exitcode;
+
+} /* end request_daemon(filename,remote,request,length) */
+
+/****************************************************************************/
+
+int obtain_through_daemon(char* filename, int remote, int nwanted, long timeout, enum Policy policy, pid_t owner, long ttl, char* require, char* prefer, int priority)
+{
+    /* Obtain resources from the daemon serving the resource file, if any */
+
+    char*  request;
+    size_t length;
+    char   host[HOST_LEN];
+    FILE*  out = open_memstream(&request, &length);
+    int    exitcode;
+
+    host_name(host);
+    fprintf(out, "obtain %d %ld %d %ld %ld %s %s %s %d\n", nwanted, timeout, (int)policy,
+            (long)owner, ttl, require? require : "-", prefer? prefer : "-", host, priority);
+    fclose(out);
+
+    exitcode = request_daemon(filename, remote, request, length);
+
+    free(request);
+
+    return exitcode;
+
+} /* end obtain_through_daemon(filename,remote,nwanted,timeout,policy,owner,ttl,require,prefer,priority) */
+
+/****************************************************************************/
+
+int release_through_daemon(char* filename, int remote, int nkeys, char** keys, long delay, pid_t owner)
+{
+    /* Release keys through the daemon serving the resource file, if any */
+
+    char*  request;
+    size_t length;
+    char   host[HOST_LEN];
+    FILE*  out = open_memstream(&request, &length);
+    int    exitcode;
+    int    i;
+
+    host_name(host);
+    fprintf(out, "release %ld %ld %d %s\n", delay, (long)owner, nkeys, host);
+    for (i = 0; i < nkeys; i++)
+        fprintf(out, "%s\n", keys[i]);
+    fclose(out);
+
+    exitcode = request_daemon(filename, remote, request, length);
+
+    free(request);
+
+    return exitcode;
+
+} /* end release_through_daemon(filename,remote,nkeys,keys,delay,owner) */
+
+/****************************************************************************/
+
+int renew_through_daemon(char* filename, int remote, int nkeys, char** keys, pid_t owner, long ttl)
+{
+    /* Renew leases through the daemon serving the resource file, if any */
+
+    char*  request;
+    size_t length;
+    char   host[HOST_LEN];
+    FILE*  out = open_memstream(&request, &length);
+    int    exitcode;
+    int    i;
+
+    host_name(host);
+    fprintf(out, "renew %ld %ld %d %s\n", (long)owner, ttl, nkeys, host);
+    for (i = 0; i < nkeys; i++)
+        fprintf(out, "%s\n", keys[i]);
+    fclose(out);
+
+    exitcode = request_daemon(filename, remote, request, length);
+
+    free(request);
+
+    return exitcode;
+
+} /* end renew_through_daemon(filename,remote,nkeys,keys,owner,ttl) */
+
+/****************************************************************************/
+
+static volatile sig_atomic_t Stopping = 0; /* set when the daemon is to exit       */
+
+static void stop_serving(int signum)
+{
+    /* Signal handler that lets the daemon finish */
+
+    Stopping = signum;
+
+} /* end stop_serving(signum) */
+
+/****************************************************************************/
+
+static int open_listener(struct sockaddr_un* address)
+{
+    /* Create the socket of a daemon (or agent) at 'address'. A socket that
+       is left over from a daemon that did not exit cleanly is replaced,
+       but not one of a daemon that is still running. Returns -1 on error. */
+
+    int    fd;
+    int    probe;
+    int    bound;
+    int    stale;
+
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+
+    bound = (bind(fd, (struct sockaddr*)address, sizeof(*address)) == 0);
+
+    if (!bound && errno == EADDRINUSE) {
+        /* nobody answers on a stale socket */
+        probe = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+        stale = (connect(probe, (struct sockaddr*)address, sizeof(*address)) != 0);
+        close(probe);
+        if (stale) {
+            unlink(address->sun_path);
+            bound = (bind(fd, (struct sockaddr*)address, sizeof(*address)) == 0);
+        }
+    }
+
+    if (!bound || listen(fd, SOMAXCONN) != 0) {
+        error(0, 0, "Could not listen on '%s'; is a daemon running already?",
+              address->sun_path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+
+} /* end open_listener(address) */
+
+/****************************************************************************/
+
+static int open_tcp_listener(char* filename, char* listen_on)
+{
+    /* Create a TCP socket for a daemon for the resource file, listening on
+       'listen_on', which is PORT or HOST:PORT (port 0 picks a free one);
+       without a HOST it only listens on the loopback interface, as any
+       caller it reaches can obtain and release keys. Leave its address in FILE.addr, for clients that just give FILE
+       (see daemon_address), followed by a line 'PID HOST' of the daemon,
+       so that a FILE.addr left behind by one that died can be told apart.
+       Returns -1 on error. */
+
+    struct addrinfo  hints;
+    struct addrinfo* found;
+    struct sockaddr_storage address;
+    socklen_t addresslength = sizeof(address);
+    char*   colon = strrchr(listen_on, ':');
+    char*   host = colon? strndup(listen_on, colon - listen_on) : NULL;
+    char*   port = colon? colon + 1 : listen_on;
+    char*   addrname;
+    char    name[HOST_LEN];
+    char    thishost[HOST_LEN];
+    FILE*   out;
+    int     fd = -1;
+    int     one = 1;
+    int     number;
+
+    if (host != NULL && host[0] == '[' && host[strlen(host)-1] == ']') {
+        host[strlen(host)-1] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host && *host? host : NULL, port, &hints, &found) == 0) {
+        fd = socket(found->ai_family, found->ai_socktype|SOCK_CLOEXEC, found->ai_protocol);
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, found->ai_addr, found->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0
+                || getsockname(fd, (struct sockaddr*)&address, &addresslength) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+    }
+
+    if (fd < 0) {
+        error(0, 0, "Could not listen on TCP address '%s'.", listen_on);
+        free(host);
+        return -1;
+    }
+
+    if (address.ss_family == AF_INET6)
+        number = ntohs(((struct sockaddr_in6*)&address)->sin6_port);
+    else
+        number = ntohs(((struct sockaddr_in*)&address)->sin_port);
+
+    /* clients on other hosts need a name for this one, not a wildcard */
+    if (host == NULL || *host == '\0')
+        snprintf(name, sizeof(name), address.ss_family == AF_INET6? "[::1]" : "127.0.0.1");
+    else if (strcmp(host, "0.0.0.0") != 0 && strcmp(host, "::") != 0)
+        snprintf(name, sizeof(name), strchr(host, ':')? "[%s]" : "%s", host);
+    else
+        host_name(name);
+
+    host_name(thishost);
+    addrname = companion_filename(filename, ADDRESS_SUFFIX);
+    out = fopen(addrname, "w");
+    if (out == NULL
+        || fprintf(out, "%s:%d\n%ld %s\n", name, number, (long)getpid(), thishost) < 0
+        || fclose(out) != 0)
+        error(0, 0, "Could not write '%s'.", addrname);
+    free(addrname);
+    free(host);
+
+    return fd;
+
+} /* end open_tcp_listener(filename,listen_on) */
+
+/****************************************************************************/
+
+static int split_lines(char* text, char*** lines)
+{
+    /* Split text into lines in place; returns their number. The array of
+       lines is to be freed. */
+
+    int    nlines = 0;
+    char*  newline;
+
+    *lines = malloc((strlen(text)/2 + 1)*sizeof(char*));
+
+    for (; *text != '\0'; text = newline + 1) {
+        newline = strchr(text, '\n');
+        (*lines)[nlines++] = text;
+        if (newline == NULL)
+            break;
+        *newline = '\0';
+    }
+
+    return nlines;
+
+} /* end split_lines(text,lines) */
+
+/****************************************************************************/
+
+struct Cached {
+    /* a key that a node-local agent holds in the resource file */
+    char*  key;         /* the key (to be freed)                            */
+    int    held;        /* whether it is handed out to a local process      */
+    pid_t  owner;       /* that process, or 0 if it gave no owner           */
+    long   ttl;         /* milliseconds it is leased for locally, if positive */
+    long   expiry;      /* when that lease ends (or, if free, when a delayed
+                           release is due), in ms since the epoch, or 0     */
+};
+
+/****************************************************************************/
+
+struct Cache {
+    /* the keys that a node-local agent took from the resource file in
+       blocks, to hand out on this host without locking the file */
+    struct Cached* keys; /* the keys, handed out or not                     */
+    int    nkeys;       /* number of keys                                   */
+    int    capacity;    /* room for keys                                    */
+    int    block;       /* number of keys to take from the file at once     */
+    long   idle;        /* milliseconds after which free keys are returned  */
+    long   lastuse;     /* when keys were last handed out or given back     */
+    pid_t  agent;       /* holder of the keys in the resource file          */
+};
+
+/****************************************************************************/
+
+static int cached_free(struct Cached* cached, long now)
+{
+    /* Whether a cached key can be handed out at epoch time 'now' */
+
+    return !cached->held && cached->expiry <= now;
+
+} /* end cached_free(cached,now) */
+
+/****************************************************************************/
+
+static int count_cached(struct Cache* cache, long now, int* chosen, int nwanted)
+{
+    /* Pick up to 'nwanted' different free keys in a cache, putting their
+       indices in 'chosen'; returns how many were found. */
+
+    int     nchosen = 0;
+    int     i;
+    int     j;
+
+    for (i = 0; i < cache->nkeys && nchosen < nwanted; i++)
+        if (cached_free(cache->keys + i, now)) {
+            /* a key that can be used more than once may be cached twice */
+            for (j = 0; j < nchosen && strcmp(cache->keys[chosen[j]].key, cache->keys[i].key); j++)
+                ;
+            if (j == nchosen)
+                chosen[nchosen++] = i;
+        }
+
+    return nchosen;
+
+} /* end count_cached(cache,now,chosen,nwanted) */
+
+/****************************************************************************/
+
+static int reclaim_cached(struct Cache* cache, long now)
+{
+    /* Forget cached keys handed out to local processes that died, or
+       whose lease ran out. Their leases in the resource file are those of
+       the holders, so they are reclaimed there like any others, and the
+       agent must not hand them out again itself. Returns how many keys
+       were forgotten. */
+
+    struct Cached* cached;
+    int     nreclaimed = 0;
+    int     i;
+    int     j;
+
+    for (i = j = 0; i < cache->nkeys; i++) {
+        cached = cache->keys + i;
+        if (cached->held
+            && ((cached->owner != 0 && kill(cached->owner, 0) != 0 && errno == ESRCH)
+                || (cached->ttl > 0 && cached->expiry <= now))) {
+            free(cached->key);
+            nreclaimed++;
+        } else
+            cache->keys[j++] = *cached;
+    }
+    cache->nkeys = j;
+
+    return nreclaimed;
+
+} /* end reclaim_cached(cache,now) */
+
+/****************************************************************************/
+
+static int log_cached(struct Pool* pool, char* text, size_t length)
+{
+    /* Append lines that pass leases of cached keys between an agent and
+       the local processes it hands them to to the lease log, while
+       sharing the scan lock, so that no process reclaiming leases (which
+       holds the whole file) misses them. Returns as acquire_pool. */
+
+    if (length == 0)
+        return NO_ERROR;
+
+    if (lock_range(pool->fd, F_RDLCK, SCAN_LOCK_OFFSET, 1, 1) != 0)
+        return lock_failure(pool, 1);
+
+    append_log(pool->filename, LEASE_SUFFIX, text, length, pool->durability);
+    lock_range(pool->fd, F_UNLCK, SCAN_LOCK_OFFSET, 1, 1);
+
+    return NO_ERROR;
+
+} /* end log_cached(pool,text,length) */
+
+/****************************************************************************/
+
+static int fill_cache(struct Pool* pool, int nneeded, enum Policy policy, int notifier, long* next_release, int* nconflicts)
+{
+    /* Take a block of keys from the resource file for the cache of its
+       agent, in one locked gang obtain, with at least 'nneeded' keys in
+       it. The keys are leased to the agent in the file, so its signals
+       and leases show which host holds them. If the pool cannot give a
+       whole block, just the keys needed are taken. Returns as try_obtain. */
+
+    struct Cache* cache = pool->cache;
+    pid_t   owner = pool->owner;
+    char*   host = pool->host;
+    long    ttl = pool->ttl;
+    char*   text;
+    char*   line;
+    char*   newline;
+    size_t  length;
+    FILE*   out;
+    int     nwanted = nneeded > cache->block? nneeded : cache->block;
+    int     exitcode;
+
+    pool->owner = cache->agent;
+    pool->host  = NULL;
+    pool->ttl   = 0;
+
+    for (;;) {
+        out = open_memstream(&text, &length);
+        exitcode = try_obtain(pool, nwanted, policy, out, notifier, next_release, nconflicts, 1);
+        fclose(out);
+        if (exitcode == NO_ERROR || nwanted == nneeded)
+            break;
+        free(text);
+        nwanted = nneeded;
+    }
+
+    pool->owner = owner;
+    pool->host  = host;
+    pool->ttl   = ttl;
+
+    if (exitcode != NO_ERROR) {
+        free(text);
+        return exitcode;
+    }
+
+    for (line = text; (newline = strchr(line, '\n')) != NULL; line = newline + 1) {
+        if (cache->nkeys == cache->capacity) {
+            cache->capacity = cache->capacity? 2*cache->capacity : 64;
+            cache->keys = realloc(cache->keys, cache->capacity*sizeof(struct Cached));
+        }
+        cache->keys[cache->nkeys].key    = strndup(line, newline - line);
+        cache->keys[cache->nkeys].held   = 0;
+        cache->keys[cache->nkeys].owner  = 0;
+        cache->keys[cache->nkeys].ttl    = 0;
+        cache->keys[cache->nkeys].expiry = 0;
+        cache->nkeys++;
+    }
+
+    free(text);
+
+    return NO_ERROR;
+
+} /* end fill_cache(pool,nneeded,policy,notifier,next_release,nconflicts) */
+
+/****************************************************************************/
+
+static int cache_obtain(struct Pool* pool, int nwanted, enum Policy policy, FILE* out, int notifier, long* next_release, int* nconflicts)
+{
+    /* Obtain 'nwanted' resources for a local client of an agent, as
+       try_obtain does, from the keys it has cached, taking another block
+       from the resource file if there are too few. Requests with tags
+       are passed on to the file, as cached keys do not keep theirs. The
+       leases of the keys in the file pass from the agent to the client,
+       so that they are reclaimed if the client dies, but not if the agent
+       does. */
+
+    struct Cache* cache = pool->cache;
+    struct Cached* cached;
+    char*   text;
+    size_t  length;
+    char    host[HOST_LEN];
+    char    agenthost[HOST_LEN];
+    FILE*   log;
+    int*    chosen;
+    int     nchosen;
+    int     exitcode = NO_ERROR;
+    int     i;
+    long    now = current_epoch_msec();
+
+    if (pool->require != NULL || pool->prefer != NULL)
+        return try_obtain(pool, nwanted, policy, out, notifier, next_release, nconflicts, 1);
+
+    *nconflicts = 0;
+    *next_release = 0;
+    chosen = malloc(nwanted*sizeof(int));
+    nchosen = count_cached(cache, now, chosen, nwanted);
+
+    if (nchosen < nwanted) {
+        reclaim_cached(cache, now);
+        exitcode = fill_cache(pool, nwanted - nchosen, policy, notifier, next_release, nconflicts);
+        if (exitcode == NO_ERROR)
+            nchosen = count_cached(cache, now, chosen, nwanted);
+        if (exitcode == NO_ERROR && nchosen < nwanted)
+            exitcode = TIME_OUT;
+    }
+
+    if (exitcode == NO_ERROR) {
+        owner_host(pool, host);
+        host_name(agenthost);
+        log = open_memstream(&text, &length);
+        for (i = 0; i < nchosen; i++)
+            fprintf(log, "- %ld %s %s\n+ %ld %s %ld %ld %s\n", (long)cache->agent, agenthost,
+                    cache->keys[chosen[i]].key, (long)pool->owner, host, now, pool->ttl,
+                    cache->keys[chosen[i]].key);
+        fclose(log);
+        exitcode = log_cached(pool, text, length);
+        free(text);
+    }
+
+    if (exitcode == NO_ERROR) {
+        for (i = 0; i < nchosen; i++) {
+            cached = cache->keys + chosen[i];
+            cached->held   = 1;
+            cached->owner  = pool->owner;
+            cached->ttl    = pool->ttl;
+            cached->expiry = pool->ttl > 0? now + pool->ttl : 0;
+            fprintf(out, "%s\n", cached->key);
+        }
+        cache->lastuse = current_msec();
+    }
+
+    free(chosen);
+
+    return exitcode;
+
+} /* end cache_obtain(pool,nwanted,policy,out,notifier,next_release,nconflicts) */
+
+/****************************************************************************/
+
+static int find_cached(struct Cache* cache, char* key, pid_t owner)
+{
+    /* Index of the cached key 'key' handed out to 'owner', or else to any
+       process, or -1 if it is not handed out at all */
+
+    int     any = -1;
+    int     i;
+
+    for (i = 0; i < cache->nkeys; i++)
+        if (cache->keys[i].held && strcmp(cache->keys[i].key, key) == 0) {
+            if (cache->keys[i].owner == owner)
+                return i;
+            if (any < 0)
+                any = i;
+        }
+
+    return any;
+
+} /* end find_cached(cache,key,owner) */
+
+/****************************************************************************/
+
+static int cache_release(struct Pool* pool, int nkeys, char** keys, long delay)
+{
+    /* Release 'keys' for a local client of an agent, as
+       release_pool_resources does: cached keys go back to the cache, to
+       be handed out again after 'delay' milliseconds, and other keys are
+       released in the resource file. The leases of cached keys pass back
+       to the agent in the file, unless they were reclaimed from the
+       client in the meantime, in which case the agent forgets the keys
+       and NOT_FOUND is returned. */
+
+    struct Cache* cache = pool->cache;
+    struct Lease* leases = NULL;
+    char**  others = malloc(nkeys*sizeof(char*));
+    int*    found = malloc(nkeys*sizeof(int));
+    char*   text;
+    size_t  length;
+    char    host[HOST_LEN];
+    FILE*   log;
+    int     nothers = 0;
+    int     nleases = 0;
+    int     check = 0;
+    int     exitcode = NO_ERROR;
+    int     i;
+    int     j;
+    long    now = current_epoch_msec();
+
+    for (i = 0; i < nkeys; i++) {
+        found[i] = j = find_cached(cache, keys[i], pool->owner);
+        if (j >= 0) {
+            /* a key released twice takes two cached uses of it */
+            cache->keys[j].held = 0;
+            if (pool->owner != 0 || cache->keys[j].ttl > 0)
+                check = 1;
+        } else
+            others[nothers++] = keys[i];
+    }
+
+    if (nothers < nkeys) {
+        host_name(host);
+        if (lock_range(pool->fd, F_RDLCK, SCAN_LOCK_OFFSET, 1, 1) != 0) {
+            exitcode = lock_failure(pool, 1);
+            for (i = 0; i < nkeys; i++)
+                if (found[i] >= 0)
+                    cache->keys[found[i]].held = 1;
+            nothers = 0;
+        } else {
+            /* a lease cannot be reclaimed while the scan lock is shared */
+            if (check)
+                nleases = read_leases(pool->filename, &leases);
+            log = open_memstream(&text, &length);
+            for (i = 0; i < nkeys; i++) {
+                if (found[i] < 0)
+                    continue;
+                j = check? find_lease(leases, nleases, keys[i], pool->owner, host, 1) : 0;
+                if (j >= 0) {
+                    if (check) {
+                        free(leases[j].key);
+                        leases[j].key = NULL;
+                    }
+                    fprintf(log, "- %ld %s %s\n+ %ld %s %ld 0 %s\n", (long)pool->owner,
+                            host, keys[i], (long)cache->agent, host, now, keys[i]);
+                    cache->keys[found[i]].expiry = delay > 0? now + delay : 0;
+                } else {
+                    error(0, 0, "Key '%s' is no longer leased to %ld; not releasing it.",
+                          keys[i], (long)pool->owner);
+                    /* it was reclaimed from the client, or is another's */
+                    if (cache->keys[found[i]].owner == pool->owner) {
+                        free(cache->keys[found[i]].key);
+                        cache->keys[found[i]].key = NULL;
+                    } else
+                        cache->keys[found[i]].held = 1;
+                    exitcode = NOT_FOUND;
+                }
+            }
+            fclose(log);
+            append_log(pool->filename, LEASE_SUFFIX, text, length, pool->durability);
+            lock_range(pool->fd, F_UNLCK, SCAN_LOCK_OFFSET, 1, 1);
+            free(text);
+            free_leases(leases, nleases);
+            /* forget the keys that were reclaimed */
+            for (i = j = 0; i < cache->nkeys; i++)
+                if (cache->keys[i].key != NULL)
+                    cache->keys[j++] = cache->keys[i];
+            cache->nkeys = j;
+        }
+    }
+
+    if (nothers > 0 && (i = release_pool_resources(pool, nothers, others, delay)) != NO_ERROR)
+        exitcode = i;
+
+    cache->lastuse = current_msec();
+    free(others);
+    free(found);
+
+    return exitcode;
+
+} /* end cache_release(pool,nkeys,keys,delay) */
+
+/****************************************************************************/
+
+static int cache_renew(struct Pool* pool, int nkeys, char** keys, pid_t owner, long ttl)
+{
+    /* Renew leases for a local client of an agent, as renew_resource
+       does. Cached keys are leased to the client in the resource file as
+       well, so all leases are renewed there, and those of cached keys
+       locally as well. */
+
+    struct Cache* cache = pool->cache;
+    struct Cached* cached;
+    int     exitcode = renew_resource(pool->filename, nkeys, keys, owner, ttl, pool->durability);
+    int     i;
+    int     j;
+    long    now = current_epoch_msec();
+
+    for (i = 0; i < nkeys; i++) {
+        j = find_cached(cache, keys[i], owner);
+        if (j >= 0 && cache->keys[j].owner == owner) {
+            cached = cache->keys + j;
+            if (ttl > 0)
+                cached->ttl = ttl;
+            cached->expiry = cached->ttl > 0? now + cached->ttl : 0;
+        }
+    }
+
+    return exitcode;
+
+} /* end cache_renew(pool,nkeys,keys,owner,ttl) */
+
+/****************************************************************************/
+
+static void return_cached(struct Pool* pool)
+{
+    /* Give the free keys in the cache of an agent back to the resource
+       file, e.g. when it has been idle. Keys with a delayed release that
+       is not due yet stay until it is. */
+
+    struct Cache* cache = pool->cache;
+    pid_t   owner = pool->owner;
+    char**  keys = malloc((cache->nkeys + 1)*sizeof(char*));
+    int     nkeys = 0;
+    int     i;
+    int     j;
+    long    now = current_epoch_msec();
+
+    for (i = j = 0; i < cache->nkeys; i++)
+        if (cached_free(cache->keys + i, now))
+            keys[nkeys++] = cache->keys[i].key;
+        else
+            cache->keys[j++] = cache->keys[i];
+    cache->nkeys = j;
+
+    if (nkeys > 0) {
+        pool->owner = cache->agent;
+        release_pool_resources(pool, nkeys, keys, 0);
+        pool->owner = owner;
+    }
+
+    for (i = 0; i < nkeys; i++)
+        free(keys[i]);
+    free(keys);
+
+} /* end return_cached(pool) */
+
+/****************************************************************************/
+
+static void forget_cached(struct Cache* cache)
+{
+    /* Forget the keys still in the cache of an agent that is about to
+       exit. Those handed out are leased to their holders in the resource
+       file already, so they can be released there directly, and those
+       with a delayed release that is not due yet are reclaimed from the
+       agent once it has exited. */
+
+    int     i;
+
+    for (i = 0; i < cache->nkeys; i++)
+        free(cache->keys[i].key);
+    cache->nkeys = 0;
+
+} /* end forget_cached(cache) */
+
+/****************************************************************************/
+
+static long cache_waittime(struct Cache* cache, long waittime)
+{
+    /* Milliseconds that the agent can wait for requests, at most
+       'waittime' or forever if negative, before free keys in its cache
+       become idle, or keys with a delayed release become free */
+
+    long    now = current_epoch_msec();
+    long    until;
+    int     i;
+
+    for (i = 0; i < cache->nkeys; i++)
+        if (!cache->keys[i].held) {
+            if (cache->keys[i].expiry > now)
+                until = cache->keys[i].expiry - now + 1;
+            else
+                until = cache->lastuse + cache->idle - current_msec();
+            if (until < 0)
+                until = 0;
+            if (waittime < 0 || until < waittime)
+                waittime = until;
+        }
+
+    return waittime;
+
+} /* end cache_waittime(cache,waittime) */
+
+/****************************************************************************/
+
+static int obtain_for_client(struct Pool* pool, int nwanted, enum Policy policy, FILE* out, int notifier, long* next_release, int* nconflicts)
+{
+    /* Obtain resources for a client of the daemon, or of an agent */
+
+    if (pool->cache != NULL)
+        return cache_obtain(pool, nwanted, policy, out, notifier, next_release, nconflicts);
+
+    return try_obtain(pool, nwanted, policy, out, notifier, next_release, nconflicts, 1);
+
+} /* end obtain_for_client(pool,nwanted,policy,out,notifier,next_release,nconflicts) */
+
+/****************************************************************************/
+
+static int release_for_client(struct Pool* pool, int nkeys, char** keys, long delay)
+{
+    /* Release resources for a client of the daemon, or of an agent */
+
+    if (pool->cache != NULL)
+        return cache_release(pool, nkeys, keys, delay);
+
+    return release_pool_resources(pool, nkeys, keys, delay);
+
+} /* end release_for_client(pool,nkeys,keys,delay) */
+
+/****************************************************************************/
+
+static int renew_for_client(struct Pool* pool, int nkeys, char** keys, pid_t owner, long ttl)
+{
+    /* Renew leases for a client of the daemon, or of an agent, on the
+       host of the pool (see handle_request) */
+
+    if (pool->cache != NULL)
+        return cache_renew(pool, nkeys, keys, owner, ttl);
+
+    return renew_leases(pool->filename, nkeys, keys, owner, pool->host, ttl, pool->durability);
+
+} /* end renew_for_client(pool,nkeys,keys,owner,ttl) */
+
+/****************************************************************************/
+
+static void respond(struct Pool* pool, int fd, int exitcode, char* keys, size_t length)
+{
+    /* Send an exit code and any keys to a client, as a line "EXITCODE N"
+       followed by the N keys, one per line. If the client has gone away,
+       keys obtained for it are released again, so that they do not go
+       missing, and the connection is shut down (see serve_resource_file). */
+
+    char   header[48];
+    char** lines;
+    int    nlines = 0;
+    int    failed;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        if (keys[i] == '\n')
+            nlines++;
+
+    snprintf(header, sizeof(header), "%d %d\n", exitcode, nlines);
+
+    failed = send_all(fd, header, strlen(header)) != 0
+          || send_all(fd, keys, length) != 0;
+
+    if (failed) {
+        shutdown(fd, SHUT_RDWR);
+        if (exitcode == NO_ERROR && length > 0) {
+            nlines = split_lines(keys, &lines);
+            release_for_client(pool, nlines, lines, 0);
+            free(lines);
+        }
+    }
+
+} /* end respond(pool,fd,exitcode,keys,length) */
+
+/****************************************************************************/
+
+struct Waiter {
+    /* a client of the daemon waiting for resources */
+    int    fd;          /* connection to the client                         */
+    int    nwanted;     /* number of keys it wants                          */
+    enum Policy policy; /* where to start looking for free keys             */
+    long   deadline;    /* when to give up (monotonic), or NO_TIMEOUT       */
+    pid_t  owner;       /* process to lease the keys to                     */
+    char*  host;        /* host of that process, or NULL (to be freed)      */
+    long   ttl;         /* milliseconds to lease them for, if positive      */
+    char*  require;     /* tags the keys must have, or NULL (to be freed)   */
+    char*  prefer;      /* tags the keys should have, or NULL (to be freed) */
+    int    priority;    /* priority among waiters, higher first             */
+    long   ticket;      /* number in the queue of waiters of the file, or 0 */
+    long   queued;      /* when that ticket was last refreshed              */
+};
+
+/****************************************************************************/
+
+static void free_waiter(struct Pool* pool, struct Waiter* waiter)
+{
+    /* Take a waiter out of the queue of the file, if it is in it, and
+       free the strings it holds */
+
+    pool->ticket = waiter->ticket;
+    leave_queue(pool, 0);
+
+    free(waiter->host);
+    free(waiter->require);
+    free(waiter->prefer);
+
+} /* end free_waiter(pool,waiter) */
+
+/****************************************************************************/
+
+static int serve_waiter(struct Pool* pool, struct Waiter* waiter, int notifier, long* next_release, int* nconflicts)
+{
+    /* Try to obtain the resources a client waits for, and respond if they
+       were obtained, or can no longer be. Returns whether it responded,
+       in which case the waiter is done with. */
+
+    char*  keys;
+    size_t length;
+    FILE*  out = open_memstream(&keys, &length);
+    int    exitcode;
+
+    pool->owner = waiter->owner;
+    pool->host  = waiter->host;
+    pool->ttl   = waiter->ttl;
+    pool->require = waiter->require;
+    pool->prefer  = waiter->prefer;
+    pool->priority = waiter->priority;
+    pool->ticket  = waiter->ticket;
+    pool->queued  = waiter->queued;
+    exitcode = obtain_for_client(pool, waiter->nwanted, waiter->policy, out,
+                                 notifier, next_release, nconflicts);
+    fclose(out);
+    pool->host  = NULL;
+
+    if (exitcode == TIME_OUT
+        && (waiter->deadline == NO_TIMEOUT || current_msec() < waiter->deadline)) {
+        /* the daemon waits in the queue of the file on behalf of clients */
+        join_queue(pool, waiter->nwanted, waiter->deadline == NO_TIMEOUT? 0 :
+                   current_epoch_msec() + waiter->deadline - current_msec());
+        waiter->ticket = pool->ticket;
+        waiter->queued = pool->queued;
+        pool->ticket = 0;
+        free(keys);
+        return 0;
+    }
+
+    /* a waiter that got its keys has left the queue already */
+    waiter->ticket = pool->ticket;
+    pool->ticket = 0;
+    respond(pool, waiter->fd, exitcode, keys, length);
+    free(keys);
+    free_waiter(pool, waiter);
+
+    return 1;
+
+} /* end serve_waiter(pool,waiter,notifier,next_release,nconflicts) */
+
+/****************************************************************************/
+
+enum Request {
+    /* what a request to the daemon turned out to be */
+    ANSWERED = 0,    /* it was handled and answered                          */
+    WAITING,         /* an obtain request; the client is to wait             */
+    RELEASED         /* a release, after which waiters can be tried again    */
+};
+
+/****************************************************************************/
+
+static enum Request handle_request(struct Pool* pool, int fd, char* text, struct Waiter* waiter)
+{
+    /* Handle a request from a client of the daemon. The requests are text,
+       with a command on the first line, i.e.,
+         obtain NWANTED TIMEOUT POLICY OWNER TTL REQUIRE PREFER [HOST [PRI]]
+         release DELAY OWNER [NKEYS [HOST]]
+         renew OWNER TTL [NKEYS [HOST]]
+       where tags that are not given are a '-', HOST is that of the owner,
+       PRI is the priority that orders waiters (see join_queue), and the
+       NKEYS keys of a release or renew are on the lines that follow
+       (without NKEYS, all lines up to the end of the input). */
+
+    char** lines;
+    int    nlines = split_lines(text, &lines);
+    int    policy;
+    int    nfields;
+    int    nkeys;
+    long   timeout;
+    long   delay;
+    long   owner;
+    long   ttl;
+    char   require[MAX_LINE_LEN];
+    char   prefer[MAX_LINE_LEN];
+    char   host[MAX_LINE_LEN];
+    enum Request result = ANSWERED;
+
+    waiter->priority = 0;
+
+    if (nlines == 1
+        && strlen(lines[0]) < MAX_LINE_LEN
+        && (nfields = sscanf(lines[0], "obtain %d %ld %d %ld %ld %s %s %s %d", &waiter->nwanted,
+                             &timeout, &policy, &owner, &ttl, require, prefer, host,
+                             &waiter->priority)) >= 7
+        && waiter->nwanted > 0 && policy >= FIRST_FIT && policy <= LEAST_LOADED) {
+        waiter->fd = fd;
+        waiter->policy = policy;
+        waiter->owner = (pid_t)owner;
+        waiter->host = nfields >= 8? strdup(host) : NULL;
+        waiter->ticket = 0;
+        waiter->queued = 0;
+        waiter->ttl = ttl;
+        waiter->require = strcmp(require, "-")? strdup(require) : NULL;
+        waiter->prefer = strcmp(prefer, "-")? strdup(prefer) : NULL;
+        waiter->deadline = timeout == NO_TIMEOUT? NO_TIMEOUT : current_msec() + timeout;
+        result = WAITING;
+    } else if (nlines >= 1 && strlen(lines[0]) < MAX_LINE_LEN
+               && (nfields = sscanf(lines[0], "release %ld %ld %d %s", &delay, &owner,
+                                    &nkeys, host)) >= 2) {
+        pool->owner = (pid_t)owner;
+        pool->host  = nfields == 4? host : NULL;
+        respond(pool, fd, release_for_client(pool, nlines - 1, lines + 1, delay), "", 0);
+        pool->host  = NULL;
+        result = RELEASED;
+    } else if (nlines >= 1 && strlen(lines[0]) < MAX_LINE_LEN
+               && (nfields = sscanf(lines[0], "renew %ld %ld %d %s", &owner, &ttl,
+                                    &nkeys, host)) >= 2) {
+        pool->host  = nfields == 4? host : NULL;
+        respond(pool, fd, renew_for_client(pool, nlines - 1, lines + 1, (pid_t)owner, ttl),
+                "", 0);
+        pool->host  = NULL;
+    } else
+        respond(pool, fd, ARGUMENT_ERROR, "", 0);
+
+    free(lines);
+
+    return result;
+
+} /* end handle_request(pool,fd,text,waiter) */
+
+/****************************************************************************/
+
+struct Client {
+    /* a connection to the daemon, over which requests come in; several
+       may follow each other without waiting for the responses */
+    int    fd;          /* the connection, or -1 once it is closed          */
+    char*  input;       /* text received, terminated by a '\0'              */
+    size_t start;       /* where the text not handled yet starts            */
+    size_t length;      /* length of the text                               */
+    int    ended;       /* whether the client has ended its input           */
+    int    waiting;     /* whether an obtain of it waits for resources      */
+};
+
+/****************************************************************************/
+
+static int receive_input(struct Client* client)
+{
+    /* Add what a client has sent to its input, without waiting for more.
+       Returns -1 if the connection failed. */
+
+    char    buffer[NOTIFY_BUF_LEN];
+    ssize_t nread = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if (nread < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)? 0 : -1;
+
+    if (client->start > 0) {
+        /* drop what has been handled */
+        client->length -= client->start;
+        memmove(client->input, client->input + client->start, client->length + 1);
+        client->start = 0;
+    }
+
+    if (nread == 0) {
+        /* a last line may lack its newline */
+        client->ended = 1;
+        if (client->length == 0 || client->input[client->length-1] == '\n')
+            return 0;
+        buffer[0] = '\n';
+        nread = 1;
+    }
+
+    client->input = realloc(client->input, client->length + nread + 1);
+    memcpy(client->input + client->length, buffer, nread);
+    client->length += nread;
+    client->input[client->length] = '\0';
+
+    return 0;
+
+} /* end receive_input(client) */
+
+/****************************************************************************/
+
+static size_t request_length(struct Client* client)
+{
+    /* Length of the first request in the input of a client that has not
+       been handled yet, if it has come in completely, or else 0. A release
+       or renew without NKEYS (see handle_request) takes all input until
+       the client ends it. */
+
+    char*   text = client->input + client->start;
+    char*   end = client->input + client->length;
+    char*   newline = memchr(text, '\n', end - text);
+    char*   line;
+    long    first;
+    long    second;
+    int     nkeys;
+
+    if (newline == NULL)
+        return 0;
+
+    if (sscanf(text, "release %ld %ld %d", &first, &second, &nkeys) == 3
+        || sscanf(text, "renew %ld %ld %d", &first, &second, &nkeys) == 3) {
+        for (line = newline + 1; nkeys > 0; nkeys--, line = newline + 1) {
+            newline = memchr(line, '\n', end - line);
+            if (newline == NULL)
+                return 0;
+        }
+        return line - text;
+    }
+
+    if (strncmp(text, "release ", 8) == 0 || strncmp(text, "renew ", 6) == 0)
+        return client->ended? (size_t)(end - text) : 0;
+
+    return newline + 1 - text;
+
+} /* end request_length(client) */
+
+/****************************************************************************/
+
+static int serve_client(struct Pool* pool, struct Client* client, struct Waiter** waiters, int* nwaiters, int* maxwaiters, int notifier, long* next_release, int* nconflicts)
+{
+    /* Handle the requests that a client has sent completely, in the order
+       they came in, until one has to wait for resources; obtains that have
+       to wait are added to the 'nwaiters' 'waiters', which has room for
+       'maxwaiters', ahead of those of lower priority. A client that has
+       ended its input is hung up on once all its requests are answered.
+       Returns whether there was a release. */
+
+    size_t  length;
+    char*   text;
+    int     released = 0;
+    int     i;
+    struct Waiter waiter;
+    enum Request request;
+
+    while (client->fd >= 0 && !client->waiting && (length = request_length(client)) > 0) {
+        if (*nwaiters == *maxwaiters) {
+            *maxwaiters = *maxwaiters? 2*(*maxwaiters) : 16;
+            *waiters = realloc(*waiters, *maxwaiters*sizeof(struct Waiter));
+        }
+        text = strndup(client->input + client->start, length);
+        client->start += length;
+        request = handle_request(pool, client->fd, text, *waiters + *nwaiters);
+        free(text);
+        if (request == WAITING
+            && !serve_waiter(pool, *waiters + *nwaiters, notifier, next_release, nconflicts)) {
+            /* waiters are served by priority, then in the order they came */
+            for (i = (*nwaiters)++; i > 0 && (*waiters)[i-1].priority < (*waiters)[i].priority; i--) {
+                waiter = (*waiters)[i-1];
+                (*waiters)[i-1] = (*waiters)[i];
+                (*waiters)[i] = waiter;
+            }
+            client->waiting = 1;
+        } else if (request == RELEASED)
+            released = 1;
+    }
+
+    if (client->fd >= 0 && client->ended && !client->waiting) {
+        if (client->start < client->length)
+            respond(pool, client->fd, ARGUMENT_ERROR, "", 0);
+        close(client->fd);
+        client->fd = -1;
+    }
+
+    return released;
+
+} /* end serve_client(pool,client,waiters,nwaiters,maxwaiters,notifier,next_release,nconflicts) */
+
+/****************************************************************************/
+
+static void serve_connections(struct Pool* pool, int* listeners, long polltime)
+{
+    /* Serve requests for an open resource file that come in on the two
+       'listeners' (the second may be -1), until interrupted or terminated.
+       Waiting clients are retried right after a release through the
+       daemon, when the file is modified otherwise, when a pending release
+       is due, and every POLLTIME for modifications that are not notified.
+       Requests over one connection are answered in order. */
+
+    struct sigaction action;
+    struct pollfd* pfds = NULL;
+    struct Waiter* waiters = NULL;
+    struct Client* clients = NULL;
+    int    nwaiters = 0;
+    int    maxwaiters = 0;
+    int    nclients = 0;
+    int    maxclients = 0;
+    int    notifier;
+    int    client;
+    int    retry;
+    int    served;
+    int    nconflicts = 0;
+    int    one = 1;
+    int    i;
+    int    j;
+    long   waittime;
+    long   next_release = 0;
+    long   now;
+
+    notifier = open_change_notifier(1, &pool->filename);
+    /* waiters are retried, and show themselves in the queue, that often */
+    pool->polltime = polltime;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_serving;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!Stopping) {
+
+        if (nclients == maxclients) {
+            maxclients = maxclients? 2*maxclients : 16;
+            clients = realloc(clients, maxclients*sizeof(struct Client));
+            pfds = realloc(pfds, (maxclients + 3)*sizeof(struct pollfd));
+        }
+
+        /* wake up for the first deadline and the next pending release */
+        waittime = -1;
+        if (nwaiters > 0) {
+            waittime = nconflicts > 0? 10 : polltime;
+            now = current_msec();
+            for (i = 0; i < nwaiters; i++)
+                if (waiters[i].deadline != NO_TIMEOUT && waiters[i].deadline - now < waittime)
+                    waittime = waiters[i].deadline - now;
+            if (next_release != 0 && next_release - current_epoch_msec() + 1 < waittime)
+                waittime = next_release - current_epoch_msec() + 1;
+            if (waittime < 0)
+                waittime = 0;
+        }
+        if (pool->cache != NULL)
+            waittime = cache_waittime(pool->cache, waittime);
+
+        pfds[0].fd = listeners[0];
+        pfds[0].events = POLLIN;
+        pfds[1].fd = listeners[1];
+        pfds[1].events = POLLIN;
+        pfds[2].fd = notifier;
+        pfds[2].events = POLLIN;
+        for (i = 0; i < nclients; i++) {
+            /* once the input has ended, only hang-ups show */
+            pfds[i+3].fd = clients[i].fd;
+            pfds[i+3].events = clients[i].ended? 0 : POLLIN;
+        }
+
+        i = poll(pfds, nclients + 3, waittime > INT_MAX? INT_MAX : (int)waittime);
+
+        if (i < 0)
+            continue;  /* interrupted */
+
+        retry = (i == 0) || (pfds[2].revents & POLLIN);
+
+        /* read what came in, and forget about clients that gave up */
+        for (i = 0; i < nclients; i++)
+            if ((pfds[i+3].revents & (POLLHUP|POLLERR))
+                || ((pfds[i+3].revents & POLLIN) && receive_input(clients + i) != 0)) {
+                for (j = 0; j < nwaiters && waiters[j].fd != clients[i].fd; j++)
+                    ;
+                if (j < nwaiters) {
+                    free_waiter(pool, waiters + j);
+                    memmove(waiters + j, waiters + j + 1, (nwaiters - j - 1)*sizeof(struct Waiter));
+                    nwaiters--;
+                }
+                close(clients[i].fd);
+                clients[i].fd = -1;
+            }
+
+        for (i = 0; i < 2; i++)
+            if (pfds[i].revents & POLLIN) {
+                client = accept(listeners[i], NULL, NULL);
+                if (client >= 0) {
+                    fcntl(client, F_SETFD, FD_CLOEXEC);
+                    if (i == 1)
+                        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    clients[nclients].fd = client;
+                    clients[nclients].input = calloc(1, 1);
+                    clients[nclients].start = 0;
+                    clients[nclients].length = 0;
+                    clients[nclients].ended = 0;
+                    clients[nclients].waiting = 0;
+                    nclients++;
+                    break;
+                }
+            }
+
+        for (;;) {
+            for (i = 0; i < nclients; i++)
+                if (serve_client(pool, clients + i, &waiters, &nwaiters, &maxwaiters,
+                                 notifier, &next_release, &nconflicts))
+                    retry = 1;
+
+            if (!retry)
+                break;
+
+            if (nwaiters == 0)
+                drain_change_notifier(notifier);
+
+            /* first come, first served; clients that got their response
+               can go on with their next request */
+            retry = 0;
+            served = 0;
+            for (i = j = 0; i < nwaiters; i++)
+                if (serve_waiter(pool, waiters + i, notifier, &next_release, &nconflicts)) {
+                    for (client = 0; client < nclients; client++)
+                        if (clients[client].fd == waiters[i].fd)
+                            clients[client].waiting = 0;
+                    served = 1;
+                } else
+                    waiters[j++] = waiters[i];
+            nwaiters = j;
+
+            if (!served)
+                break;
+        }
+
+        if (pool->cache != NULL && current_msec() - pool->cache->lastuse >= pool->cache->idle) {
+            /* keys sitting idle on this host are better off in the pool */
+            reclaim_cached(pool->cache, current_epoch_msec());
+            return_cached(pool);
+        }
+
+        for (i = j = 0; i < nclients; i++)
+            if (clients[i].fd >= 0)
+                clients[j++] = clients[i];
+            else
+                free(clients[i].input);
+        nclients = j;
+
+        if (pool->reopened) {
+            /* the watch is on the file that was replaced */
+            pool->reopened = 0;
+            if (notifier >= 0)
+                close(notifier);
+            notifier = open_change_notifier(1, &pool->filename);
+        }
+    }
+
+    for (i = 0; i < nwaiters; i++)
+        free_waiter(pool, waiters + i);
+    for (i = 0; i < nclients; i++) {
+        close(clients[i].fd);
+        free(clients[i].input);
+    }
+    free(waiters);
+    free(clients);
+    free(pfds);
+
+    if (notifier >= 0)
+        close(notifier);
+
+} /* end serve_connections(pool,listeners,polltime) */
+
+/****************************************************************************/
+
+int serve_resource_file(char* filename, long polltime, enum Locking locking, enum Durability durability, char* listen_on)
+{
+    /* Serve obtain and release requests for a resource file on FILE.sock,
+       and, if 'listen_on' is not NULL, on that TCP address (see
+       open_tcp_listener), until interrupted or terminated (see
+       serve_connections). The state stays in the file itself, so other
+       processes can still use the file directly. The file is kept open
+       and mapped while serving, and changes are flushed as 'durability'
+       asks. A daemon serves a single file, so for a sharded pool,
+       ARGUMENT_ERROR is returned. */
+
+    struct Pool pool;
+    struct sockaddr_un address;
+    int    listeners[2];
+    char*  addrname;
+    char** shards;
+    int    nshards = read_manifest(filename, &shards);
+
+    if (nshards > 0) {
+        free_names(shards, nshards);
+        return ARGUMENT_ERROR;
+    }
+
+    if (socket_address(filename, &address) != 0) {
+        error(0, 0, "Socket name for '%s' too long.", filename);
+        return FILE_NOT_OPEN;
+    }
+
+    if (open_pool(&pool, filename, 0, locking) != NO_ERROR)
+        return FILE_NOT_OPEN;
+
+    pool.durability = durability;
+
+    listeners[0] = open_listener(&address);
+    listeners[1] = listen_on? open_tcp_listener(filename, listen_on) : -1;
+
+    if (listeners[0] < 0 || (listen_on && listeners[1] < 0)) {
+        if (listeners[0] >= 0) {
+            unlink(address.sun_path);
+            close(listeners[0]);
+        }
+        close_pool(&pool);
+        return FILE_NOT_OPEN;
+    }
+
+    serve_connections(&pool, listeners, polltime);
+
+    unlink(address.sun_path);
+    close(listeners[0]);
+    if (listeners[1] >= 0) {
+        addrname = companion_filename(filename, ADDRESS_SUFFIX);
+        unlink(addrname);
+        free(addrname);
+        close(listeners[1]);
+    }
+    close_pool(&pool);
+
+    return NO_ERROR;
+
+} /* end serve_resource_file(filename,polltime,locking,durability,listen_on) */
+
+/****************************************************************************/
+
+int agent_resource_file(char* filename, int block, long idle, long polltime, enum Locking locking, enum Durability durability)
+{
+    /* Serve as the agent for a resource file on this host, until
+       interrupted or terminated, on the socket FILE.HOST.agent, which
+       mresource calls on this host use before any daemon. The agent takes
+       keys from the file 'block' at a time, in one locked obtain, and
+       hands them out to local clients without locking the file, passing
+       their leases on to them. Keys that are free for 'idle' milliseconds
+       go back to the file, as do all free keys on exit. Changes to the
+       file are flushed as 'durability' asks. An agent serves a single
+       file, so for a sharded pool, ARGUMENT_ERROR is returned. */
+
+    struct Pool  pool;
+    struct Cache cache;
+    struct sockaddr_un address;
+    int    listeners[2];
+    char** shards;
+    int    nshards = read_manifest(filename, &shards);
+
+    if (nshards > 0) {
+        free_names(shards, nshards);
+        return ARGUMENT_ERROR;
+    }
+
+    if (agent_address(filename, &address) != 0) {
+        error(0, 0, "Socket name for '%s' too long.", filename);
+        return FILE_NOT_OPEN;
+    }
+
+    if (open_pool(&pool, filename, 0, locking) != NO_ERROR)
+        return FILE_NOT_OPEN;
+
+    pool.durability = durability;
+
+    listeners[0] = open_listener(&address);
+    listeners[1] = -1;
+
+    if (listeners[0] < 0) {
+        close_pool(&pool);
+        return FILE_NOT_OPEN;
+    }
+
+    memset(&cache, 0, sizeof(cache));
+    cache.block   = block;
+    cache.idle    = idle;
+    cache.lastuse = current_msec();
+    cache.agent   = getpid();
+    pool.cache    = &cache;
+
+    serve_connections(&pool, listeners, polltime);
+
+    /* no more requests come in once the socket has gone */
+    unlink(address.sun_path);
+    close(listeners[0]);
+    return_cached(&pool);
+    forget_cached(pool.cache);
+    free(cache.keys);
+    close_pool(&pool);
+
+    return NO_ERROR;
+
+} /* end agent_resource_file(filename,block,idle,polltime,locking,durability) */
+
+/****************************************************************************/
+
+static size_t format_record(char* text, char* argument)
+{
+    /* Write the free record for a key argument to 'text', unless it is
+       NULL, and return its length. An argument 'KEY:N' with N>1 gives a
+       counted record for KEY, which can be obtained N times at once. The
+       key may be followed by tags, as in 'KEY:N NAME=VALUE ...'. */
+
+    char*  tags = tags_start(argument, argument + strlen(argument));
+    unsigned long capacity;
+    int    keylength = argument_key_length(argument, &capacity);
+    int    width;
+
+    if (capacity == 1) {
+        if (text != NULL)
+            sprintf(text, "%c%.*s%s\n", FREE_CHAR, keylength, argument, tags);
+        return keylength + strlen(tags) + 2;
+    }
+
+    width = snprintf(NULL, 0, "%lu", capacity);
+
+    if (text != NULL)
+        sprintf(text, "%c%c%0*d/%lu %.*s%s\n", FREE_CHAR, COUNT_CHAR, width, 0, 
+                capacity, keylength, argument, tags);
+
+    return 2*width + keylength + strlen(tags) + 5;
+
+} /* end format_record(text,argument) */
+
+/****************************************************************************/
+
+static char* format_records(int argc, char**argv, size_t* length)
+{
+    /* Text of free records for the given keys (to be freed) */
+
+    char*  text;
+    size_t position = 0;
+    int    i;
+
+    *length = 0;
+    for (i = 0; i < argc; i++)
+        *length += format_record(NULL, argv[i]);
+
+    text = malloc(*length + 1);
+
+    for (i = 0; i < argc; i++) 
+        position += format_record(text + position, argv[i]);
+
+    return text;
+
+} /* end format_records(argc,argv,length) */
+
+/****************************************************************************/
+
+static int parse_number_range(char* text, size_t length, unsigned long* first, unsigned long* last, int* width)
+{
+    /* Read a number range 'N-M' or 'N..M', or a single number N, from the
+       'length' characters of 'text'. The numbers get zero-padded to 
+       'width' digits if either is written with a leading zero, as in
+       '00-15'. Returns whether the text is such a range, or -1 if it is
+       one with a number too large to represent. */
+
+    char*   end = text + length;
+    char*   second = NULL;
+    char*   p;
+
+    if (length == 0 || *text < '0' || *text > '9')
+        return 0;
+
+    for (p = text; p < end && *p >= '0' && *p <= '9'; p++)
+        ;
+
+    *width = (p - text > 1 && *text == '0')? p - text : 0;
+
+    if (p < end && *p == '-')
+        second = p + 1;
+    else if (p + 1 < end && p[0] == '.' && p[1] == '.')
+        second = p + 2;
+    else if (p < end)
+        return 0;
+
+    errno = 0;
+    *first = *last = strtoul(text, NULL, 10);
+
+    if (second == NULL)
+        return errno == ERANGE? -1 : 1;
+
+    for (p = second; p < end && *p >= '0' && *p <= '9'; p++)
+        ;
+
+    if (p == second || p != end)
+        return 0;
+
+    if (p - second > 1 && *second == '0' && p - second > *width)
+        *width = p - second;
+    *last = strtoul(second, NULL, 10);
+
+    return errno == ERANGE? -1 : 1;
+
+} /* end parse_number_range(text,length,first,last,width) */
+
+/****************************************************************************/
+
+static int parse_key_group(char* group, char*** items, size_t* length)
+{
+    /* Read a group of alternatives at the start of 'group', to be 
+       expanded into the keys that have each of them in its place:
+         [LIST]    with LIST a comma-separated list of numbers and number
+                   ranges N-M, as in 'gpu[0-3,8]' or 'node[01-64]'
+         {N..M}    a number range as in the shell, as in 'node{01..64}'
+         {A,B,..}  words as in the shell, as in 'host{a,b}'
+       Returns the number of alternatives, put in the newly allocated
+       'items', and sets 'length' to that of the group; or returns 0 if
+       the text is no such group, in which case it is part of a key, and
+       -1 if its numbers are too large or it has more than MAX_EXPANSION
+       alternatives. */
+
+    char    close = (*group == '[')? ']' : '}';
+    char*   end = strchr(group + 1, close);
+    char*   item;
+    char*   next;
+    unsigned long first;
+    unsigned long last;
+    unsigned long number;
+    int     width;
+    int     range;
+    int     nitems = 0;
+    int     capacity = 0;
+
+    if ((*group != '[' && *group != '{') || end == NULL || end == group + 1)
+        return 0;
+
+    *items = NULL;
+    *length = end - group + 1;
+
+    if (*group == '{' && memchr(group + 1, ',', end - group - 1) == NULL) {
+        /* a range, possibly descending, or not a group at all */
+        range = parse_number_range(group + 1, end - group - 1, &first, &last, &width);
+        if (range == 0 || memchr(group + 1, '.', end - group - 1) == NULL)
+            return 0;
+        if (range < 0 || (first < last? last - first : first - last) >= MAX_EXPANSION) {
+            error(0, 0, "Range '%.*s' is too large.", (int)*length, group);
+            return -1;
+        }
+        *items = malloc((first < last? last - first + 1 : first - last + 1)*sizeof(char*));
+        for (number = first; ; number += (first < last)? 1 : -1) {
+            (*items)[nitems] = malloc(width + 24);
+            sprintf((*items)[nitems++], "%0*lu", width, number);
+            if (number == last)
+                break;
+        }
+        return nitems;
+    }
+
+    for (item = group + 1; item < end; item = next + 1) {
+        next = memchr(item, ',', end - item);
+        if (next == NULL)
+            next = end;
+        if (*group == '{') {
+            /* a word */
+            first = last = 0;
+            width = -1;
+        } else if ((range = parse_number_range(item, next - item, &first, &last, &width)) == 0
+                   || memchr(item, '.', next - item) != NULL || (range > 0 && first > last)) {
+            free_names(*items, nitems);
+            return 0;
+        } else if (range < 0 || last - first >= (unsigned long)(MAX_EXPANSION - nitems)) {
+            error(0, 0, "Range '%.*s' is too large.", (int)*length, group);
+            free_names(*items, nitems);
+            return -1;
+        }
+        for (number = first; number <= last; number++) {
+            if (nitems == capacity) {
+                capacity = capacity? 2*capacity : 16;
+                *items = realloc(*items, capacity*sizeof(char*));
+            }
+            if (width < 0)
+                (*items)[nitems++] = strndup(item, next - item);
+            else {
+                (*items)[nitems] = malloc(width + 24);
+                sprintf((*items)[nitems++], "%0*lu", width, number);
+            }
+        }
+    }
+
+    return nitems;
+
+} /* end parse_key_group(group,items,length) */
+
+/****************************************************************************/
+
+static int expand_key_argument(char* argument, size_t from, char*** keys, int* nkeys, int* capacity)
+{
+    /* Add the keys that a key argument expands to (see parse_key_group)
+       to the 'nkeys' in 'keys', which has room for 'capacity'. Groups 
+       are looked for from offset 'from' on. Returns 0, or -1 if a group
+       is too large or there would be more than MAX_EXPANSION keys. */
+
+    char*   group;
+    char**  items;
+    char*   key;
+    size_t  length;
+    size_t  prefix;
+    int     nitems = 0;
+    int     result = 0;
+    int     i;
+
+    for (group = argument + from; *group != '\0'; group++)
+        if ((*group == '[' || *group == '{') 
+            && (nitems = parse_key_group(group, &items, &length)) != 0)
+            break;
+
+    if (nitems < 0)
+        return -1;
+
+    if (nitems == 0) {
+        if (*nkeys == MAX_EXPANSION) {
+            error(0, 0, "Keys expand to more than %d.", MAX_EXPANSION);
+            return -1;
+        }
+        if (*nkeys == *capacity) {
+            *capacity = *capacity? 2*(*capacity) : 256;
+            *keys = realloc(*keys, *capacity*sizeof(char*));
+        }
+        (*keys)[(*nkeys)++] = strdup(argument);
+        return 0;
+    }
+
+    prefix = group - argument;
+    for (i = 0; i < nitems && result == 0; i++) {
+        key = malloc(strlen(argument) + strlen(items[i]) + 1);
+        sprintf(key, "%.*s%s%s", (int)prefix, argument, items[i], group + length);
+        result = expand_key_argument(key, prefix + strlen(items[i]), keys, nkeys, capacity);
+        free(key);
+    }
+
+    free_names(items, nitems);
+
+    return result;
+
+} /* end expand_key_argument(argument,from,keys,nkeys,capacity) */
+
+/****************************************************************************/
+
+int expand_keys(int argc, char** argv, FILE* in, char*** keys)
+{
+    /* Key arguments for create_resource_file or append_resource_file from
+       the given ones, with their ranges expanded (see parse_key_group).
+       An argument '-' stands for the lines read from 'in', one key
+       argument each. Returns the number of keys, which are put in 
+       'keys'; those are to be freed with free_names. Returns -1 if the
+       arguments do not expand (see expand_key_argument). */
+
+    char*   line = NULL;
+    size_t  linesize = 0;
+    ssize_t length;
+    int     nkeys = 0;
+    int     capacity = 0;
+    int     result = 0;
+    int     i;
+
+    *keys = NULL;
+
+    for (i = 0; i < argc && result == 0; i++) {
+        if (strcmp(argv[i], "-") != 0) {
+            result = expand_key_argument(argv[i], 0, keys, &nkeys, &capacity);
+            continue;
+        }
+        while (result == 0 && (length = getline(&line, &linesize, in)) > 0) {
+            while (length > 0 && (line[length-1] == '\n' || line[length-1] == '\r'))
+                line[--length] = '\0';
+            if (length > 0)
+                result = expand_key_argument(line, 0, keys, &nkeys, &capacity);
+        }
+    }
+
+    free(line);
+
+    if (result != 0) {
+        free_names(*keys, nkeys);
+        *keys = NULL;
+        return -1;
+    }
+
+    return nkeys;
+
+} /* end expand_keys(argc,argv,in,keys) */
+
+/****************************************************************************/
+
+static int replace_pool_file(struct Pool* pool, char* contents, size_t size)
+{
+    /* Replace the resource file of a pool that is locked as a whole by a
+       file with 'contents', as replace_file does, and carry on with the
+       new file, locked and mapped. The new file is locked before it gets
+       its name, so other processes never get to see it unlocked: those
+       that wait for the lock on the old file open the new one once they
+       get that lock (see reopen_replaced_pool), and then wait for this
+       one's lock to be released. */
+
+    char*   tempname = temporary_filename(pool->filename);
+    int     fd = write_replacement(pool->filename, contents, size, tempname, pool->durability);
+
+    if (fd >= 0 && (apply_lock(fd, &pool->set_lock, 0) != 0 
+                    || rename(tempname, pool->filename) != 0)) {
+        close(fd);
+        unlink(tempname);
+        fd = -1;
+    }
+
+    free(tempname);
+
+    if (fd < 0)
+        return FILE_NOT_OPEN;
+
+    /* closing the old file drops the lock on it */
+    unmap_pool(pool);
+    close(pool->fd);
+    pool->fd = fd;
+    pool->reopened = 1;
+
+    return map_pool(pool);
+
+} /* end replace_pool_file(pool,contents,size) */
+
+/****************************************************************************/
+
+static int grow_index(struct Pool* pool, uint32_t nrecords)
+{
+    /* Rewrite an indexed file locked as a whole with a larger bitmap,
+       offset table and hash table, with room for at least 'nrecords'
+       records. The body moves up, so all record offsets shift, and the
+       keys are hashed anew for the larger table. The rewritten file
+       replaces the old one (see replace_pool_file), so a crash leaves
+       either file, never a torn one. */
+
+    struct IndexHeader* index = pool->index;
+    struct IndexHeader* newindex;
+    uint32_t capacity = index->capacity? index->capacity : INDEX_MIN_CAP;
+    uint64_t body;
+    uint64_t shift;
+    uint64_t* offsets;
+    uint32_t* keyslots;
+    uint32_t i;
+    size_t   size;
+    char*    contents;
+    int      exitcode = NO_ERROR;
+
+    while (capacity < nrecords)
+        capacity *= 2;
+
+    body  = index_body_offset(capacity);
+    shift = body - index->body;
+    size  = pool->size + shift;
+    contents = calloc(size, 1);
+
+    newindex = (struct IndexHeader*)contents;
+    *newindex = *index;
+    newindex->capacity = capacity;
+    newindex->body = body;
+    memcpy(contents + sizeof(struct IndexHeader), pool->freebits, index->capacity/8);
+    offsets = (uint64_t*)(contents + sizeof(struct IndexHeader) + capacity/8);
+    keyslots = (uint32_t*)(offsets + capacity);
+    for (i = 0; i < index->nrecords; i++) {
+        offsets[i] = pool->offsets[i] + shift;
+        insert_key(keyslots, 2*capacity, record_key(pool->data + pool->offsets[i]), 
+                   key_length(pool, pool->data + pool->offsets[i]), i);
+    }
+    memcpy(contents + body, pool->data + index->body, pool->size - index->body);
+
+    exitcode = replace_pool_file(pool, contents, size);
+
+    free(contents);
+
+    return exitcode;
+
+} /* end grow_index(pool,nrecords) */
+
+/****************************************************************************/
+
+static int append_records(struct Pool* pool, int argc, char**argv)
+{
+    /* Append free records for the given keys to a locked resource file,
+       updating the bitmap and offset table if the file is indexed */
+
+    struct IndexHeader* index;
+    size_t   length;
+    size_t   end;
+    uint32_t number;
+    int      exitcode = NO_ERROR;
+    int      i;
+    char*    text;
+    char*    record;
+    char*    key;
+
+    if (pool->index != NULL && pool->index->nrecords + (uint32_t)argc > pool->index->capacity) {
+        exitcode = grow_index(pool, pool->index->nrecords + argc);
+        if (exitcode != NO_ERROR)
+            return exitcode;
+    }
+
+    end = pool->size;
+    text = format_records(argc, argv, &length);
+
+    pool->unsynced = 1;
+    if (pwrite(pool->fd, text, length, end) != (ssize_t)length)
+        exitcode = FILE_NOT_OPEN;
+
+    index = pool->index;
+
+    if (exitcode == NO_ERROR && index != NULL) {
+        for (i = 0, record = text; i < argc; i++, record = strchr(key, '\n') + 1) {
+            number = index->nrecords++;
+            pool->offsets[number] = end + (record - text);
+            pool->freebits[number/64] |= (uint64_t)1 << (number%64);
+            key = record_key(record);
+            insert_key(pool->keyslots, 2*index->capacity, key, 
+                       tags_start(key, strchr(key, '\n')) - key, number);
+        }
+        index->nfree += argc;
+        write_back(pool, pool->freebits, index->body - sizeof(struct IndexHeader));
+        write_back(pool, index, sizeof(struct IndexHeader));
+    }
+
+    free(text);
+
+    return exitcode;
+
+} /* end append_records(pool,argc,argv) */
+
+/****************************************************************************/
+
+int append_resource_file(char* filename, int argc, char**argv, enum Durability durability) 
+{
+    /* Append possible keys to a resource file that could be in use already,
+       or to the shards of a sharded pool that they belong to, flushing
+       them to disk as 'durability' asks */
+    
+    struct Pool pool;
+    char**  shards;
+    char**  selected;
+    int     nselected;
+    int     nshards = read_manifest(filename, &shards);
+    int     exitcode = NO_ERROR;
+    int     result;
+    int     i;
+
+    if (nshards > 0) {
+        selected = malloc((argc + 1)*sizeof(char*));
+        for (i = 0; i < nshards; i++) {
+            nselected = select_shard_keys(argc, argv, nshards, i, 1, selected);
+            result = nselected? append_resource_file(shards[i], nselected, selected, durability)
+                                 : NO_ERROR;
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+        free(selected);
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    exitcode = open_pool(&pool, filename, O_CREAT, LOCK_FILE);
+
+    if (exitcode == NO_ERROR) {
+
+        pool.durability = durability;
+        exitcode = lock_pool(&pool);
+
+        if (exitcode == NO_ERROR)
+            exitcode = append_records(&pool, argc, argv);
+
+        unlock_pool(&pool);
+        close_pool(&pool);
+
+    }
+
+    return exitcode;
+    
+} /* end append_resource_file */
+
+/****************************************************************************/
+
+int create_resource_file(char* filename, int argc, char**argv, int indexed, int nshards, enum Durability durability) 
+{
+    /* Create a resource file with the given keys, all free. An indexed 
+       file starts out as an empty index, to which the keys get appended.
+       With more than one shard, the file becomes the manifest of a pool
+       of shard files FILE.0 to FILE.K-1 (listed by their name relative to
+       the manifest), among which the keys are divided by their hash. 
+       The file is written under a temporary name, FILE.PID.tmp, and then
+       renamed to FILE, so that a pool that is replaced is never seen
+       half-written; it keeps the permissions of the file it replaces, and
+       is on disk before the rename if 'durability' asks for that. */
+
+    char*  tempname = temporary_filename(filename);
+    FILE*  f;
+    struct IndexHeader index;
+    struct stat status;
+    char*  base = strrchr(filename, '/')? strrchr(filename, '/') + 1 : filename;
+    char*  shardname;
+    char*  pendingname;
+    char*  cursorname;
+    char*  leasename;
+    char** selected;
+    char*  text;
+    size_t length;
+    int    nselected;
+    int    result;
+    int    exitcode = NO_ERROR;
+    int    i;
+
+    f = fopen(tempname, "w");
+
+    if (f == NULL) {
+        free(tempname);
+        return FILE_NOT_OPEN;
+    }
+
+    if (stat(filename, &status) == 0)
+        fchmod(fileno(f), status.st_mode & 07777);
+
+    if (nshards > 1) {
+
+        fputs(SHARD_MAGIC, f);
+        shardname = malloc(strlen(filename) + 16);
+        selected = malloc((argc + 1)*sizeof(char*));
+        for (i = 0; i < nshards; i++) {
+            fprintf(f, "%s.%d\n", base, i);
+            sprintf(shardname, "%s.%d", filename, i);
+            nselected = select_shard_keys(argc, argv, nshards, i, 1, selected);
+            result = create_resource_file(shardname, nselected, selected, indexed, 1, durability);
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+        free(selected);
+        free(shardname);
+
+    } else if (indexed) {
+
+        memset(&index, 0, sizeof(index));
+        memcpy(index.magic, INDEX_MAGIC, sizeof(index.magic));
+        index.version = INDEX_VERSION;
+        index.body = index_body_offset(0);
+        fwrite(&index, sizeof(index), 1, f);
+        if (fflush(f) != 0)
+            exitcode = FILE_NOT_OPEN;
+        else
+            exitcode = append_resource_file(tempname, argc, argv, durability);
+
+    } else {
+
+        text = format_records(argc, argv, &length);
+        fwrite(text, 1, length, f);
+        free(text);
+
+    }
+
+    /* the new file has to be on disk before it replaces the old one */
+    if (exitcode == NO_ERROR && durability != SYNC_NONE
+        && (fflush(f) != 0 || fdatasync(fileno(f)) != 0))
+        exitcode = FILE_NOT_OPEN;
+
+    if (fclose(f) != 0 && exitcode == NO_ERROR)
+        exitcode = FILE_NOT_OPEN;
+
+    if (exitcode == NO_ERROR && nshards <= 1) {
+        /* releases queued for a previous incarnation of the file are void,
+           and so are its cursor and its leases */
+        pendingname = companion_filename(filename, PENDING_SUFFIX);
+        cursorname  = companion_filename(filename, CURSOR_SUFFIX);
+        leasename   = companion_filename(filename, LEASE_SUFFIX);
+        unlink(pendingname);
+        unlink(cursorname);
+        unlink(leasename);
+        free(pendingname);
+        free(cursorname);
+        free(leasename);
+    }
+
+    if (exitcode == NO_ERROR && rename(tempname, filename) != 0)
+        exitcode = FILE_NOT_OPEN;
+
+    if (exitcode != NO_ERROR)
+        unlink(tempname);
+
+    free(tempname);
+
+    return exitcode;
+
+} /* end create_resource_file */
+
+/****************************************************************************/
+
+static char* index_image(struct Pool* pool, size_t* size)
+{
+    /* Contents of an indexed file with the records of a mapped plain file
+       as they are, so obtained keys remain obtained. Returns the contents,
+       newly allocated, and puts their length in 'size'. */
+
+    struct IndexHeader* index;
+    uint64_t* freebits;
+    uint64_t* offsets;
+    uint32_t* keyslots;
+    uint32_t nrecords = count_records(pool, UINT32_MAX);
+    uint32_t capacity = INDEX_MIN_CAP;
+    uint32_t number;
+    uint64_t body;
+    char*    contents;
+    char*    record;
+
+    while (capacity < nrecords)
+        capacity *= 2;
+
+    body = index_body_offset(capacity);
+    *size = body + pool->size;
+    contents = calloc(*size, 1);
+
+    index = (struct IndexHeader*)contents;
+    memcpy(index->magic, INDEX_MAGIC, sizeof(index->magic));
+    index->version  = INDEX_VERSION;
+    index->nrecords = nrecords;
+    index->capacity = capacity;
+    index->body     = body;
+    freebits = (uint64_t*)(contents + sizeof(struct IndexHeader));
+    offsets  = freebits + capacity/64;
+    keyslots = (uint32_t*)(offsets + capacity);
+
+    for (record = first_record(pool), number = 0; 
+         record != NULL; 
+         record = next_record(pool, record), number++) {
+        offsets[number] = body + (record - pool->data);
+        insert_key(keyslots, 2*capacity, record_key(record), key_length(pool, record), number);
+        if (*record == FREE_CHAR) {
+            freebits[number/64] |= (uint64_t)1 << (number%64);
+            index->nfree++;
+        } else if (*record == CLAIM_CHAR)
+            index->nclaimed++;
+    }
+    if (pool->size > 0)
+        memcpy(contents + body, pool->data, pool->size);
+
+    return contents;
+
+} /* end index_image(pool,size) */
+
+/****************************************************************************/
+
+int convert_resource_file(char* filename, enum Durability durability)
+{
+    /* Give a plain resource file, which may be in use already, an index.
+       The file is rewritten under the lock, with the records as they are,
+       so obtained keys remain obtained, and replaces the old one as
+       compaction does, as durably as 'durability' asks. For a sharded
+       pool, each shard gets an index. */
+
+    struct Pool pool;
+    size_t   size;
+    char*    contents;
+    char*    cursorname;
+    char**   shards;
+    int      nshards = read_manifest(filename, &shards);
+    int      exitcode = NO_ERROR;
+    int      result;
+    int      i;
+
+    if (nshards > 0) {
+        for (i = 0; i < nshards; i++) {
+            result = convert_resource_file(shards[i], durability);
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    exitcode = open_pool(&pool, filename, 0, LOCK_FILE);
+
+    if (exitcode != NO_ERROR)
+        return exitcode;
+
+    exitcode = lock_pool(&pool);
+
+    if (exitcode == NO_ERROR && pool.index == NULL) {
+
+        contents = index_image(&pool, &size);
+
+        exitcode = replace_file(filename, contents, size, durability);
+
+        free(contents);
+
+        /* the cursor of a plain file is a byte offset, which moved */
+        cursorname = companion_filename(filename, CURSOR_SUFFIX);
+        unlink(cursorname);
+        free(cursorname);
+    }
+
+    unlock_pool(&pool);
+    close_pool(&pool);
+
+    return exitcode;
+
+} /* end convert_resource_file(filename,durability) */
+
+/****************************************************************************/
+
+int export_resource_file(char* filename)
+{
+    /* Print the records of a resource file in the plain format; for a
+       sharded pool, those of all shards */
+
+    struct Pool pool;
+    char*   start;
+    char**  shards;
+    int     nshards = read_manifest(filename, &shards);
+    int     exitcode = NO_ERROR;
+    int     result;
+    int     i;
+
+    if (nshards > 0) {
+        for (i = 0; i < nshards; i++) {
+            result = export_resource_file(shards[i]);
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    exitcode = open_pool(&pool, filename, 0, LOCK_RECORDS);
+
+    if (exitcode != NO_ERROR)
+        return exitcode;
+
+    exitcode = lock_pool(&pool);
+
+    if (exitcode == NO_ERROR && pool.size > 0) {
+        start = pool.index? pool.data + pool.index->body : pool.data;
+        fwrite(start, 1, pool.data + pool.size - start, stdout);
+    }
+
+    unlock_pool(&pool);
+    close_pool(&pool);
+
+    return exitcode;
+
+} /* end export_resource_file(filename) */
+
+/****************************************************************************/
+
+static void retire_record(struct Pool* pool, char* record)
+{
+    /* Take a record of a locked file out of service: a free record is
+       removed right away, while one in use is marked to be removed once
+       it is released (see release_record). Removed records stay in the
+       file, but are never obtained, until the file gets compacted. */
+
+    if (*record != RETIRED_CHAR && *record != DRAIN_CHAR)
+        set_signal(pool, record, record_in_use(record)? DRAIN_CHAR : RETIRED_CHAR);
+
+} /* end retire_record(pool,record) */
+
+/****************************************************************************/
+
+static int remove_records(struct Pool* pool, int nkeys, char** keys)
+{
+    /* Take the records with 'keys' in a locked resource file out of
+       service (see retire_record), finding them with a single pass 
+       through the file, or by hash lookups if the file is indexed. 
+       Returns NOT_FOUND if any of the keys is not in the file. */
+
+    char*    record;
+    size_t   length;
+    uint32_t nslots = pool->index? 2*pool->index->capacity : 0;
+    uint32_t slot;
+    int      exitcode = NO_ERROR;
+    int      i;
+    size_t*  keylength = malloc(nkeys*sizeof(size_t));
+    char*    found = calloc(nkeys, 1);
+
+    for (i = 0; i < nkeys; i++)
+        keylength[i] = strlen(keys[i]);
+
+    for (i = 0; i < nkeys && nslots > 0; i++)
+        for (slot = key_slot(keys[i], keylength[i], nslots); 
+             pool->keyslots[slot] != 0; 
+             slot = (slot + 1) % nslots) {
+            record = pool->data + pool->offsets[pool->keyslots[slot] - 1];
+            if (key_length(pool, record) == keylength[i]
+                && memcmp(record_key(record), keys[i], keylength[i]) == 0) {
+                retire_record(pool, record);
+                found[i] = 1;
+            }
+        }
+
+    for (record = first_record(pool); 
+         record != NULL && pool->index == NULL; 
+         record = next_record(pool, record)) {
+        length = key_length(pool, record);
+        for (i = 0; i < nkeys; i++)
+            if (keylength[i] == length && memcmp(record_key(record), keys[i], length) == 0) {
+                retire_record(pool, record);
+                found[i] = 1;
+            }
+    }
+
+    for (i = 0; i < nkeys; i++)
+        if (!found[i])
+            exitcode = NOT_FOUND;
+
+    free(found);
+    free(keylength);
+
+    return exitcode;
+
+} /* end remove_records(pool,nkeys,keys) */
+
+/****************************************************************************/
+
+int remove_resource_file(char* filename, int nkeys, char** keys, enum Durability durability)
+{
+    /* Take keys out of service in a resource file that could be in use 
+       (see retire_record), or in the shards of a sharded pool that they
+       belong to, flushing the change as 'durability' asks */
+
+    struct Pool pool;
+    char**  shards;
+    char**  selected;
+    int     nselected;
+    int     nshards = read_manifest(filename, &shards);
+    int     exitcode = NO_ERROR;
+    int     result;
+    int     i;
+
+    if (nshards > 0) {
+        selected = malloc((nkeys + 1)*sizeof(char*));
+        for (i = 0; i < nshards; i++) {
+            nselected = select_shard_keys(nkeys, keys, nshards, i, 0, selected);
+            result = nselected? remove_resource_file(shards[i], nselected, selected, durability)
+                              : NO_ERROR;
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+        free(selected);
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    exitcode = open_pool(&pool, filename, 0, LOCK_FILE);
+
+    if (exitcode == NO_ERROR) {
+
+        pool.durability = durability;
+        exitcode = lock_pool(&pool);
+
+        if (exitcode == NO_ERROR)
+            exitcode = remove_records(&pool, nkeys, keys);
+
+        unlock_pool(&pool);
+        close_pool(&pool);
+
+    }
+
+    return exitcode;
+
+} /* end remove_resource_file(filename,nkeys,keys,durability) */
+
+/****************************************************************************/
+
+int compact_resource_file(char* filename, enum Durability durability)
+{
+    /* Rebuild a resource file, which may be in use, without the records
+       of removed keys; the other records keep their state. The new file
+       replaces the old one (see replace_file) while the lock of the old
+       one is held, so that other processes see either file, but never a
+       torn one; those that wait for the lock of the old file move on to
+       the new one (see reopen_replaced_pool). The new file is written as
+       durably as 'durability' asks. For a sharded pool, each shard is
+       compacted. */
+
+    struct Pool pool;
+    struct Pool plain;
+    char*   text;
+    size_t  length;
+    char*   contents;
+    size_t  size;
+    char*   record;
+    char*   cursorname;
+    FILE*   out;
+    char**  shards;
+    int     nshards = read_manifest(filename, &shards);
+    int     nremoved = 0;
+    int     exitcode = NO_ERROR;
+    int     result;
+    int     i;
+
+    if (nshards > 0) {
+        for (i = 0; i < nshards; i++) {
+            result = compact_resource_file(shards[i], durability);
+            if (result != NO_ERROR)
+                exitcode = result;
+        }
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    exitcode = open_pool(&pool, filename, 0, LOCK_FILE);
+
+    if (exitcode != NO_ERROR)
+        return exitcode;
+
+    exitcode = lock_pool(&pool);
+
+    if (exitcode == NO_ERROR) {
+
+        out = open_memstream(&text, &length);
+        for (record = first_record(&pool); record != NULL; record = next_record(&pool, record))
+            if (*record == RETIRED_CHAR)
+                nremoved++;
+            else
+                fwrite(record, 1, (char*)memchr(record, '\n', pool.data + pool.size - record) 
+                                  + 1 - record, out);
+        fclose(out);
+
+        if (nremoved > 0) {
+            contents = text;
+            size = length;
+            if (pool.index != NULL) {
+                /* index the remaining records anew */
+                memset(&plain, 0, sizeof(plain));
+                plain.data = text;
+                plain.size = length;
+                contents = index_image(&plain, &size);
+            }
+            exitcode = replace_file(filename, contents, size, durability);
+            if (contents != text)
+                free(contents);
+            /* the cursor of a plain file is a byte offset, which moved */
+            cursorname = companion_filename(filename, CURSOR_SUFFIX);
+            unlink(cursorname);
+            free(cursorname);
+        }
+
+        free(text);
+    }
+
+    unlock_pool(&pool);
+    close_pool(&pool);
+
+    return exitcode;
+
+} /* end compact_resource_file(filename,durability) */
+
+/****************************************************************************/
+
+int count_free_resources(char* filename, unsigned long* nkeys, unsigned long* nfree)
+{
+    /* Count the keys of a resource file, or sharded pool, and those that
+       can be obtained right now. Only a shared lock is taken, the one on
+       the scan byte that processes with record locking share, so neither
+       those nor other counting processes are held up, and the file is
+       opened for reading only. Of an indexed file, just the header is 
+       read; a plain file is scanned. Keys that other processes are busy
+       obtaining or releasing may or may not be counted as free. */
+
+    struct IndexHeader index;
+    struct stat status;
+    unsigned long shardkeys;
+    unsigned long shardfree;
+    char**  shards;
+    char*   data;
+    char*   record;
+    char*   newline;
+    char*   end;
+    int     nshards = read_manifest(filename, &shards);
+    int     exitcode = NO_ERROR;
+    int     fd;
+    int     i;
+
+    *nkeys = *nfree = 0;
+
+    if (nshards > 0) {
+        for (i = 0; i < nshards && exitcode == NO_ERROR; i++) {
+            exitcode = count_free_resources(shards[i], &shardkeys, &shardfree);
+            *nkeys += shardkeys;
+            *nfree += shardfree;
+        }
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return FILE_NOT_OPEN;
+
+    if (lock_range(fd, F_RDLCK, SCAN_LOCK_OFFSET, 1, 1) != 0) {
+        close(fd);
+        return FILE_NOT_OPEN;
+    }
+
+    if (pread(fd, &index, sizeof(index), 0) == (ssize_t)sizeof(index)
+        && memcmp(index.magic, INDEX_MAGIC, sizeof(index.magic)) == 0) {
+
+        if (index.version == INDEX_VERSION && index.nfree <= index.nrecords) {
+            *nkeys = index.nrecords;
+            *nfree = index.nfree;
+        } else
+            exitcode = BAD_FILE;
+
+    } else if (fstat(fd, &status) == 0 && status.st_size > 0) {
+
+        data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            end = data + status.st_size;
+            for (record = data; 
+                 record < end && (newline = memchr(record, '\n', end - record)) != NULL;
+                 record = newline + 1) {
+                (*nkeys)++;
+                if (*record == FREE_CHAR)
+                    (*nfree)++;
+            }
+            munmap(data, status.st_size);
+        } else
+            exitcode = FILE_NOT_OPEN;
+
+    }
+
+    lock_range(fd, F_UNLCK, SCAN_LOCK_OFFSET, 1, 1);
+    close(fd);
+
+    return exitcode;
+
+} /* end count_free_resources(filename,nkeys,nfree) */
+
+/****************************************************************************/
+
+static int print_holders(char* filename)
+{
+    /* Print who holds which keys of a resource file, or sharded pool, as
+       recorded in its lease log, one lease per line. The log is read 
+       under the same shared lock as in count_free_resources: processes
+       only append to it while sharing that lock, and rewrite it only when
+       they have the whole file. */
+
+    struct Lease* leases;
+    char**  shards;
+    int     nshards = read_manifest(filename, &shards);
+    int     nleases;
+    int     exitcode = NO_ERROR;
+    int     fd;
+    int     i;
+    long    now = current_epoch_msec();
+
+    if (nshards > 0) {
+        for (i = 0; i < nshards && exitcode == NO_ERROR; i++)
+            exitcode = print_holders(shards[i]);
+        free_names(shards, nshards);
+        return exitcode;
+    }
+
+    fd = open(filename, O_RDONLY);
+
+    if (fd < 0 || lock_range(fd, F_RDLCK, SCAN_LOCK_OFFSET, 1, 1) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return FILE_NOT_OPEN;
+    }
+
+    nleases = read_leases(filename, &leases);
+    lock_range(fd, F_UNLCK, SCAN_LOCK_OFFSET, 1, 1);
+    close(fd);
+
+    for (i = 0; i < nleases; i++) {
+        printf("%s pid=%ld host=%s age=%.1fs", leases[i].key, (long)leases[i].owner,
+               leases[i].host, (now - leases[i].start)/1000.0);
+        if (leases[i].ttl > 0)
+            printf(" ttl=%.1fs", leases[i].ttl/1000.0);
+        printf("\n");
+    }
+
+    free_leases(leases, nleases);
+
+    return exitcode;
+
+} /* end print_holders(filename) */
+
+/****************************************************************************/
+
+int status_resource_file(char* filename, int holders)
+{
+    /* Print the number of keys of a resource file, how many are free and
+       how many are in use, and with 'holders', who holds them */
+
+    unsigned long nkeys;
+    unsigned long nfree;
+    int     exitcode;
+
+    exitcode = count_free_resources(filename, &nkeys, &nfree);
+
+    if (exitcode == NO_ERROR) {
+        printf("total %lu free %lu used %lu\n", nkeys, nfree, nkeys - nfree);
+        if (holders)
+            exitcode = print_holders(filename);
+    }
+
+    return exitcode;
+
+} /* end status_resource_file(filename,holders) */
+
+/****************************************************************************/
+
+static int compare_longs(const void* a, const void* b)
+{
+    /* Order of two longs, for qsort */
+
+    long    x = *(const long*)a;
+    long    y = *(const long*)b;
+
+    return (x > y) - (x < y);
+
+} /* end compare_longs(a,b) */
+
+/****************************************************************************/
+
+static long percentile(long* values, int nvalues, int percent)
+{
+    /* The 'percent'th percentile of 'nvalues' sorted values, by the
+       nearest rank */
+
+    int     rank = (nvalues*percent + 99)/100;
+
+    return values[rank > 0? rank - 1 : 0];
+
+} /* end percentile(values,nvalues,percent) */
+
+/****************************************************************************/
+
+int stats_resource_file(char* filename)
+{
+    /* Print, for each operation in the stats log of a resource file (see
+       end_stats), how many calls there were, how they ended, and the 
+       percentiles of their lock wait, lock hold, records scanned and 
+       polls */
+
+    char*   operations[2] = { "obtain", "release" };
+    char*   names[NSTATS] = { "lock wait (us)", "lock hold (us)", "scanned", "polls" };
+    char*   statsname = companion_filename(filename, STATS_SUFFIX);
+    FILE*   in = fopen(statsname, "r");
+    char*   line = NULL;
+    size_t  linesize = 0;
+    char    operation[16];
+    long    pid;
+    long    start;
+    int     exitcode;
+    long*   values = NULL;  /* NSTATS per call                              */
+    int*    kinds = NULL;   /* per call, the operation and exit code        */
+    long*   sorted;
+    int     ncalls = 0;
+    int     capacity = 0;
+    int     outcomes[6];
+    int     n;
+    int     kind;
+    int     i;
+    int     j;
+
+    free(statsname);
+
+    if (in == NULL)
+        return FILE_NOT_OPEN;
+
+    while (getline(&line, &linesize, in) > 0) {
+        if (ncalls == capacity) {
+            capacity = capacity? 2*capacity : 256;
+            values = realloc(values, capacity*NSTATS*sizeof(long));
+            kinds  = realloc(kinds, capacity*sizeof(int));
+        }
+        if (sscanf(line, "%15s %ld %ld %d %ld %ld %ld %ld", operation, &pid, &start, &exitcode,
+                   values + ncalls*NSTATS, values + ncalls*NSTATS + 1, 
+                   values + ncalls*NSTATS + 2, values + ncalls*NSTATS + 3) != 8
+            || exitcode < 0 || exitcode > BAD_FILE)
+            continue;
+        for (kind = 0; kind < 2 && strcmp(operation, operations[kind]) != 0; kind++)
+            ;
+        if (kind < 2)
+            kinds[ncalls++] = kind*8 + exitcode;
+    }
+
+    free(line);
+    fclose(in);
+
+    sorted = malloc((ncalls? ncalls : 1)*sizeof(long));
+
+    for (kind = 0; kind < 2; kind++) {
+        memset(outcomes, 0, sizeof(outcomes));
+        for (i = n = 0; i < ncalls; i++)
+            if (kinds[i]/8 == kind) {
+                outcomes[kinds[i]%8]++;
+                n++;
+            }
+        if (n == 0)
+            continue;
+        printf("%s: %d calls", operations[kind], n);
+        for (exitcode = NO_ERROR; exitcode <= BAD_FILE; exitcode++)
+            if (outcomes[exitcode] > 0)
+                printf(", %d %s", outcomes[exitcode], 
+                       exitcode == NO_ERROR? "ok" : mresource_ExitMsg[exitcode]);
+        printf("\n%-16s %10s %10s %10s %10s\n", "", "p50", "p90", "p99", "max");
+        for (j = 0; j < NSTATS; j++) {
+            for (i = n = 0; i < ncalls; i++)
+                if (kinds[i]/8 == kind)
+                    sorted[n++] = values[i*NSTATS + j];
+            qsort(sorted, n, sizeof(long), compare_longs);
+            printf("  %-14s %10ld %10ld %10ld %10ld\n", names[j], percentile(sorted, n, 50),
+                   percentile(sorted, n, 90), percentile(sorted, n, 99), sorted[n-1]);
+        }
+    }
+
+    free(sorted);
+    free(values);
+    free(kinds);
+
+    return NO_ERROR;
+
+} /* end stats_resource_file(filename) */
+
+/****************************************************************************/
+
+struct MResource {
+    /* A resource file opened through the library, to obtain and release
+       resources repeatedly without opening it again each time */
+    struct Pool* pools; /* the open file, or the shards of a sharded pool,
+                           mapped while they stay the same size             */
+    int    npools;      /* number of pools                                  */
+    char*  filename;    /* copy of the name of the file                     */
+    enum Policy policy; /* where to start looking for free keys             */
+    long   polltime;    /* milliseconds between tries for unnotified changes */
+    long   maxpolltime; /* upper bound of backed-off polltime, if larger    */
+    char*  require;     /* copy of the tags obtained keys must have, or NULL */
+    char*  prefer;      /* copy of the tags they should have, or NULL       */
+};
+
+/****************************************************************************/
+
+struct MResource* mresource_open(char* filename, enum Locking locking, enum Policy policy)
+{
+    /* Open a resource file to obtain and release resources through.
+       Returns NULL if the file could not be opened. */
+
+    struct MResource* handle = malloc(sizeof(struct MResource));
+
+    handle->filename    = strdup(filename);
+    handle->policy      = policy;
+    handle->polltime    = POLL_INTERVAL;
+    handle->maxpolltime = 0;
+    handle->require     = NULL;
+    handle->prefer      = NULL;
+
+    handle->npools = open_pools(handle->filename, locking, &handle->pools);
+
+    if (handle->npools == 0) {
+        free(handle->filename);
+        free(handle);
+        return NULL;
+    }
+
+    mresource_set_durability(handle, durability_setting());
+
+    return handle;
+
+} /* end mresource_open(filename,locking,policy) */
+
+/****************************************************************************/
+
+void mresource_set_polling(struct MResource* handle, long polltime, long maxpolltime)
+{
+    /* Set the time between tries while waiting, and its upper bound when
+       backing off, in milliseconds, as with '-p' and '-b' */
+
+    if (polltime > 0)
+        handle->polltime = polltime;
+    handle->maxpolltime = maxpolltime;
+
+} /* end mresource_set_polling(handle,polltime,maxpolltime) */
+
+/****************************************************************************/
+
+void mresource_set_lease(struct MResource* handle, pid_t owner, long ttl)
+{
+    /* Set the process that obtained keys are leased to, and for how many
+       milliseconds, if positive, as with '--owner' and '--ttl'; keys have
+       no owner unless one is set */
+
+    int i;
+
+    for (i = 0; i < handle->npools; i++) {
+        handle->pools[i].owner = owner;
+        handle->pools[i].ttl   = ttl;
+    }
+
+} /* end mresource_set_lease(handle,owner,ttl) */
+
+/****************************************************************************/
+
+void mresource_set_tags(struct MResource* handle, char* require, char* prefer)
+{
+    /* Set the tags that obtained keys must have, and those that they 
+       should have if possible, as with '--require' and '--prefer'. Each
+       is a comma-separated list of NAME=VALUE, or NULL for none. */
+
+    int i;
+
+    free(handle->require);
+    free(handle->prefer);
+    handle->require = require? strdup(require) : NULL;
+    handle->prefer  = prefer? strdup(prefer) : NULL;
+
+    for (i = 0; i < handle->npools; i++) {
+        handle->pools[i].require = handle->require;
+        handle->pools[i].prefer  = handle->prefer;
+    }
+
+} /* end mresource_set_tags(handle,require,prefer) */
+
+/****************************************************************************/
+
+void mresource_set_priority(struct MResource* handle, int priority)
+{
+    /* Set the priority with which obtains that have to wait are queued,
+       as with '-P' */
+
+    int i;
+
+    for (i = 0; i < handle->npools; i++)
+        handle->pools[i].priority = priority;
+
+} /* end mresource_set_priority(handle,priority) */
+
+/****************************************************************************/
+
+void mresource_set_durability(struct MResource* handle, enum Durability durability)
+{
+    /* Set when changes to the file, its lease log and its other companion
+       files are flushed to disk, overriding MRESOURCE_SYNC */
+
+    int i;
+
+    for (i = 0; i < handle->npools; i++)
+        handle->pools[i].durability = durability;
+
+} /* end mresource_set_durability(handle,durability) */
+
+/****************************************************************************/
+
+int mresource_obtain(struct MResource* handle, int nwanted, long timeout, char* keys, size_t size)
+{
+    /* Obtain 'nwanted' resources, waiting at most 'timeout' milliseconds
+       (or forever if it is NO_TIMEOUT). Their keys are put into 'keys',
+       one per line, and terminated by a '\0'. If they do not fit in 'size'
+       bytes, they are released again, and ARGUMENT_ERROR is returned. */
+
+    char*  text;
+    size_t length;
+    char** lines;
+    int    nlines;
+    FILE*  out = open_memstream(&text, &length);
+    int    exitcode;
+    struct Stats stats;
+
+    begin_stats(&stats, handle->pools, handle->npools);
+    if (nwanted < 1)
+        exitcode = ARGUMENT_ERROR;
+    else
+        exitcode = obtain_pool_resources(handle->pools, handle->npools, nwanted, timeout, 
+                                         handle->polltime, handle->maxpolltime, 
+                                         handle->policy, out, NULL);
+    end_stats(handle->filename, "obtain", handle->pools, handle->npools, exitcode);
+    fclose(out);
+
+    if (exitcode == NO_ERROR && length < size)
+        memcpy(keys, text, length + 1);
+    else if (exitcode == NO_ERROR) {
+        nlines = split_lines(text, &lines);
+        release_shard_resources(handle->pools, handle->npools, nlines, lines, 0);
+        free(lines);
+        exitcode = ARGUMENT_ERROR;
+    }
+
+    free(text);
+
+    return exitcode;
+
+} /* end mresource_obtain(handle,nwanted,timeout,keys,size) */
+
+/****************************************************************************/
+
+int mresource_release(struct MResource* handle, int nkeys, char** keys, long delay)
+{
+    /* Release 'keys', after 'delay' milliseconds if it is positive */
+
+    struct Stats stats;
+    int    exitcode;
+
+    begin_stats(&stats, handle->pools, handle->npools);
+    exitcode = release_shard_resources(handle->pools, handle->npools, nkeys, keys, delay);
+    end_stats(handle->filename, "release", handle->pools, handle->npools, exitcode);
+
+    return exitcode;
+
+} /* end mresource_release(handle,nkeys,keys,delay) */
+
+/****************************************************************************/
+
+int mresource_renew(struct MResource* handle, int nkeys, char** keys)
+{
+    /* Restart the leases of the owner of the handle on 'keys' */
+
+    return renew_resource(handle->filename, nkeys, keys, handle->pools[0].owner, 
+                          handle->pools[0].ttl, handle->pools[0].durability);
+
+} /* end mresource_renew(handle,nkeys,keys) */
+
+/****************************************************************************/
+
+void mresource_close(struct MResource* handle)
+{
+    /* Close a resource file opened with mresource_open */
+
+    close_pools(handle->pools, handle->npools);
+    free(handle->filename);
+    free(handle->require);
+    free(handle->prefer);
+    free(handle);
+
+} /* end mresource_close(handle) */
+
+/****************************************************************************/
@@ -0,0 +1,174 @@
+#!/bin/bash
+#
+# mrbench.sh - benchmarks resource management with mresource under contention
+#
+# Copyright (c)  2022  Ramses van Zon
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions;
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+#
+# -------------------------
+# Explanation of the script
+# -------------------------
+#
+# For every combination of directory, pool size, file format and kind
+# of locking, this script creates a resource file, and starts WORKERS
+# processes that each, ROUNDS times, obtain 1 to MAXN keys, briefly
+# hold them, and release them again.
+#
+# Each worker marks the keys it holds by creating a directory for each
+# of them, so that a key that is handed out twice is caught and
+# reported as 'DOUBLE'. At the end, all keys of the file should be
+# free again.
+#
+# Per combination, one line is printed with the number of obtains and
+# releases per second, and the 50th, 99th and 99.9th percentiles of the
+# time that a single obtain or release took, in milliseconds, as seen
+# by the calling script (so including the start-up of mresource).
+#
+# The parameters below can be overridden from the environment, e.g.
+#
+#    make bench WORKERS=64 SIZES="4 1000" BENCHDIRS="/dev/shm /nfs/tmp"
+#
+# to compare tmpfs with a network file system. MRESOURCE selects the
+# executable, so that different builds can be compared on one machine.
+# The exit code is nonzero if any key was handed out twice, or if any
+# call failed.
+#
+
+# Parameters
+WORKERS=${WORKERS:-16}
+ROUNDS=${ROUNDS:-40}
+MAXN=${MAXN:-3}
+TIMEOUT=${TIMEOUT:-30}
+SIZES=${SIZES:-"4 1024 1000000"}
+FORMATS=${FORMATS:-"plain indexed"}
+LOCKINGS=${LOCKINGS:-"file records atomic"}
+BENCHDIRS=${BENCHDIRS:-/dev/shm}
+MRESOURCE=${MRESOURCE:-./mresource}
+
+if [ -z "$EPOCHREALTIME" ]
+then
+    echo "mrbench.sh needs bash 5 or later for its timings" >&2
+    exit 1
+fi
+
+# Microseconds since the epoch, from the clock of bash itself
+now() {
+    echo ${EPOCHREALTIME/[.,]/}
+}
+
+# One worker: obtain, hold and release keys, logging the time of each call
+worker() {
+    local file=$1 held=$2 lockopt=$3 round n keys key t0 t1 t2
+    for ((round=0; round<ROUNDS; round++))
+    do
+        let n=$RANDOM%$MAXN+1
+        t0=${EPOCHREALTIME/[.,]/}
+        if ! keys=$($MRESOURCE $file -n $n -t $TIMEOUT $lockopt)
+        then
+            echo "FAILED obtain"
+            continue
+        fi
+        t1=${EPOCHREALTIME/[.,]/}
+        for key in $keys; do mkdir $held/$key 2>/dev/null || echo "DOUBLE $key"; done
+        for key in $keys; do rmdir $held/$key; done
+        t2=${EPOCHREALTIME/[.,]/}
+        $MRESOURCE $file $keys $lockopt || echo "FAILED release"
+        echo "obtain $((t1-t0))"
+        echo "release $((${EPOCHREALTIME/[.,]/}-t2))"
+    done
+}
+
+# Percentiles, in milliseconds, of the times of one kind of call
+percentiles() {
+    grep "^$1 " $2 | cut -d' ' -f2 | sort -n | awk '
+        function at(q,  r) { r = int(NR*q); if (r < NR*q) r++; if (r < 1) r = 1; return v[r]/1000 }
+        { v[NR] = $1 }
+        END { if (NR) printf "%8.2f %8.2f %8.2f", at(0.5), at(0.99), at(0.999);
+              else printf "%8s %8s %8s", "-", "-", "-" }'
+}
+
+# Set up and run all combinations
+errors=0
+printf "%-12s %8s %-8s %-8s %9s %9s  %-26s  %-26s\n" \
+       dir keys format locking obtain/s release/s \
+       "obtain p50/p99/p999 ms" "release p50/p99/p999 ms"
+for dir in $BENCHDIRS
+do
+    resourcefile=$dir/mrbench.$$
+    held=$dir/mrbench.$$.held
+    log=$dir/mrbench.$$.log
+    for size in $SIZES
+    do
+        for format in $FORMATS
+        do
+            # large pools are written directly, as they do not fit on a command line
+            rm -f $resourcefile $resourcefile.*
+            seq 1 $size | sed 's/^/ K/' > $resourcefile
+            if [ $format == indexed ]
+            then
+                $MRESOURCE $resourcefile -i || exit 1
+            fi
+            for locking in $LOCKINGS
+            do
+                lockopt=
+                if [ $locking == records ]
+                then
+                    lockopt=-l
+                elif [ $locking == atomic ]
+                then
+                    lockopt=--atomic
+                fi
+                rm -rf $held
+                mkdir $held
+                start=$(now)
+                for ((w=0; w<$WORKERS; w++))
+                do
+                    worker $resourcefile $held "$lockopt" > $log.$w &
+                done
+                wait
+                elapsed=$(( $(now) - start ))
+                cat $log.* > $log
+                rm -f $log.*
+                obtains=$(grep -c '^obtain ' $log)
+                releases=$(grep -c '^release ' $log)
+                printf "%-12s %8s %-8s %-8s %9.1f %9.1f  %s  %s\n" \
+                       $dir $size $format $locking \
+                       $(awk "BEGIN { print $obtains*1000000/$elapsed }") \
+                       $(awk "BEGIN { print $releases*1000000/$elapsed }") \
+                       "$(percentiles obtain $log)" "$(percentiles release $log)"
+                grep -h '^DOUBLE\|^FAILED' $log | sort | uniq -c
+                if grep -q '^DOUBLE\|^FAILED' $log
+                then
+                    errors=1
+                fi
+                free=$($MRESOURCE $resourcefile -s | awk '{print $4}')
+                if [ "$free" != "$size" ]
+                then
+                    echo "only $free of $size keys are free at the end"
+                    errors=1
+                fi
+                rm -rf $held $log
+            done
+        done
+    done
+    rm -f $resourcefile $resourcefile.*
+done
+exit $errors
@@ -22,39 +22,25 @@
  * THE SOFTWARE.
  */
 
-#include <sys/types.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <limits.h>
 #include <error.h>
+#include <errno.h>
+#include <signal.h>
+#include <math.h>
+#include <time.h>
 #include <sys/wait.h>
+#include "mresource.h"
 
 /*****************************************************************************/
 
-#define POLL_INTERVAL    2  /* number of seconds between trying to get a key */
-#define MAX_LINE_LEN  1024  /* maximum number of character per key           */
-#define SIGNAL_CHAR     '!' /* initial character on a line if key is used    */
 #define SWITCH_CHAR     '-' /* initial character of a command line switch    */
-
-/*****************************************************************************/
-
-enum ExitCodes { 
-    /* possible error codes of the program */
-    NO_ERROR=0,       /* exit code when all's well                           */
-    FILE_NOT_OPEN,    /* exit code when file could not be opened             */
-    NOT_FOUND,        /* exit code when a key could not be found             */
-    ARGUMENT_ERROR,   /* exit code when called with too few arguments        */
-    TIME_OUT          /* exit code when key was not obtained before timeout  */
-};
-
-char ExitMsg[5][22] = { "", 
-                        "Could not open file", 
-                        "Could not find key", 
-                        "Argument error", 
-                        "Time-out" };
+#define KEYS_VARIABLE "MRESOURCE_KEYS" /* environment variable with the keys
+                               obtained for a command that mresource runs     */
+#define FILE_VARIABLE "MRESOURCE_FILE" /* and with the file they came from    */
 
 /*****************************************************************************/
 
@@ -65,372 +51,873 @@ enum Mode {
     SHOW_HELP, 
     CREATE,
     APPEND,
+    CONVERT,
+    EXPORT,
+    SERVE,
+    RENEW,
+    STATUS,
+    STATS,
+    REMOVE,
+    COMPACT,
+    AGENT,
+    RUN,
     ERROR 
 };
 
 /*****************************************************************************/
 
-void read_cmdline(int argc, char**argv, enum Mode*mode, char**file, char***keys, int*nkeys, int* timeout, int* delay, int* polltime) 
+struct Options {
+    /* what the command line asks for */
+    enum Mode    mode;        /* what are we supposed to be doing?           */
+    char*        filename;    /* file with resource names                    */
+    char**       keys;        /* requested key(s)                            */
+    int          nkeys;       /* number of keys on command line              */
+    int          nwanted;     /* number of keys to obtain at once            */
+    long         timeout;     /* time-out delay in milliseconds              */
+    long         delay;       /* delay in releasing the key                  */
+    long         polltime;    /* milliseconds in between tries               */
+    long         maxpolltime; /* upper bound on backed-off polltime          */
+    int          indexed;     /* whether a created file gets an index        */
+    int          nshards;     /* number of files a created pool is split over */
+    int          holders;     /* whether the status lists the holders        */
+    enum Locking locking;     /* lock the whole file or single records       */
+    enum Durability durability; /* when changes are flushed to disk          */
+    int          remote;      /* whether daemons are reached through FILE.addr */
+    enum Policy  policy;      /* where to start looking for free keys        */
+    pid_t        owner;       /* process that obtained keys are leased to    */
+    long         ttl;         /* milliseconds they are leased for, if positive */
+    char*        require;     /* tags that obtained keys must have           */
+    char*        prefer;      /* tags that obtained keys should have         */
+    char*        listen_on;   /* TCP address for the daemon, if any          */
+    int          block;       /* number of keys an agent takes at once       */
+    long         idle;        /* milliseconds before an agent returns free keys */
+    int          priority;    /* order among callers waiting for keys        */
+    char**       files;       /* FILE and those given with '--or'            */
+    int          nfiles;      /* number of those files                       */
+    char**       command;     /* command to run with the keys, if any        */
+};
+
+/*****************************************************************************/
+
+long parse_duration(char* option, char* text)
+{
+    /* Convert a time duration like '0.5', '2s' or '50ms' to milliseconds.
+       Plain numbers are in seconds; 'm' and 'h' suffixes are also allowed. */
+
+    char*  suffix;
+    double value = strtod(text, &suffix);
+    double scale;
+
+    if (suffix == text || value < 0 || !isfinite(value))
+        error(ARGUMENT_ERROR, 0, "Invalid duration '%s' for '%s'.", text, option);
+
+    if (strcmp(suffix, "") == 0 || strcmp(suffix, "s") == 0)
+        scale = 1000.0;
+    else if (strcmp(suffix, "ms") == 0)
+        scale = 1.0;
+    else if (strcmp(suffix, "m") == 0)
+        scale = 60000.0;
+    else if (strcmp(suffix, "h") == 0)
+        scale = 3600000.0;
+    else
+        error(ARGUMENT_ERROR, 0, "Invalid unit '%s' for '%s'.", suffix, option);
+
+    if (value*scale > LONG_MAX)
+        error(ARGUMENT_ERROR, 0, "Duration '%s' for '%s' too large.", text, option);
+
+    return (long)(value*scale + 0.5);
+
+} /* end parse_duration(option,text) */
+
+/****************************************************************************/
+
+int parse_number(char* option, char* text)
+{
+    /* Convert a whole number like '4' or '-2' */
+
+    char* end;
+    long  value;
+
+    errno = 0;
+    value = strtol(text, &end, 10);
+
+    if (end == text || *end != '\0' || errno == ERANGE || value > INT_MAX || value < INT_MIN)
+        error(ARGUMENT_ERROR, 0, "Invalid number '%s' for '%s'.", text, option);
+
+    return (int)value;
+
+} /* end parse_number(option,text) */
+
+/****************************************************************************/
+
+enum Policy parse_policy(char* option, char* text)
+{
+    /* Convert the name of an allocation policy to its enum value */
+
+    if (strcmp(text, "first") == 0)
+        return FIRST_FIT;
+    else if (strcmp(text, "next") == 0)
+        return NEXT_FIT;
+    else if (strcmp(text, "random") == 0)
+        return RANDOM_FIT;
+    else if (strcmp(text, "least") == 0)
+        return LEAST_LOADED;
+
+    error(ARGUMENT_ERROR, 0, "Invalid policy '%s' for '%s'.", text, option);
+
+    return FIRST_FIT;
+
+} /* end parse_policy(option,text) */
+
+/****************************************************************************/
+
+enum Durability parse_durability(char* option, char* text)
+{
+    /* Convert the name of a durability mode to its enum value */
+
+    if (strcmp(text, "none") == 0)
+        return SYNC_NONE;
+    else if (strcmp(text, "data") == 0)
+        return SYNC_DATA;
+    else if (strcmp(text, "group") == 0)
+        return SYNC_GROUP;
+
+    error(ARGUMENT_ERROR, 0, "Invalid durability '%s' for '%s'.", text, option);
+
+    return SYNC_NONE;
+
+} /* end parse_durability(option,text) */
+
+/****************************************************************************/
+
+char* parse_tags(char* option, char* text)
+{
+    /* Check a comma-separated list of tags like 'numa=0,host=n12', and
+       return it, or NULL if it is empty */
+
+    char* tag;
+
+    if (text[0] == '\0')
+        return NULL;
+
+    for (tag = text; tag != NULL; tag = strchr(tag, ',')? strchr(tag, ',') + 1 : NULL)
+        if (strcspn(tag, ",") == 0 || strcspn(tag, ",=") == strcspn(tag, ",")
+            || strcspn(tag, ", \t\n") != strcspn(tag, ","))
+            error(ARGUMENT_ERROR, 0, "Invalid tags '%s' for '%s'; expected NAME=VALUE[,...].", 
+                  text, option);
+
+    return text;
+
+} /* end parse_tags(option,text) */
+
+/****************************************************************************/
+
+void read_cmdline(int argc, char**argv, struct Options* options) 
 {
     /* Read command line */
-    *file    = NULL;
-    *keys    = NULL;
-    *nkeys   = 0;
-    *mode    = OBTAIN;
-    *timeout = INT_MAX;
-    *delay   = 0;
-    *polltime= 2;
+    options->filename    = NULL;
+    options->keys        = NULL;
+    options->nkeys       = 0;
+    options->nwanted     = 1;
+    options->mode        = OBTAIN;
+    options->timeout     = NO_TIMEOUT;
+    options->delay       = 0;
+    options->polltime    = POLL_INTERVAL;
+    options->maxpolltime = 0;
+    options->indexed     = 0;
+    options->nshards     = 1;
+    options->holders     = 0;
+    options->locking     = LOCK_FILE;
+    options->durability  = durability_setting();
+    options->remote      = getenv(REMOTE_VARIABLE) != NULL && *getenv(REMOTE_VARIABLE) != '\0';
+    options->policy      = FIRST_FIT;
+    options->owner       = 0;
+    options->ttl         = 0;
+    options->require     = NULL;
+    options->prefer      = NULL;
+    options->listen_on   = NULL;
+    options->block       = 0;
+    options->idle        = -1;
+    options->priority    = 0;
+    options->files       = malloc(argc*sizeof(char*));
+    options->nfiles      = 0;
+    options->command     = NULL;
     int argi;
     for (argi = 1; argi < argc; argi++) {
-        if (argv[argi][0] == SWITCH_CHAR) {
+        /* what follows a '--' is a command to run with the keys */
+        if (strcmp(argv[argi], "--") == 0) {
+            options->command = argv + argi + 1;
+            if (options->mode == OBTAIN)
+                options->mode = RUN;
+            break;
+        }
+        /* a lone '-' is not an option, but stands for keys on stdin */
+        if (argv[argi][0] == SWITCH_CHAR && argv[argi][1] != '\0') {
             switch (argv[argi][1]) {
             case 'c': 
-                *mode=CREATE;
+                options->mode=CREATE;
                 break;
             case 'a': 
-                *mode=APPEND;
+                options->mode=APPEND;
+                break;
+            case 'i': 
+                options->indexed=1;
+                break;
+            case 'l': 
+                if (options->locking == LOCK_ATOMIC)
+                    error(ARGUMENT_ERROR, 0, "Options '-l' and '--atomic' cannot be used together.");
+                options->locking=LOCK_RECORDS;
+                break;
+            case 'x': 
+                options->mode=EXPORT;
+                break;
+            case 'D': 
+                options->mode=SERVE;
+                break;
+            case 's': 
+                options->mode=STATUS;
+                break;
+            case 'r': 
+                options->mode=REMOVE;
                 break;
             case 'h': 
                 if (argi == 1 && argc == 2) 
-                    *mode=SHOW_HELP;
+                    options->mode=SHOW_HELP;
                 else
                     error(ARGUMENT_ERROR, 0, "Too many arguments; '-h' must be the only argument.");
                 break;
             case 't': 
                 if (argi < argc-1) 
-                    *timeout = atoi(argv[++argi]);
+                    options->timeout = parse_duration("-t", argv[++argi]);
                 else
                     error(ARGUMENT_ERROR, 0, "Missing parameter for '-t'.");
                 break;
             case 'd': 
                 if (argi < argc-1) 
-                    *delay = atoi(argv[++argi]);
+                    options->delay = parse_duration("-d", argv[++argi]);
                 else
                     error(ARGUMENT_ERROR, 0, "Missing parameter for '-d'.");
                 break;
             case 'p': 
                 if (argi < argc-1) 
-                    *polltime = atoi(argv[++argi]);
+                    options->polltime = parse_duration("-p", argv[++argi]);
                 else
                     error(ARGUMENT_ERROR, 0, "Missing parameter for '-p'.");
                 break;
+            case 'n': 
+                if (argi < argc-1) 
+                    options->nwanted = parse_number("-n", argv[++argi]);
+                else
+                    error(ARGUMENT_ERROR, 0, "Missing parameter for '-n'.");
+                if (options->nwanted < 1)
+                    error(ARGUMENT_ERROR, 0, "Number of keys for '-n' must be positive.");
+                break;
+            case 'b': 
+                if (argi < argc-1) 
+                    options->maxpolltime = parse_duration("-b", argv[++argi]);
+                else
+                    error(ARGUMENT_ERROR, 0, "Missing parameter for '-b'.");
+                break;
+            case 'o': 
+                if (argi < argc-1) 
+                    options->policy = parse_policy("-o", argv[++argi]);
+                else
+                    error(ARGUMENT_ERROR, 0, "Missing parameter for '-o'.");
+                break;
+            case 'P': 
+                if (argi < argc-1) 
+                    options->priority = parse_number("-P", argv[++argi]);
+                else
+                    error(ARGUMENT_ERROR, 0, "Missing parameter for '-P'.");
+                break;
+            case SWITCH_CHAR: 
+                /* long options */
+                if (strcmp(argv[argi], "--help") == 0 && argi == 1 && argc == 2) 
+                    options->mode=SHOW_HELP;
+                else if (strcmp(argv[argi], "--renew") == 0) 
+                    options->mode=RENEW;
+                else if (strcmp(argv[argi], "--holders") == 0) 
+                    options->holders=1;
+                else if (strcmp(argv[argi], "--atomic") == 0) {
+                    if (options->locking == LOCK_RECORDS)
+                        error(ARGUMENT_ERROR, 0, "Options '-l' and '--atomic' cannot be used together.");
+                    options->locking=LOCK_ATOMIC;
+                }
+                else if (strcmp(argv[argi], "--stats") == 0) 
+                    options->mode=STATS;
+                else if (strcmp(argv[argi], "--compact") == 0) 
+                    options->mode=COMPACT;
+                else if (strcmp(argv[argi], "--remote") == 0) 
+                    options->remote=1;
+                else if (strcmp(argv[argi], "--ttl") == 0 && argi < argc-1)
+                    options->ttl = parse_duration("--ttl", argv[++argi]);
+                else if (strcmp(argv[argi], "--owner") == 0 && argi < argc-1) {
+                    options->owner = parse_number("--owner", argv[++argi]);
+                    if (options->owner < 1)
+                        error(ARGUMENT_ERROR, 0, "PID for '--owner' must be positive.");
+                } else if (strcmp(argv[argi], "--require") == 0 && argi < argc-1)
+                    options->require = parse_tags("--require", argv[++argi]);
+                else if (strcmp(argv[argi], "--prefer") == 0 && argi < argc-1)
+                    options->prefer = parse_tags("--prefer", argv[++argi]);
+                else if (strcmp(argv[argi], "--agent") == 0 && argi < argc-1) {
+                    options->mode = AGENT;
+                    options->block = parse_number("--agent", argv[++argi]);
+                    if (options->block < 1)
+                        error(ARGUMENT_ERROR, 0, "Number of keys for '--agent' must be positive.");
+                } else if (strcmp(argv[argi], "--idle") == 0 && argi < argc-1)
+                    options->idle = parse_duration("--idle", argv[++argi]);
+                else if (strcmp(argv[argi], "--or") == 0 && argi < argc-1)
+                    options->files[++options->nfiles] = argv[++argi];
+                else if (strcmp(argv[argi], "--listen") == 0 && argi < argc-1)
+                    options->listen_on = argv[++argi];
+                else if (strcmp(argv[argi], "--sync") == 0 && argi < argc-1)
+                    options->durability = parse_durability("--sync", argv[++argi]);
+                else if (strcmp(argv[argi], "--shards") == 0 && argi < argc-1) {
+                    options->nshards = parse_number("--shards", argv[++argi]);
+                    if (options->nshards < 1)
+                        error(ARGUMENT_ERROR, 0, "Number of shards for '--shards' must be positive.");
+                } else if (strcmp(argv[argi], "--ttl") == 0 || strcmp(argv[argi], "--owner") == 0
+                         || strcmp(argv[argi], "--require") == 0 || strcmp(argv[argi], "--prefer") == 0
+                         || strcmp(argv[argi], "--shards") == 0 || strcmp(argv[argi], "--listen") == 0
+                         || strcmp(argv[argi], "--agent") == 0 || strcmp(argv[argi], "--idle") == 0
+                         || strcmp(argv[argi], "--or") == 0 || strcmp(argv[argi], "--sync") == 0)
+                    error(ARGUMENT_ERROR, 0, "Missing parameter for '%s'.", argv[argi]);
+                else
+                    error(ARGUMENT_ERROR, 0, "Unknown option '%s.'", argv[argi]);
+                break;
             default:
                 error(ARGUMENT_ERROR, 0, "Unknown option '%s.'", argv[argi]);
             }
         } else {
-            if (!*file) 
-                *file = argv[argi];
-            else if (!*keys) {
-                if (*mode == OBTAIN)
-                    *mode = RELEASE;
-                *keys = argv + argi;
-                for (;argi < argc && argv[argi][0] != SWITCH_CHAR; argi++) 
-                    (*nkeys)++;
+            if (!options->filename) 
+                options->filename = argv[argi];
+            else if (!options->keys) {
+                if (options->mode == OBTAIN)
+                    options->mode = RELEASE;
+                options->keys = argv + argi;
+                for (;argi < argc && (argv[argi][0] != SWITCH_CHAR || argv[argi][1] == '\0'); argi++) 
+                    options->nkeys++;
                 argi--;
             } else 
                 error(ARGUMENT_ERROR, 0, "Extraneous argument '%s'\n", argv[argi]);
         }
     }
+    if (!options->filename && options->mode != SHOW_HELP)
+        error(ARGUMENT_ERROR, 0, "Missing FILE.");
+    if (options->polltime <= 0)
+        error(ARGUMENT_ERROR, 0, "POLLTIME must be positive.");
+    if (options->indexed && options->mode == OBTAIN)
+        options->mode = CONVERT;
+    if (options->indexed && options->mode != CREATE && options->mode != CONVERT)
+        error(ARGUMENT_ERROR, 0, "Option '-i' can only be used with '-c', or without keys.");
+    if (options->mode == EXPORT && options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '-x' cannot be used with keys.");
+    if (options->mode == SERVE && options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '-D' cannot be used with keys.");
+    if (options->nshards > 1 && options->mode != CREATE)
+        error(ARGUMENT_ERROR, 0, "Option '--shards' can only be used with '-c'.");
+    if ((options->require || options->prefer) && options->mode != OBTAIN && options->mode != RUN)
+        error(ARGUMENT_ERROR, 0, "Options '--require' and '--prefer' are for obtaining keys.");
+    if (options->mode == STATUS && options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '-s' cannot be used with keys.");
+    if (options->mode == REMOVE && !options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '-r' needs the keys to remove.");
+    if (options->mode == COMPACT && options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '--compact' cannot be used with keys.");
+    if (options->mode == STATS && options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '--stats' cannot be used with keys.");
+    if (options->holders && options->mode != STATUS)
+        error(ARGUMENT_ERROR, 0, "Option '--holders' can only be used with '-s'.");
+    if (options->mode == RENEW && !options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '--renew' needs the keys to renew.");
+    if (options->listen_on && options->mode != SERVE)
+        error(ARGUMENT_ERROR, 0, "Option '--listen' can only be used with '-D'.");
+    if (options->mode == AGENT && options->keys)
+        error(ARGUMENT_ERROR, 0, "Option '--agent' cannot be used with keys.");
+    if (options->idle >= 0 && options->mode != AGENT)
+        error(ARGUMENT_ERROR, 0, "Option '--idle' can only be used with '--agent'.");
+    if (options->idle < 0)
+        options->idle = AGENT_IDLE;
+    if (options->command && options->mode != RUN)
+        error(ARGUMENT_ERROR, 0, "A command after '--' can only be run with keys to obtain.");
+    if (options->command && !*options->command)
+        error(ARGUMENT_ERROR, 0, "Missing command after '--'.");
+    /* keys obtained for a command are leased to mresource, which waits
+       for it; other keys only get an owner with '--owner', as the process
+       that called mresource, such as a '$(...)' subshell, may well exit
+       while they are still in use */
+    if (options->owner == 0 && options->mode == RUN)
+        options->owner = getpid();
+    if (options->priority != 0 && options->mode != OBTAIN && options->mode != RUN)
+        error(ARGUMENT_ERROR, 0, "Option '-P' is for obtaining keys.");
+    if (options->nfiles > 0 && options->mode != OBTAIN && options->mode != RUN)
+        error(ARGUMENT_ERROR, 0, "Option '--or' is for obtaining keys.");
+    /* the first of the files to obtain from is FILE itself */
+    options->files[0] = options->filename;
+    options->nfiles++;
 } /* end read_cmdline */
 
 /****************************************************************************/
 
-void show_help()
-{
-    /* Show help message */
-    printf("\n"
-           "mresource - file-based resource key allocator\n"
-           "\n"
-           "  Usage:\n"
-           "\n"
-           "    mresource [ -h | --help ]\n"
-           "    mresource FILE [-t TIME] [-p POLLTIME]\n"
-           "    mresource FILE KEY [-d DELAY] \n"
-           "    mresource FILE -c KEY1 [KEY2 ....] \n"
-           "    mresource FILE -a KEY1 [KEY2 ....] \n"
-           "\n"
-           "  When given a FILE but no key(s), mresource prints out\n"
-           "  the next available resource in the file, and marks it\n"
-           "  as used in the file. If no resource is available, it\n"
-           "  waits for POLLTIME seconds before trying again.\n"
-           "\n"
-           "  POLLTIME is 2 seconds by default, but can be set with\n"
-           "  the optional '-p POLLTIME' argument\n"
-           "\n"
-           "  With '-t TIME', mresource only tries for TIME seconds.\n"
-           "  Without '-t TIME', mresource waits untill a resource is\n"
-           "  available.\n "
-           "\n"
-           "  When given a FILE and a KEY, that resource key gets\n"
-           "  unmarked in the file, after a DELAY seconds lag time.\n"
-           "\n"
-           "  Note that FILE should contain a list of resource keys.\n"
-           "  The first character of each line is reserved to store the\n"
-           "  allocation signal: when it is a space (as it should be \n"
-           "  initially), then the resource is not reserved, when it \n"
-           "  is an exclamation mark it is.\n"
-           "\n"
-           "  mresource can generate such a file when invoked with\n"
-           "  FILE, '-c', and a list of one or more keys.\n"
-           "\n"
-           "  mresource can insert more keys into such a file when\n"
-           "  invoked with FILE, '-a', and a list of one or more keys.\n"
-           "\n"
-           "  TIP: When accessed a lot, put FILE a ram-based file\n"
-           "  system, e.g., /tmp or /dev/shm.\n"
-           "\n\n"
-           "Ramses van Zon, SciNet, Toronto, 2013-2022\n"
-           "\n"); 
-    
-} /* end show_help() */
-
-/****************************************************************************/
-
-void fill_file_lock_controls(struct flock* set_lock, struct flock* unset_lock)
+FILE* capture_stdout(int* saved)
 {
-    /* Fill two 'struct flock's needed for file locking and unlocking */
-
-    pid_t pid = getpid();
-    set_lock->l_type     = F_WRLCK;
-    set_lock->l_whence   = SEEK_SET;
-    set_lock->l_start    = 0;
-    set_lock->l_len      = 0;
-    set_lock->l_pid      = pid; 
-    unset_lock->l_type   = F_UNLCK;
-    unset_lock->l_whence = SEEK_SET;
-    unset_lock->l_start  = 0;
-    unset_lock->l_len    = 0;
-    unset_lock->l_pid    = pid; 
-
-} /* end fill_file_lock_controls(set_lock,unset_lock) */
+    /* Send what gets printed to stdout to a temporary file instead, until
+       release_stdout, keeping the real stdout in 'saved' */
 
-/****************************************************************************/
+    FILE*   captured = tmpfile();
 
-int obtain_resource(char* filename, int timeout, int polltime)
-{
-    /* Resource management routine to obtain a resource given a resource file */
-
-    FILE*   file;
-    int     file_descriptor;
-    size_t  file_pointer;
-    char    line[MAX_LINE_LEN+1];
-    char*   checkline;
-    int     repeat;
-    int     exitcode;
-    struct flock set_lock, unset_lock;
-    int     rep = 0;
-    int     maxrep = timeout?((timeout+polltime-1)/polltime):INT_MAX;
-
-    fill_file_lock_controls(&set_lock, &unset_lock);
-
-    do {
-        file = fopen(filename, "r+");
-
-        if (file != NULL) {
-
-            file_descriptor = fileno(file);
-            fcntl(file_descriptor, F_SETLKW, &set_lock);
-
-            do {
-                file_pointer = ftell(file);
-                checkline = fgets(line, sizeof(line), file);
-            } while ( checkline != NULL && !feof(file) && line[0] == SIGNAL_CHAR );
-            
-            if (feof(file)) {
-                if (rep<maxrep) {
-                    sleep(polltime);
-                    rep++;
-                    repeat = 1; 
-                } else {
-                    exitcode = TIME_OUT;
-                    repeat = 0;
-                }
-            } else {           
-                fseek(file, file_pointer, SEEK_SET);
-                fprintf(file, "%c", SIGNAL_CHAR);
-                printf("%s", line + 1);
-                exitcode = NO_ERROR;
-                repeat = 0;
-            }
-            
-            fcntl(file_descriptor, F_SETLK, &unset_lock);
-            fclose(file);
+    fflush(stdout);
+    *saved = dup(STDOUT_FILENO);
+    if (captured == NULL || *saved < 0 || dup2(fileno(captured), STDOUT_FILENO) < 0)
+        error(FILE_NOT_OPEN, errno, "Could not capture the obtained keys");
 
-        } else {
-            
-            exitcode = FILE_NOT_OPEN;
-            
-        }
-        
-    } while (repeat); /* keep polling if resources were not avaliable */
+    return captured;
 
-    return exitcode;
-
-} /* end obtain_resource(filename,timeout) */
+} /* end capture_stdout(saved) */
 
 /****************************************************************************/
 
-int release_resource(char* filename, char* key, int delay)
+char* release_stdout(FILE* captured, int saved)
 {
-    /* Resource management routine to release 'key' from resource file */
-
-    FILE*   file;
-    int     file_descriptor;
-    size_t  file_pointer;
-    char    line[MAX_LINE_LEN+1];
-    char*   checkline;
-    int     exitcode;
-    pid_t   pid;
-    struct flock set_lock, unset_lock;
+    /* Restore stdout, and return what was printed to it meanwhile (to be
+       freed) */
 
+    char*   text;
+    long    length;
 
-    /* quick check before delaying */
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
 
-    file = fopen(filename, "r+");
+    length = ftell(captured);
+    text = malloc(length + 1);
+    rewind(captured);
+    length = fread(text, 1, length, captured);
+    text[length] = '\0';
+    fclose(captured);
 
-    if (file == NULL) return FILE_NOT_OPEN; else fclose(file);
+    return text;
 
-    /* double fork to daemonize */
+} /* end release_stdout(captured,saved) */
 
-    pid = fork();
+/****************************************************************************/
 
-    if (pid < 0)
+int run_command(char** command, int nkeys, char** keys, char* filename, int remote, enum Durability durability, pid_t owner, long ttl)
+{
+    /* Run a command with the keys in KEYS_VARIABLE, separated by spaces,
+       and wait for it, renewing their lease halfway its 'ttl', if any,
+       but not more often than every millisecond. Signals sent to
+       mresource (e.g. by a batch system cancelling the job) are passed
+       on to it; those that the terminal sends go to the command directly,
+       as it is in the same process group. Returns its exit code, or, as
+       the shell does, 128 plus the signal that killed it, or 126 if it
+       could not be run or waited for. */
+
+    sigset_t  forwarded;
+    sigset_t  original;
+    siginfo_t info;
+    struct timespec now;
+    struct timespec remaining;
+    long      deadline;
+    long      left;
+    void      (*onchild)(int);
+    char*     text;
+    size_t    length;
+    FILE*     out = open_memstream(&text, &length);
+    pid_t     child;
+    pid_t     waited;
+    int       status = 0;
+    int       i;
+
+    for (i = 0; i < nkeys; i++)
+        fprintf(out, i? " %s" : "%s", keys[i]);
+    fclose(out);
+    setenv(KEYS_VARIABLE, text, 1);
+    free(text);
+
+    /* signals are taken in by sigwaitinfo below, so block them before
+       the command can exit or be signalled */
+    sigemptyset(&forwarded);
+    sigaddset(&forwarded, SIGHUP);
+    sigaddset(&forwarded, SIGINT);
+    sigaddset(&forwarded, SIGQUIT);
+    sigaddset(&forwarded, SIGTERM);
+    sigaddset(&forwarded, SIGUSR1);
+    sigaddset(&forwarded, SIGUSR2);
+    sigaddset(&forwarded, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &forwarded, &original);
+
+    /* an ignored SIGCHLD, inherited from the caller, would have the
+       command reaped before it can be waited for; the command itself
+       still inherits it */
+    onchild = signal(SIGCHLD, SIG_DFL);
+
+    fflush(stdout);
+    child = fork();
+
+    if (child == 0) {
+        signal(SIGCHLD, onchild);
+        sigprocmask(SIG_SETMASK, &original, NULL);
+        execvp(command[0], command);
+        error(0, errno, "Could not run '%s'", command[0]);
+        _exit(errno == ENOENT? 127 : 126);
+    }
 
-        error(1, 0, "fork error");
+    if (child < 0) {
+        sigprocmask(SIG_SETMASK, &original, NULL);
+        error(0, errno, "Could not run '%s'", command[0]);
+        return 126;
+    }
 
-    else if (pid == 0) {  /* pid==0 means this is the forked child */
+    /* renewals are due at an absolute deadline, in milliseconds on the
+       monotonic clock, so that a stream of signals cannot put them off */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now.tv_sec*1000 + now.tv_nsec/1000000 + (ttl/2 < 1? 1 : ttl/2);
 
-        pid = fork();
-        if (pid < 0)
-            error(1, 0, "fork error");
-        else if (pid > 0)
-            /* parent from second fork, i.e. first child */
-            return NO_ERROR;       
+    while ((waited = waitpid(child, &status, WNOHANG)) == 0
+           || (waited < 0 && errno == EINTR)) {
+        if (ttl <= 0)
+            i = sigwaitinfo(&forwarded, &info);
         else {
-            ; /* We are the second child and will continue with the function */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = deadline - (now.tv_sec*1000 + now.tv_nsec/1000000);
+            if (left <= 0) {
+                if (renew_through_daemon(filename, remote, nkeys, keys, owner, ttl) < 0)
+                    renew_resource(filename, nkeys, keys, owner, ttl, durability);
+                deadline = now.tv_sec*1000 + now.tv_nsec/1000000 + (ttl/2 < 1? 1 : ttl/2);
+                continue;
+            }
+            remaining.tv_sec  = left/1000;
+            remaining.tv_nsec = left%1000*1000000;
+            i = sigtimedwait(&forwarded, &info, &remaining);
         }
-
-    } else {
-
-        if (waitpid(pid, NULL, 0) != pid)  /* wait for first child */
-            error(1, 0, "waitpid error");
-        return NO_ERROR;
-
+        if (i > 0 && info.si_signo != SIGCHLD
+            && (info.si_code == SI_USER || info.si_code == SI_QUEUE))
+            kill(child, info.si_signo);
     }
 
-    /* If we get here, we know that we are the deamonized process. */
-
-    /* delay */
-    sleep(delay);
-
-    /* return the resource to the pool, using file locks */
-
-    fill_file_lock_controls(&set_lock, &unset_lock);
+    if (waited < 0)
+        error(0, errno, "Could not wait for '%s'", command[0]);
 
+    sigprocmask(SIG_SETMASK, &original, NULL);
 
-    file = fopen(filename, "r+");
+    if (waited < 0)
+        return 126;
 
-    if (file != NULL) {
+    return WIFEXITED(status)? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 
-        file_descriptor = fileno(file);
-        fcntl(file_descriptor, F_SETLKW, &set_lock);
-        
-        do {
-            file_pointer = ftell(file);
-            checkline = fgets(line, sizeof(line), file);
-            if (strlen(line) > 0 && line[strlen(line)-1]=='\n')
-                line[strlen(line)-1]='\0';
-        } while ( checkline != NULL && !feof(file) && strcmp(line+1, key) != 0 );
-        
-        if (feof(file))
-            exitcode = NOT_FOUND;
-        else {           
-            fseek(file, file_pointer, SEEK_SET);
-            fprintf(file, "%c", ' ');
-            exitcode = NO_ERROR;
-        }
-        
-        fcntl(file_descriptor, F_SETLK, &unset_lock);
-        fclose(file);
-
-    } else {
-
-        exitcode = FILE_NOT_OPEN;
-        
-    }
-
-    return exitcode;
-
-} /* end release_resource(filename,key) */
+} /* end run_command(command,nkeys,keys,filename,remote,durability,owner,ttl) */
 
 /****************************************************************************/
 
-int create_resource_file(char* filename, int argc, char**argv) 
+int run_with_keys(char* text, int nfiles, char* filename, int remote, char** command, long delay, enum Locking locking, enum Durability durability, pid_t owner, long ttl)
 {
-    FILE* f = fopen(filename,"w"); 
-
-    if ( f != NULL ) {
-
-        int i;
+    /* Run a command with the keys obtained in 'text', which are preceded
+       by the name of their file if they may come from several 'nfiles',
+       and release them once it is done, after 'delay' (see run_command).
+       Returns the exit code of the command. */
+
+    char**  keys = NULL;
+    char*   line;
+    int     nkeys = 0;
+    int     exitcode;
+    int     status;
 
-        for (i=0; i< argc; i++) 
-            fprintf(f, " %s\n", argv[i]);
+    for (line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        if (nfiles > 1 && line == text)
+            filename = line;
+        else {
+            keys = realloc(keys, (nkeys + 1)*sizeof(char*));
+            keys[nkeys++] = line;
+        }
+    }
 
-        fclose(f);
+    setenv(FILE_VARIABLE, filename, 1);
+    status = run_command(command, nkeys, keys, filename, remote, durability, owner, ttl);
 
-        return 0;
+    exitcode = release_through_daemon(filename, remote, nkeys, keys, delay, owner);
+    if (exitcode < 0)
+        exitcode = release_resource(filename, nkeys, keys, delay, locking, durability, owner);
+    if (exitcode != NO_ERROR)
+        error(0, 0, "Error (releasing keys): %s.", mresource_ExitMsg[exitcode]);
 
-    } else {
+    free(keys);
 
-        return 1;
-    }
+    return status;
 
-} /* end create_resource_file */
+} /* end run_with_keys(text,nfiles,filename,remote,command,delay,locking,durability,owner,ttl) */
 
 /****************************************************************************/
 
-int append_resource_file(char* filename, int argc, char**argv) 
+void show_help()
 {
-    /* Append possible keys to a resource file that could be in use already */
-    
-    FILE*   file;
-    int     file_descriptor;
-    int     exitcode;
-    struct flock set_lock, unset_lock;
-
-    fill_file_lock_controls(&set_lock, &unset_lock);
-
-    while (1) {
-        file = fopen(filename, "a");
-
-        if (file != NULL) {
-
-            int i;
-
-            file_descriptor = fileno(file);
-            fcntl(file_descriptor, F_SETLKW, &set_lock);
-            
-            for (i=0; i< argc; i++) 
-                fprintf(file, " %s\n", argv[i]);
-            
-            fcntl(file_descriptor, F_SETLK, &unset_lock);
-            fclose(file);
-
-            exitcode = NO_ERROR;
-
-            break;
-
-        } else {
-            
-            exitcode = FILE_NOT_OPEN;
-            
-        }
-        
-    }
-
-    return exitcode;
+    /* Show help message */
+    printf("\n"
+           "mresource - file-based resource key allocator\n"
+           "\n"
+           "  Usage:\n"
+           "\n"
+           "    mresource [ -h | --help ]\n"
+           "    mresource FILE [-n N] [-t TIME] [-p POLLTIME] [-b MAXPOLLTIME] [-l|--atomic]\n"
+           "                   [-o POLICY] [--ttl TTL] [--require TAGS]\n"
+           "                   [--prefer TAGS] [--or FILE2 ...] [-P PRIORITY] [--remote]\n"
+           "    mresource FILE [-n N] [...] [-d DELAY] -- COMMAND [ARG ...]\n"
+           "    mresource FILE KEY1 [KEY2 ....] [-d DELAY] [-l|--atomic]\n"
+           "    mresource FILE --renew KEY1 [KEY2 ....] [--ttl TTL]\n"
+           "    mresource FILE -c [-i] [--shards K] KEY1 [KEY2 ....] \n"
+           "    mresource FILE -c [-i] [--shards K] - < KEYFILE\n"
+           "    mresource FILE -a KEY1 [KEY2 ....] \n"
+           "    mresource FILE -r KEY1 [KEY2 ....] \n"
+           "    mresource FILE --compact\n"
+           "    mresource FILE -i\n"
+           "    mresource FILE -x\n"
+           "    mresource FILE -s [--holders]\n"
+           "    mresource FILE --stats\n"
+           "    mresource FILE -D [-p POLLTIME] [-l|--atomic] [--listen [HOST:]PORT]\n"
+           "    mresource FILE --agent K [--idle IDLE] [-p POLLTIME] [-l|--atomic]\n"
+           "\n"
+           "  When given a FILE but no key(s), mresource prints out\n"
+           "  the next available resource in the file, and marks it\n"
+           "  as used in the file. If no resource is available, it\n"
+           "  waits until the file gets modified (e.g. by a release),\n"
+           "  or for at most POLLTIME, before trying again.\n"
+           "\n"
+           "  With '-n N', N resources are obtained at once and printed\n"
+           "  one per line. Either all N are marked, or none are, so\n"
+           "  while waiting no resources are held.\n"
+           "\n"
+           "  With '--or FILE2', and more '--or' options, the keys are\n"
+           "  obtained from the first of FILE, FILE2, ... that has them\n"
+           "  free, e.g. for a fast and a slow class of resources. If\n"
+           "  none has, mresource waits on all of them at once. All\n"
+           "  keys come from one file, whose name is printed on a line\n"
+           "  before them; release them with that file. Such calls do\n"
+           "  not go through a daemon or agent.\n"
+           "\n"
+           "  POLLTIME is 2 seconds by default, but can be set with\n"
+           "  the optional '-p POLLTIME' argument. It is the fallback\n"
+           "  for file systems on which modifications by other hosts\n"
+           "  are not notified (e.g. NFS).\n"
+           "\n"
+           "  With '-o POLICY', the search for free resources starts\n"
+           "  at the first one ('first', the default), after the one\n"
+           "  obtained last from FILE ('next'), or at a random one\n"
+           "  ('random'). The latter two spread the use evenly over\n"
+           "  the keys, and 'next' also shortens the search when most\n"
+           "  keys are in use. The 'next' position is kept in the\n"
+           "  index of an indexed file, and in FILE.cursor otherwise.\n"
+           "  With 'least', the keys with the smallest part of their\n"
+           "  capacity in use are obtained (see '-c' below).\n"
+           "\n"
+           "  With '-b MAXPOLLTIME', the wait doubles after every\n"
+           "  unsuccessful try, up to MAXPOLLTIME, and is randomized\n"
+           "  so that many waiters do not retry in lock step.\n"
+           "\n");
+    printf("  Callers that have to wait queue up in FILE.queue, and\n"
+           "  get keys in the order they came, so that a request for\n"
+           "  many keys is not overtaken forever by smaller ones; the\n"
+           "  first in line holds on to the keys that come free until\n"
+           "  it has all it needs. With '-P PRIORITY', a caller goes\n"
+           "  ahead of waiters with a lower PRIORITY (0 by default).\n"
+           "  Waiters that died or gave up are dropped from the queue,\n"
+           "  as are those that have not retried for four of their\n"
+           "  POLLTIMEs (or MAXPOLLTIMEs), and at least a second.\n"
+           "\n"
+           "  With '-t TIME', mresource only tries for TIME; '-t 0'\n"
+           "  tries only once. Without '-t TIME', mresource waits\n"
+           "  until a resource is available.\n"
+           "\n"
+           "  When given a FILE and one or more KEYs, those resource\n"
+           "  keys get unmarked in the file, after a DELAY lag time.\n"
+           "  Without a DELAY, this happens before mresource exits, and\n"
+           "  the exit code reports whether all keys were found. With\n"
+           "  a DELAY, the release is queued in FILE.pending, and is\n"
+           "  carried out by the first mresource call on FILE after the\n"
+           "  DELAY has passed; waiting callers wake up for it.\n"
+           "\n"
+           "  With '-- COMMAND', the keys are not printed, but passed\n"
+           "  to COMMAND in MRESOURCE_KEYS (separated by spaces), and\n"
+           "  their file in MRESOURCE_FILE. mresource waits for it,\n"
+           "  passes on the signals it gets, and releases the keys,\n"
+           "  after '-d DELAY' if given, once COMMAND exits. The exit\n"
+           "  code is that of COMMAND. The keys are leased to this\n"
+           "  mresource, and their '--ttl' lease gets renewed while\n"
+           "  COMMAND runs, so they come free even if it gets killed.\n"
+           "\n");
+    printf("  With '-l', obtaining and releasing only lock the records\n"
+           "  involved, instead of the whole file, so that processes\n"
+           "  working on different keys do not wait for each other.\n"
+           "  Processes with and without '-l' can be mixed.\n"
+           "\n"
+           "  With '--atomic', obtaining and releasing never wait for\n"
+           "  one another: a key is claimed by swapping its first\n"
+           "  character from free to used in one atomic operation on\n"
+           "  FILE mapped into memory, and released by a swap back. A\n"
+           "  lock shared by all of them only keeps out changes to the\n"
+           "  whole FILE, like '-a' and '--compact'. This is meant for\n"
+           "  a FILE on a local ram-based file system that many jobs\n"
+           "  on one node use at once. Keys with a capacity (see '-c')\n"
+           "  are still locked one at a time, as with '-l'. A claim\n"
+           "  also locks its key as '-l' does, but passes it by rather\n"
+           "  than wait, so processes with '--atomic' can be mixed with\n"
+           "  ones with or without '-l'; one process cannot be given\n"
+           "  both.\n"
+           "\n");
+    printf("  With '-s', mresource prints how many keys FILE has, and\n"
+           "  how many of them are free and in use, on one line, e.g.\n"
+           "  'total 12 free 8 used 4'. It only takes a shared lock\n"
+           "  and reads just the header of an indexed file, so it is\n"
+           "  cheap enough to run often. With '--holders', it also\n"
+           "  lists who holds which keys, one lease per line.\n"
+           "\n"
+           "  If the environment variable MRESOURCE_STATS is set (and\n"
+           "  not '0'), every obtain and release on FILE appends a\n"
+           "  line to FILE.stats with its time spent waiting for and\n"
+           "  holding locks, the free keys it looked at, the number\n"
+           "  of tries and the outcome. With '--stats', mresource\n"
+           "  sums these up into percentiles per operation. Calls\n"
+           "  served by a daemon (see '-D') are not included.\n"
+           "\n"
+           "  With '--sync MODE', or MRESOURCE_SYNC=MODE in the\n"
+           "  environment, any call on FILE only returns once its\n"
+           "  changes to FILE and FILE.leases are on disk: 'data'\n"
+           "  flushes them before unlocking FILE, 'group' right after,\n"
+           "  so that concurrent calls share flushes. The default,\n"
+           "  'none', leaves writing them out to the system, which is\n"
+           "  fastest, and is all that a ram-based FILE needs, but on\n"
+           "  disk the last changes may be lost in a crash. A daemon\n"
+           "  or agent flushes as it was started with.\n"
+           "\n"
+           "  With '-D', mresource runs as a daemon for FILE, until it\n"
+           "  gets interrupted or terminated. It serves obtain and\n"
+           "  release requests on the socket FILE.sock, which other\n"
+           "  mresource calls on FILE use automatically, and it lets\n"
+           "  waiting callers know directly when keys get released.\n"
+           "  FILE keeps the state, so it can still be used as well\n"
+           "  where FILE.sock cannot be reached, e.g. on other hosts.\n"
+           "  The daemon does not detach; run it in the background.\n"
+           "\n"
+           "  With '--listen [HOST:]PORT', the daemon also serves on\n"
+           "  that TCP port (0 picks a free one), and writes where it\n"
+           "  listens to FILE.addr. Without a HOST it only listens on\n"
+           "  the loopback interface; give the address of one to serve\n"
+           "  other hosts, or 0.0.0.0 for all. There is no\n"
+           "  authentication: anyone who reaches the port can obtain\n"
+           "  and release keys, so only listen on trusted networks.\n"
+           "  Calls on other hosts that see FILE (and so FILE.addr) go\n"
+           "  through the daemon as well if they are given '--remote'\n"
+           "  (or MRESOURCE_REMOTE=1 is set), and a FILE given as\n"
+           "  'tcp://HOST:PORT' reaches the daemon without any file at\n"
+           "  all. Keys obtained from other hosts are only reclaimed\n"
+           "  once their '--ttl' runs out, as the daemon cannot tell\n"
+           "  whether the owner died.\n"
+           "\n"
+           "  With '--agent K', mresource runs as an agent for FILE on\n"
+           "  this host, until it gets interrupted or terminated. It\n"
+           "  takes keys from FILE K at a time, in one locked obtain,\n"
+           "  and hands them out to mresource calls on this host, on\n"
+           "  the socket FILE.HOST.agent, which they use before any\n"
+           "  daemon. In FILE, free keys are leased to the agent and\n"
+           "  keys in use to their holders, so '-s --holders' shows\n"
+           "  who holds them, and the keys of a holder that dies are\n"
+           "  reclaimed while those of a dead agent's holders are not.\n"
+           "  Keys that stay free in the agent for IDLE (10 seconds,\n"
+           "  unless given with '--idle') go back to FILE, as do all\n"
+           "  free keys when the agent exits. Keys obtained from the\n"
+           "  agent are to be released through it, and requests with\n"
+           "  tags are passed on to FILE.\n"
+           "\n");
+    printf("  Obtained keys are leased, as recorded in FILE.leases,\n"
+           "  to the process given with '--owner PID', to mresource\n"
+           "  itself when it runs a COMMAND, and otherwise to no\n"
+           "  process in particular. When no resource is available,\n"
+           "  keys leased to processes that have died on this host\n"
+           "  are released, as are keys with a lease given by '--ttl\n"
+           "  TTL' that has run out. Holders renew their lease with\n"
+           "  FILE, '--renew' and their keys; a '--ttl' then also\n"
+           "  replaces the TTL. A release with '--owner' leaves keys\n"
+           "  alone that are now leased to others only, as their lease\n"
+           "  was reclaimed from the owner, and warns about them. A\n"
+           "  lease is that of the PID on the host it runs on.\n"
+           "\n"
+           "  TIME, POLLTIME, MAXPOLLTIME, DELAY and TTL are in seconds,\n"
+           "  but may be fractional or carry a unit, e.g. '0.5',\n"
+           "  '50ms', '2s', '1m' or '1h'.\n"
+           "\n"
+           "  Note that FILE should contain a list of resource keys.\n"
+           "  The first character of each line is reserved to store the\n"
+           "  allocation signal: when it is a space (as it should be \n"
+           "  initially), then the resource is not reserved, when it \n"
+           "  is an exclamation mark it is.\n"
+           "\n"
+           "  mresource can generate such a file when invoked with\n"
+           "  FILE, '-c', and a list of one or more keys.\n"
+           "\n"
+           "  Keys given to '-c' or '-a' may hold ranges, which give\n"
+           "  a key for each number: 'gpu[0-3]' gives gpu0 to gpu3,\n"
+           "  'node[01-08,12]' keeps the leading zeros, and, as in\n"
+           "  the shell, 'node{01..64}:gpu{0..7}' gives 512 keys. A\n"
+           "  key '-' reads more keys from stdin, one per line, for\n"
+           "  sets too large for the command line. With '-c', FILE\n"
+           "  is written under a temporary name and then renamed, so\n"
+           "  the previous FILE is replaced as a whole; processes that\n"
+           "  have the previous FILE open move on to the new one.\n"
+           "\n"
+           "  With '-r', the given keys are taken out of service: free\n"
+           "  ones right away, and ones in use once they get released.\n"
+           "  Their lines start with a '-' (or a '~' while still in\n"
+           "  use), and they are never obtained again. They count as\n"
+           "  used for '-s' until FILE is compacted with '--compact',\n"
+           "  which rewrites FILE without them, keeping the state of\n"
+           "  all other keys. The rewrite is done under a temporary\n"
+           "  name and renamed over FILE, so other processes never\n"
+           "  see it half done.\n"
+           "\n"
+           "  A key given as 'KEY:N' can be obtained by N users at\n"
+           "  once. Its line then holds a count after the allocation\n"
+           "  signal, e.g. ' #1/4 KEY', and the signal only becomes\n"
+           "  an exclamation mark when all N are in use. With '-n N',\n"
+           "  the keys obtained are all different.\n"
+           "\n"
+           "  Keys may be followed by tags on their line, i.e.,\n"
+           "  words 'NAME=VALUE', given with the key to '-c' or '-a',\n"
+           "  e.g. 'R1 numa=0 host=n12' or 'R2:4 numa=1'. With\n"
+           "  '--require TAGS', only keys with all of TAGS, a comma-\n"
+           "  separated list such as 'numa=0,host=n12', are obtained.\n"
+           "  With '--prefer TAGS', keys with all of TAGS are obtained\n"
+           "  if enough are free, and other keys otherwise.\n"
+           "\n"
+           "  With '-c -i', the file gets an index: a binary header\n"
+           "  with the number of free keys, a bitmap of the free keys\n"
+           "  and a hash table of all keys, so that neither obtaining\n"
+           "  nor releasing a key has to scan the file. This pays off\n"
+           "  for large numbers of keys.\n"
+           "\n"
+           "  Invoked with FILE and just '-i', mresource converts an\n"
+           "  existing file to the indexed format, keeping the state\n"
+           "  of its keys. With FILE and '-x', it prints the file in\n"
+           "  the plain format, which also converts it back.\n"
+           "\n"
+           "  mresource can insert more keys into such a file when\n"
+           "  invoked with FILE, '-a', and a list of one or more keys.\n"
+           "\n"
+           "  With '-c --shards K', the keys are divided over K files\n"
+           "  FILE.0 to FILE.K-1, and FILE becomes a manifest that\n"
+           "  lists them, so that there is not one lock for all keys.\n"
+           "  Processes obtaining from FILE start at a shard picked by\n"
+           "  their host and process id, and move on to the next one\n"
+           "  if it is locked or has too few free keys; keys obtained\n"
+           "  with '-n N' come from one shard. All other operations\n"
+           "  on FILE go to the shard each key belongs to, except '-D';\n"
+           "  a daemon serves one file only.\n"
+           "\n"
+           "  TIP: When accessed a lot, put FILE a ram-based file\n"
+           "  system, e.g., /tmp or /dev/shm.\n"
+           "\n\n"
+           "Ramses van Zon, SciNet, Toronto, 2013-2022\n"
+           "\n"); 
     
-} /* end append_resource_file */
+} /* end show_help() */
 
 /****************************************************************************/
 
@@ -438,29 +925,99 @@ int main(int argc, char**argv)
 {
     /* Main program */
 
-    enum Mode  mode;        /* what are we supposed to be doing?  */
-    char*      filename;    /* file with resource names           */
-    char**     keys=NULL;   /* requested key(s)                   */
-    int        timeout=0;   /* time-out delay                     */
-    int        nkeys;       /* number of keys on command line     */
-    int        delay;       /* delay in releasing the key (silly implementation for now) */
-    int        polltime;    /* number of seconds in between tries */
+    struct Options options; /* what the command line asks for      */
+    FILE*      captured=NULL; /* keys obtained for a command to run  */
+    char*      text;        /* the same, once obtained             */
+    int        saved;       /* stdout while keys are captured      */
+    int        status=0;    /* exit code of the command            */
     int        exitcode=0;
 
-    read_cmdline(argc, argv, &mode, &filename, &keys, &nkeys, &timeout, &delay, &polltime);
+    read_cmdline(argc, argv, &options);
 
-    switch (mode) {
+    switch (options.mode) {
     case CREATE:    
-        exitcode = create_resource_file(filename, nkeys, keys); 
+        options.nkeys = expand_keys(options.nkeys, options.keys, stdin, &options.keys);
+        exitcode = options.nkeys < 0? ARGUMENT_ERROR 
+                 : create_resource_file(options.filename, options.nkeys, options.keys, 
+                                          options.indexed, options.nshards, options.durability); 
+        free_names(options.keys, options.nkeys);
         break;
     case APPEND:    
-        exitcode = append_resource_file(filename, nkeys, keys); 
+        options.nkeys = expand_keys(options.nkeys, options.keys, stdin, &options.keys);
+        exitcode = options.nkeys < 0? ARGUMENT_ERROR 
+                 : append_resource_file(options.filename, options.nkeys, options.keys, 
+                                          options.durability); 
+        free_names(options.keys, options.nkeys);
+        break;
+    case REMOVE:    
+        options.nkeys = expand_keys(options.nkeys, options.keys, stdin, &options.keys);
+        exitcode = options.nkeys < 0? ARGUMENT_ERROR 
+                 : remove_resource_file(options.filename, options.nkeys, options.keys, 
+                                          options.durability); 
+        free_names(options.keys, options.nkeys);
+        break;
+    case COMPACT:    
+        exitcode = compact_resource_file(options.filename, options.durability); 
+        break;
+    case CONVERT:    
+        exitcode = convert_resource_file(options.filename, options.durability); 
+        break;
+    case EXPORT:    
+        exitcode = export_resource_file(options.filename); 
         break;
     case OBTAIN:    
-        exitcode = obtain_resource(filename, timeout, polltime); 
+    case RUN:
+        /* keys for a command are not printed, but passed on to it */
+        if (options.mode == RUN)
+            captured = capture_stdout(&saved);
+        /* a daemon serves one file, so several are obtained from directly */
+        exitcode = options.nfiles > 1? -1 
+                 : obtain_through_daemon(options.filename, options.remote, options.nwanted, 
+                                         options.timeout, options.policy, options.owner, options.ttl, 
+                                         options.require, options.prefer, options.priority);
+        if (exitcode < 0)
+            exitcode = obtain_any_resource(options.nfiles, options.files, options.nwanted, 
+                                           options.timeout, options.polltime, options.maxpolltime,
+                                           options.locking, options.durability, options.policy, 
+                                           options.owner, options.ttl, options.require, 
+                                           options.prefer, options.priority);
+        if (options.mode == RUN) {
+            text = release_stdout(captured, saved);
+            if (exitcode == NO_ERROR)
+                status = run_with_keys(text, options.nfiles, options.filename, options.remote, 
+                                       options.command, options.delay, options.locking, 
+                                       options.durability, options.owner, options.ttl);
+            free(text);
+        }
         break;
     case RELEASE:  
-        exitcode = release_resource(filename, keys[0], delay); 
+        exitcode = release_through_daemon(options.filename, options.remote, options.nkeys, 
+                                          options.keys, options.delay, options.owner);
+        if (exitcode < 0)
+            exitcode = release_resource(options.filename, options.nkeys, options.keys, 
+                                        options.delay, options.locking, options.durability, 
+                                        options.owner); 
+        break;
+    case STATUS:  
+        exitcode = status_resource_file(options.filename, options.holders); 
+        break;
+    case STATS:  
+        exitcode = stats_resource_file(options.filename); 
+        break;
+    case RENEW:  
+        exitcode = renew_through_daemon(options.filename, options.remote, options.nkeys, 
+                                        options.keys, options.owner, options.ttl);
+        if (exitcode < 0)
+            exitcode = renew_resource(options.filename, options.nkeys, options.keys, 
+                                      options.owner, options.ttl, options.durability); 
+        break;
+    case SERVE:    
+        exitcode = serve_resource_file(options.filename, options.polltime, options.locking, 
+                                       options.durability, options.listen_on); 
+        break;
+    case AGENT:    
+        exitcode = agent_resource_file(options.filename, options.block, options.idle, 
+                                       options.polltime, options.locking, options.durability); 
         break;
     case SHOW_HELP: 
         show_help(); 
@@ -470,10 +1027,12 @@ int main(int argc, char**argv)
         exitcode = 1;
     }
 
+    free(options.files);
+
     if (exitcode!=0) 
-        error(exitcode, 0, "Error (%s): %s.", argv[0], ExitMsg[exitcode]);
+        error(exitcode, 0, "Error (%s): %s.", argv[0], mresource_ExitMsg[exitcode]);
     else 
-        return NO_ERROR;
+        return status;
 
 } /* end main((int argc, char**argv) */
 
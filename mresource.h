@@ -0,0 +1,193 @@
+/* 
+ * mresource.h - interface of libmresource, the file-based resource key
+ *               allocator as a library
+ *
+ * Copyright (c) 2013-2022  Ramses van Zon
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef MRESOURCE_H
+#define MRESOURCE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*****************************************************************************/
+
+#define POLL_INTERVAL 2000  /* milliseconds between trying to get a key      */
+#define NO_TIMEOUT      -1  /* value of the time-out when waiting forever    */
+#define AGENT_IDLE   10000  /* milliseconds before an agent returns free keys */
+#define MAX_EXPANSION 16777216 /* most keys that key arguments expand to     */
+#define SYNC_VARIABLE "MRESOURCE_SYNC" /* environment variable with the
+                               durability of changes: none, data or group    */
+#define REMOTE_VARIABLE "MRESOURCE_REMOTE" /* environment variable that, if
+                               set, has the command reach daemons through
+                               FILE.addr by default                          */
+
+/*****************************************************************************/
+
+enum ExitCodes { 
+    /* possible error codes of the program */
+    NO_ERROR=0,       /* exit code when all's well                           */
+    FILE_NOT_OPEN,    /* exit code when file could not be opened             */
+    NOT_FOUND,        /* exit code when a key could not be found             */
+    ARGUMENT_ERROR,   /* exit code when called with too few arguments        */
+    TIME_OUT,         /* exit code when key was not obtained before timeout  */
+    BAD_FILE          /* exit code when the file's index is inconsistent     */
+};
+
+extern char mresource_ExitMsg[6][22]; /* messages for the exit codes        */
+
+/*****************************************************************************/
+
+enum Locking {
+    /* how processes keep each other from modifying the same records */
+    LOCK_FILE = 0,   /* write-lock the whole file for each operation         */
+    LOCK_RECORDS,    /* share a scan lock, and write-lock single records     */
+    LOCK_ATOMIC      /* share a scan lock, and swap signals atomically, in a
+                        shared mapping, trying a record lock along so as
+                        not to clash with LOCK_RECORDS                      */
+};
+
+/*****************************************************************************/
+
+enum Policy {
+    /* where the search for free records starts when obtaining */
+    FIRST_FIT = 0,   /* at the first record, so the first keys are preferred */
+    NEXT_FIT,        /* after the last record obtained, by any process       */
+    RANDOM_FIT,      /* at a random record                                   */
+    LEAST_LOADED     /* at the record with the least of its capacity in use  */
+};
+
+/*****************************************************************************/
+
+enum Durability {
+    /* when changes to a resource file are flushed to disk */
+    SYNC_NONE = 0,   /* never; the system writes them out when it likes      */
+    SYNC_DATA,       /* with fdatasync, before the file is unlocked          */
+    SYNC_GROUP       /* with fdatasync, once the file is unlocked, so that
+                        concurrent operations share their flushes           */
+};
+
+/*****************************************************************************/
+
+/* Operations on a resource file given by name, as carried out by the
+   mresource program. All return one of the ExitCodes. Obtained keys are
+   printed to stdout, one per line; times are in milliseconds. Obtained
+   keys are leased to an 'owner' process, or to none if it is 0, and are
+   reclaimed by later obtains once that process has died on this host
+   or, if 'ttl' is positive, once the lease has not been renewed for
+   'ttl'. A release by an owner leaves keys alone that were reclaimed
+   from it, returning NOT_FOUND, unless it still has a lease; a lease is
+   that of an owner on a host, as process ids are only unique on one.
+   Tags to 'require' or to 'prefer' are comma-separated lists of
+   NAME=VALUE, or NULL. If the environment variable MRESOURCE_STATS is
+   set (and not "0"), the lock waits, lock holds, records scanned, polls
+   and outcome of each obtain and release are appended to FILE.stats,
+   which stats_resource_file summarizes. The 'durability' of the changes
+   to FILE and its lease log is SYNC_NONE (e.g. for /dev/shm), SYNC_DATA
+   or SYNC_GROUP; either of the latter has each operation return only
+   once its changes are on disk. Its default, as set by the environment
+   variable MRESOURCE_SYNC ('none', 'data' or 'group'), is returned by
+   durability_setting. */
+
+int obtain_resource(char* filename, int nwanted, long timeout, long polltime, long maxpolltime, enum Locking locking, enum Durability durability, enum Policy policy, pid_t owner, long ttl, char* require, char* prefer);
+int release_resource(char* filename, int nkeys, char** keys, long delay, enum Locking locking, enum Durability durability, pid_t owner);
+int renew_resource(char* filename, int nkeys, char** keys, pid_t owner, long ttl, enum Durability durability);
+int create_resource_file(char* filename, int argc, char**argv, int indexed, int nshards, enum Durability durability);
+int append_resource_file(char* filename, int argc, char**argv, enum Durability durability);
+int convert_resource_file(char* filename, enum Durability durability);
+int export_resource_file(char* filename);
+int remove_resource_file(char* filename, int nkeys, char** keys, enum Durability durability);
+int compact_resource_file(char* filename, enum Durability durability);
+int status_resource_file(char* filename, int holders);
+int stats_resource_file(char* filename);
+enum Durability durability_setting(void);
+
+/* Obtaining from the first of several resource files, in order of
+   preference, that has the keys free, waiting on all of them at once if
+   none has; the keys are preceded by a line with the name of that file.
+   Processes that wait queue up in FILE.queue, and are served by
+   'priority' (higher first), then in the order they came. */
+
+int obtain_any_resource(int nfiles, char** filenames, int nwanted, long timeout, long polltime, long maxpolltime, enum Locking locking, enum Durability durability, enum Policy policy, pid_t owner, long ttl, char* require, char* prefer, int priority);
+
+/* The same through the daemon serving a resource file, found through
+   FILE.sock on its own host, through a FILE given as 'tcp://HOST:PORT',
+   and, if 'remote' is set, through FILE.addr on others; these return -1
+   if there is no such daemon. */
+
+int obtain_through_daemon(char* filename, int remote, int nwanted, long timeout, enum Policy policy, pid_t owner, long ttl, char* require, char* prefer, int priority);
+int release_through_daemon(char* filename, int remote, int nkeys, char** keys, long delay, pid_t owner);
+int renew_through_daemon(char* filename, int remote, int nkeys, char** keys, pid_t owner, long ttl);
+int serve_resource_file(char* filename, long polltime, enum Locking locking, enum Durability durability, char* listen_on);
+
+/* A node-local agent for a resource file, which takes keys from it 'block'
+   at a time, hands them out to calls on this host, and returns the ones
+   that are free for 'idle' milliseconds. */
+
+int agent_resource_file(char* filename, int block, long idle, long polltime, enum Locking locking, enum Durability durability);
+
+/* The number of keys of a resource file, and of those that are free, for
+   programs that check often; only a shared lock is taken. */
+
+int count_free_resources(char* filename, unsigned long* nkeys, unsigned long* nfree);
+
+/* Key arguments for create_resource_file and append_resource_file with
+   ranges such as 'gpu[0-4095]', 'node[01-08,12]' or 'node{01..64}:gpu{0..7}'
+   expanded, and with an argument '-' replaced by the lines read from 'in'.
+   Returns the number of keys put in 'keys', to be freed with free_names,
+   or -1 if a range has a number too large to represent, or the arguments
+   expand to more than MAX_EXPANSION keys. */
+
+int  expand_keys(int argc, char** argv, FILE* in, char*** keys);
+void free_names(char** names, int nnames);
+
+/*****************************************************************************/
+
+/* Handles to a resource file that stays open, for programs that obtain and
+   release resources many times. Keys are returned in a buffer rather than
+   printed. */
+
+struct MResource;
+
+struct MResource* mresource_open(char* filename, enum Locking locking, enum Policy policy);
+void mresource_set_polling(struct MResource* handle, long polltime, long maxpolltime);
+void mresource_set_lease(struct MResource* handle, pid_t owner, long ttl);
+void mresource_set_tags(struct MResource* handle, char* require, char* prefer);
+void mresource_set_priority(struct MResource* handle, int priority);
+void mresource_set_durability(struct MResource* handle, enum Durability durability);
+int  mresource_obtain(struct MResource* handle, int nwanted, long timeout, char* keys, size_t size);
+int  mresource_release(struct MResource* handle, int nkeys, char** keys, long delay);
+int  mresource_renew(struct MResource* handle, int nkeys, char** keys);
+void mresource_close(struct MResource* handle);
+
+/*****************************************************************************/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -64,3 +64,445 @@ do
         echo $task:no resource available
     fi
 done
+
+# -----------------------------
+# Checks of individual features
+# -----------------------------
+#
+# Each check below works on files of its own in CHECKDIR, and prints
+# 'ok' or 'FAILED' with what it checks. The exit code of the script is
+# the number of checks that failed.
+
+CHECKDIR=/dev/shm/mrtest.$$
+FAILED=0
+rm -rf $CHECKDIR
+mkdir -p $CHECKDIR
+
+check() {
+    # Report whether check $1 had the expected outcome $2; it had $3
+    if [ "$2" == "$3" ]
+    then
+        echo "ok: $1"
+    else
+        echo "FAILED: $1 (expected '$2', got '$3')"
+        let FAILED++
+    fi
+}
+
+# Waiting: a waiter wakes up when a key is released, long before its
+# POLLTIME, and sub-second time-outs (also with '-b') are kept
+F=$CHECKDIR/wait
+./mresource $F -c a
+./mresource $F -t 1 >/dev/null
+start=$(date +%s%3N)
+./mresource $F -t 5 -p 10 > $CHECKDIR/wait.out &
+waiter=$!
+sleep 0.3
+./mresource $F a
+wait $waiter
+check "a waiter wakes up on a release" "0 a" "$? $(cat $CHECKDIR/wait.out)"
+check "it does not wait for its POLLTIME" 1 "$(( $(date +%s%3N) - start < 3000 ))"
+start=$(date +%s%3N)
+./mresource $F -t 0.3 -b 1 2>/dev/null
+check "a sub-second time-out is kept" "4 1" "$? $(( $(date +%s%3N) - start < 1000 ))"
+./mresource $F -t nan 2>/dev/null
+check "a time-out that is not a number is an argument error" 3 $?
+./mresource $F a
+
+# Several keys: '-n N' obtains all N or none, and one call releases all
+# keys given to it
+F=$CHECKDIR/gang
+./mresource $F -c a b c
+./mresource $F -n 2x -t 0 2>/dev/null
+check "'-n' only takes a whole number" 3 $?
+./mresource $F -t 1 >/dev/null
+./mresource $F -n 3 -t 0 2>/dev/null
+check "no keys are held when not all N are free" "4 1" "$? $(grep -c '^!' $F)"
+check "N keys are obtained at once" "b c" "$(echo $(./mresource $F -n 2 -t 0))"
+./mresource $F a b c
+check "one call releases all its keys" "0 0" "$? $(grep -c '^!' $F)"
+./mresource $F d 2>/dev/null
+check "a key that is not in the file is not released" 2 $?
+
+# Delayed releases: a release with '-d DELAY' returns right away, and
+# the key is freed after DELAY, waking up a waiter, also one that waits
+# without a time-out while the release comes due
+F=$CHECKDIR/delay
+./mresource $F -c a
+./mresource $F -t 1 >/dev/null
+./mresource $F a -d 0.5
+check "a delayed release leaves the key in use for now" "0 1" "$? $(grep -c '^!' $F)"
+check "the key is freed after the delay" a "$(./mresource $F -t 3 -p 10)"
+./mresource $F a
+./mresource $F -c k{1..5000}
+./mresource $F -n 5000 >/dev/null
+failed=0
+for delay in 1 2 3 4 5 6 7 8 9 10
+do
+    ./mresource $F k5000 -d ${delay}ms
+    ./mresource $F -p 1ms >/dev/null 2>&1 || let failed++
+done
+check "a waiter without a time-out gets a key that comes due" 0 $failed
+
+# Indexed files: '-c -i' creates one, '-a' grows it, '-x' exports it in
+# the plain format, '-i' converts a plain file, and a release of a key
+# not in it is an error
+F=$CHECKDIR/indexed
+./mresource $F -c -i k{1..3}
+check "an indexed file starts with its magic" MRINDEX "$(head -c 7 $F)"
+check "keys are obtained from an indexed file" k1 "$(./mresource $F -t 1)"
+./mresource $F -a k{4..200}
+check "an indexed file grows with '-a'" 199 "$(./mresource $F -n 199 -t 0 | wc -l)"
+./mresource $F k999 2>/dev/null
+check "a key not in the file is not released" 2 $?
+./mresource $F k{1..200}
+check "keys are released in an indexed file" 200 "$(./mresource $F -n 200 -t 0 | wc -l)"
+./mresource $F k{2..200}
+check "an indexed file is exported" "!k1 k2" "$(echo $(./mresource $F -x | head -2))"
+./mresource $F -x > $CHECKDIR/plain
+./mresource $CHECKDIR/plain -i
+check "a plain file is converted" "MRINDEX k2" \
+      "$(head -c 7 $CHECKDIR/plain) $(./mresource $CHECKDIR/plain -t 1)"
+
+# Record locks and policies: calls with '-l' lock single records but
+# still get different keys, and '-o next' continues after the key
+# obtained last
+F=$CHECKDIR/policy
+./mresource $F -c a b c
+check "keys obtained with record locks differ" "a b" "$(./mresource $F -l -t 1) $(./mresource $F -l -t 1)"
+./mresource $F a b
+./mresource $F -o next -t 1 >/dev/null
+./mresource $F a
+check "'-o next' continues after the key obtained last" b "$(./mresource $F -o next -t 1)"
+./mresource $F b
+
+# Daemon: '-D' serves FILE through FILE.sock, which plain calls use,
+# and it wakes up its waiters on a release
+F=$CHECKDIR/sock
+./mresource $F -c a b
+./mresource $F -D &
+daemon=$!
+sleep 0.3
+check "the daemon listens on FILE.sock" yes "$([ -S $F.sock ] && echo yes)"
+check "keys obtained through the daemon differ" "a b" "$(./mresource $F -t 1) $(./mresource $F -t 1)"
+./mresource $F -t 5 -p 10 > $CHECKDIR/sock.out &
+waiter=$!
+sleep 0.3
+./mresource $F a
+wait $waiter
+check "a waiter on the daemon wakes up on a release" "0 a" "$? $(cat $CHECKDIR/sock.out)"
+kill $daemon
+wait $daemon 2>/dev/null
+
+# Library: a program linked with libmresource obtains and releases keys
+# through a handle
+F=$CHECKDIR/handle
+./mresource $F -c a b
+cat > $CHECKDIR/library.c <<END
+#include <stdio.h>
+#include "mresource.h"
+int main(void)
+{
+    char keys[64];
+    char* key = keys;
+    struct MResource* handle = mresource_open("$F", LOCK_FILE, FIRST_FIT);
+    int exitcode = mresource_obtain(handle, 1, 1000, keys, sizeof(keys));
+    keys[1] = '\0';
+    printf("%d %s ", exitcode, keys);
+    printf("%d\n", mresource_release(handle, 1, &key, 0));
+    mresource_close(handle);
+    return 0;
+}
+END
+${CC:-gcc} -o $CHECKDIR/library $CHECKDIR/library.c libmresource.c -I. -std=c99 -D_POSIX_C_SOURCE=200809L
+check "keys are obtained and released through a handle" "0 a 0" "$($CHECKDIR/library)"
+check "the handle left the key free" "a b" "$(echo $(cat $F))"
+
+# Counted keys: a key 'KEY:N' is handed out N times before it is used up
+F=$CHECKDIR/counted
+./mresource $F -c a:2
+check "a counted key is obtained N times" "a a" "$(./mresource $F -t 1) $(./mresource $F -t 1)"
+./mresource $F -t 0 2>/dev/null
+check "not more than N times" 4 $?
+check "the count is kept in the file" "!#2/2 a" "$(cat $F)"
+./mresource $F a a
+
+# Leases: keys of mresource calls from a subshell, which exits right
+# away, are only reclaimed by their TTL, while keys with an owner are
+# also reclaimed once that process has died
+F=$CHECKDIR/leases
+./mresource $F -c a b
+first=$(sh -c "./mresource $F")
+second=$(sh -c "./mresource $F")
+check "keys obtained from subshells differ" "a b" "$first $second"
+./mresource $F -t 0.1 -p 0.05 2>/dev/null
+check "keys of exited subshells are not reclaimed" 4 $?
+./mresource $F a b
+sleep 30 &
+owner=$!
+./mresource $F -n 2 --owner $owner >/dev/null
+kill $owner
+wait $owner 2>/dev/null
+check "keys of a dead owner are reclaimed" "a b" "$(echo $(./mresource $F -n 2 -t 1 -p 0.05))"
+check "the lease log is rewritten with the current leases" "2 0" \
+      "$(grep -c '^+' $F.leases) $(ls $CHECKDIR | grep -c tmp)"
+./mresource $F a b
+./mresource $F -n 2 --ttl 0.2 >/dev/null
+sleep 0.3
+check "keys with an expired TTL are reclaimed" "a b" "$(echo $(./mresource $F -n 2 -t 1 -p 0.05))"
+./mresource $F a b
+sleep 30 &
+owner=$!
+./mresource $F -n 2 --owner $owner --ttl 0.3 >/dev/null
+sleep 0.2
+./mresource $F --renew a b --owner $owner
+sleep 0.2
+./mresource $F -t 0.1 -p 0.05 2>/dev/null
+check "renewed leases are not reclaimed" 4 $?
+sleep 0.2
+sleep 30 &
+other=$!
+./mresource $F -n 2 --owner $other >/dev/null
+./mresource $F a --owner $owner 2>/dev/null
+check "a late release leaves a reclaimed key alone" "2 2" "$? $(grep -c '^!' $F)"
+./mresource $F a b --owner $other
+check "the new owner releases the key" 0 $?
+./mresource $F -n 2 --owner $other >/dev/null
+sed -i "s/^\(+ $other\) [^ ]*/\\1 elsewhere/" $F.leases
+./mresource $F a --owner $other 2>/dev/null
+check "a lease of the same process id on another host is kept" "2 2" "$? $(grep -c '^!' $F)"
+sed -i "s/^\(+ $other\) elsewhere/\\1 $(hostname)/" $F.leases
+./mresource $F a b --owner $other
+kill $owner $other
+wait $owner $other 2>/dev/null
+
+# Tags: '--require' only obtains keys with all given tags, '--prefer'
+# takes those first
+F=$CHECKDIR/tags
+./mresource $F -c "a numa=0" "b numa=1" "c numa=0 rack=1"
+check "only keys with the required tags are obtained" b "$(./mresource $F --require numa=1 -t 1)"
+./mresource $F --require numa=1 -t 0 2>/dev/null
+check "none is obtained if none with the tags is free" 4 $?
+check "keys with the preferred tags go first" c "$(./mresource $F --prefer numa=0,rack=1 -t 1)"
+./mresource $F b c
+
+# Shards: '--shards K' spreads the keys over K files under a manifest,
+# which '-s' sums up, and N keys obtained at once come from one shard
+F=$CHECKDIR/shards
+./mresource $F -c --shards 2 k{1..6}
+check "a shard file is created for each shard" "yes yes" \
+      "$([ -e $F.0 ] && echo yes) $([ -e $F.1 ] && echo yes)"
+check "'-s' sums over the shards" "total 6 free 6 used 0" "$(./mresource $F -s)"
+keys=$(echo $(./mresource $F -n 2 -t 1))
+check "N keys come from one shard" "2 1" \
+      "$(cat $F.0 $F.1 | grep -c '^!') $(grep -l '^!' $F.0 $F.1 | wc -l)"
+./mresource $F $keys
+check "keys are released in their shards" 0 "$(cat $F.0 $F.1 | grep -c '^!')"
+
+# Costs: with MRESOURCE_STATS set, calls log their costs, which
+# '--stats' summarizes
+F=$CHECKDIR/stats
+./mresource $F -c a b
+MRESOURCE_STATS=1 ./mresource $F -n 2 -t 1 >/dev/null
+check "the costs of calls are summarized" "obtain: 1 calls, 1 ok" "$(./mresource $F --stats | head -1)"
+./mresource $F a b
+
+# Benchmark: a small run of mrbench.sh completes
+WORKERS=2 ROUNDS=2 SIZES=4 FORMATS=plain LOCKINGS=file BENCHDIRS=$CHECKDIR ./mrbench.sh >/dev/null
+check "a small benchmark runs" 0 $?
+
+# Ranges: key arguments with ranges are expanded, but not ranges that
+# are too large
+F=$CHECKDIR/ranges
+./mresource $F -c 'n[1-3]' 'm{01..02}'
+check "ranges are expanded" "n1 n2 n3 m01 m02" "$(echo $(cat $F))"
+./mresource $CHECKDIR/toolarge -c 'x[1-99999999999]' 2>/dev/null
+check "a range that is too large is an argument error" 3 $?
+
+# Retiring: '-r' takes a key out of service, and '--compact' drops it
+F=$CHECKDIR/retire
+./mresource $F -c a b c
+./mresource $F -r b
+check "a retired key is not obtained" "a c" "$(echo $(./mresource $F -n 2 -t 1))"
+./mresource $F a c
+./mresource $F --compact
+check "a compacted file drops retired keys" "a c" "$(echo $(cat $F))"
+
+# Daemon over TCP: it leaves its address and pid in FILE.addr, which
+# calls only use when given '--remote', while 'tcp://HOST:PORT' always
+# reaches it; a FILE.addr left behind by a daemon that died is removed,
+# and without a HOST it only listens on loopback
+F=$CHECKDIR/daemon
+./mresource $F -c a b
+./mresource $F -D --listen 127.0.0.1:0 &
+daemon=$!
+sleep 0.3
+check "the daemon leaves its pid in FILE.addr" $daemon "$(sed -n 2p $F.addr | cut -d' ' -f1)"
+check "keys are obtained from tcp://HOST:PORT" a "$(./mresource tcp://$(head -1 $F.addr) -t 1)"
+cp $F.addr $CHECKDIR/elsewhere.addr
+./mresource $CHECKDIR/elsewhere -t 0 2>/dev/null
+check "FILE.addr is not used without '--remote'" 1 $?
+check "FILE.addr is used with '--remote'" b "$(./mresource $CHECKDIR/elsewhere -t 1 --remote)"
+./mresource $F a b
+host=$(sed -n 2p $F.addr | cut -d' ' -f2)
+kill $daemon
+wait $daemon
+printf "127.0.0.1:1\n$daemon $host\n" > $F.addr
+./mresource $F -t 0 --remote >/dev/null
+check "a FILE.addr of a daemon that died is removed" "0 absent" \
+      "$? $([ -e $F.addr ] && echo present || echo absent)"
+./mresource $F a
+./mresource $F -D --listen 0 &
+daemon=$!
+sleep 0.3
+check "without a HOST the daemon listens on loopback" yes \
+      "$(head -1 $F.addr | grep -q '^\(127\.0\.0\.1\|\[::1\]\):' && echo yes)"
+check "keys are obtained from it there" a "$(./mresource tcp://$(head -1 $F.addr) -t 1)"
+./mresource $F a
+kill $daemon
+wait $daemon
+
+# Agent: the keys an agent hands out are leased to their holders in the
+# file, so they stay with them if the agent dies, and are reclaimed if
+# a holder does
+F=$CHECKDIR/agent
+./mresource $F -c a b c d
+./mresource $F --agent 2 &
+agent=$!
+sleep 0.2
+check "keys obtained through an agent differ" "a b" "$(./mresource $F) $(./mresource $F)"
+sleep 30 &
+owner=$!
+./mresource $F --owner $owner >/dev/null
+kill -9 $agent
+wait $agent 2>/dev/null
+check "the holders keep their keys when the agent dies" "d" \
+      "$(echo $(./mresource $F -n 1 -t 1 -p 0.05))"
+kill $owner
+wait $owner 2>/dev/null
+check "the key of a dead holder is reclaimed" "c" \
+      "$(echo $(./mresource $F -n 1 -t 1 -p 0.05))"
+./mresource $F a b c d
+check "all keys are released" 0 $?
+
+# Several files: '--or' obtains from the first file that has free keys,
+# printing its name before the keys
+F=$CHECKDIR/fast
+./mresource $F -c a
+./mresource $CHECKDIR/slow -c b
+check "keys come from the first file" "$F a" "$(echo $(./mresource $F --or $CHECKDIR/slow -t 1))"
+check "or from the next one" "$CHECKDIR/slow b" "$(echo $(./mresource $F --or $CHECKDIR/slow -t 1))"
+./mresource $F a
+./mresource $CHECKDIR/slow b
+
+# Queue: a waiter shows itself in FILE.queue at least every other poll,
+# and one that stops doing so is dropped after four polls (but at least
+# a second), so that a waiter on another host that died does not hold
+# up the queue for long
+F=$CHECKDIR/queue
+./mresource $F -c a
+echo "1 0 99999 elsewhere 1 0 $(date +%s%3N) 1000 -" > $F.queue
+./mresource $F -t 0 2>/dev/null
+check "a waiter ahead in the queue is served first" 4 $?
+check "a waiter that stopped showing itself is dropped" a "$(./mresource $F -t 3 -p 0.05)"
+./mresource $F -t 5 -p 0.05 >/dev/null &
+waiter=$!
+sleep 1.5
+check "a waiter stays in the queue while it waits" 1 "$(wc -l < $F.queue)"
+./mresource $F a
+wait $waiter
+check "the waiter gets the key that is released" 0 $?
+
+# Queue priorities: a waiter with a higher '-P PRIORITY' is served
+# before one that has waited longer
+F=$CHECKDIR/priority
+./mresource $F -c a
+./mresource $F -t 1 >/dev/null
+./mresource $F -t 5 -p 0.05 > $CHECKDIR/low.out &
+low=$!
+sleep 0.3
+./mresource $F -t 5 -p 0.05 -P 5 > $CHECKDIR/high.out &
+high=$!
+sleep 0.3
+./mresource $F a
+wait $high
+check "a waiter with a higher priority goes first" "0 a" "$? $(cat $CHECKDIR/high.out)"
+./mresource $F a
+wait $low
+check "the other waiter is served next" "0 a" "$? $(cat $CHECKDIR/low.out)"
+./mresource $F a
+
+# Durability: '--sync' takes one of its modes, and no other, and
+# MRESOURCE_SYNC gives the default
+F=$CHECKDIR/sync
+./mresource $F -c a
+check "keys are obtained with '--sync data'" a "$(./mresource $F --sync data -t 1)"
+./mresource $F a --sync data
+check "keys are obtained with MRESOURCE_SYNC=group" a "$(MRESOURCE_SYNC=group ./mresource $F -t 1)"
+./mresource $F a
+./mresource $F --sync bogus -t 1 2>/dev/null
+check "an unknown mode is an argument error" 3 $?
+
+# Commands: 'FILE -- COMMAND' runs COMMAND with its keys in
+# MRESOURCE_KEYS, passes on its exit code, and releases the keys
+F=$CHECKDIR/command
+./mresource $F -c a b
+check "the command gets its keys and file" "a $F" \
+      "$(./mresource $F -t 1 -- sh -c 'echo $MRESOURCE_KEYS $MRESOURCE_FILE')"
+./mresource $F -t 1 -- sh -c 'exit 7'
+check "the exit code of the command is passed on" 7 $?
+check "its keys are released afterwards" "total 2 free 2 used 0" "$(./mresource $F -s)"
+check "the command does not inherit '--sync'" "-" \
+      "$(./mresource $F -t 1 --sync data -- sh -c 'echo ${MRESOURCE_SYNC:--}')"
+./mresource $F -t 1 --ttl 1ms -- sleep 0.2
+check "a short TTL is renewed at most every millisecond" "0 1" \
+      "$? $(( $(wc -l < $F.leases) < 250 ))"
+check "signals to mresource do not put renewals off" 4 \
+      "$(./mresource $F -n 2 --ttl 0.2 -- sh -c 'trap "" USR1
+         for i in 1 2 3 4 5 6 7 8; do kill -USR1 $PPID; sleep 0.05; done
+         ./mresource '$F' -t 0 2>/dev/null; echo $?')"
+
+# Lock-free obtains: keys are claimed by swapping their signal for a
+# '*' first; a claim left behind by a process that died in between is
+# freed again, as no claim can be in flight under a whole-file lock;
+# claims and releases with and without locks in an indexed file agree,
+# and a claim also tries the record lock, so it passes by keys that
+# processes with '-l' hold
+F=$CHECKDIR/atomic
+./mresource $F -c a b
+check "keys are obtained without locks" "a b" "$(echo $(./mresource $F -n 2 --atomic))"
+./mresource $F a b --atomic
+printf '*' | dd of=$F bs=1 count=1 conv=notrunc 2>/dev/null
+check "a key left claimed is freed again" "a b" "$(echo $(./mresource $F -n 2 -t 1 -p 0.05 --atomic))"
+F=$CHECKDIR/atomicindex
+./mresource $F -c -i k{1..8}
+mkdir $CHECKDIR/held
+for locking in --atomic --atomic --atomic --atomic "" ""; do
+    (for i in $(seq 40); do
+         key=$(./mresource $F $locking -t 5 -p 0.01) || continue
+         mkdir $CHECKDIR/held/$key 2>/dev/null || echo $key
+         rmdir $CHECKDIR/held/$key 2>/dev/null
+         ./mresource $F $key $locking
+     done) &
+done > $CHECKDIR/twice
+wait
+check "no key of an indexed file is handed out twice" "0 8 total 8 free 0 used 8" \
+      "$(wc -l < $CHECKDIR/twice) $(./mresource $F -n 8 -t 1 | sort -u | wc -l) $(./mresource $F -s)"
+F=$CHECKDIR/atomicmixed
+./mresource $F -c k{1..8}
+for locking in --atomic --atomic --atomic -l -l -l; do
+    (for i in $(seq 40); do
+         key=$(./mresource $F $locking -t 5 -p 0.01) || continue
+         mkdir $CHECKDIR/held/$key 2>/dev/null || echo $key
+         rmdir $CHECKDIR/held/$key 2>/dev/null
+         ./mresource $F $key $locking
+     done) &
+done > $CHECKDIR/twice
+wait
+check "no key is handed out twice with and without '-l'" "0 8" \
+      "$(wc -l < $CHECKDIR/twice) $(./mresource $F -n 8 -t 1 | sort -u | wc -l)"
+./mresource $F -l --atomic 2>/dev/null
+check "'-l' and '--atomic' cannot be given together" 3 $?
+
+rm -rf $CHECKDIR
+exit $FAILED